@@ -17,168 +17,267 @@
 XUsbEndpoint::XUsbEndpoint(const UsbEPDescriptor & descriptor,
 				 	 	   XUsbIface * iface) :
 		UsbEPDescriptor(descriptor),
+#ifndef XUSB_COMPACT_LAYOUT
 		_handle(nullptr),
-		_status(0),
+#endif
 		_iface(iface),
-		_opened(false)
+		_state(nullptr)
 {}
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-void XUsbEndpoint::reportStatus(XUsbZeroEndpoint * ep0)
+XUsbEndpoint::XUsbEndpoint(XUsbIface * iface,
+						   uint8_t address) :
+		UsbEPDescriptor(iface->findEP(address)),
+#ifndef XUSB_COMPACT_LAYOUT
+		_handle(nullptr),
+#endif
+		_iface(iface),
+		_state(nullptr)
 {
-	ep0->transmit(reinterpret_cast<uint8_t*>(&_status), 2);
+	assert(isValid());
+	iface->bindEP(*this);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-void XUsbZeroEndpoint::setupStage(uint8_t * pdata)
-{
-    _request.bmRequest     = *(uint8_t *)  (pdata);
-    _request.bRequest      = *(uint8_t *)  (pdata +  1);
-    _request.wValue        = SWAPBYTE      (pdata +  2);
-    _request.wIndex        = SWAPBYTE      (pdata +  4);
-    _request.wLength       = SWAPBYTE      (pdata +  6);
+#ifdef XUSB_COMPACT_LAYOUT
+void * XUsbEndpoint::_sharedHandle = nullptr;
+#endif
 
-    _state = EP0_SETUP;
-    _dataLength = _request.wLength;
+/////////////////////////////////////////////////////////////////////////////////////////
 
-    switch (_request.bmRequest & 0x1F)
-    {
-    case REQ_RECIPIENT_DEVICE:
-        stdDevReq(&_request);
-        break;
+void XUsbEndpoint::reportStatus(XUsbDevice * device)
+{
+	//! Ответ GET_STATUS берётся из flash, поле статуса в точке не нужно
+	static const uint8_t Status[2][2] = { { 0x00, 0x00 }, { 0x01, 0x00 } };
+	bool stalled = (_state != nullptr) && (_state->flags & XUsbEndpointState::STALLED);
+	device->ctlTransmit(const_cast<uint8_t*>(Status[stalled ? 1 : 0]), 2);
+}
 
-    case REQ_RECIPIENT_INTERFACE:
-        stdItfReq(&_request);
-        break;
+/////////////////////////////////////////////////////////////////////////////////////////
 
-    case REQ_RECIPIENT_ENDPOINT:
-        stdEPReq(&_request);
-        break;
+bool XUsbEndpoint::claimRequest(UsbReqType type, uint8_t bRequest)
+{
+	return (_iface != nullptr) && _iface->isInitialized() &&
+		   _iface->device()->claimRequest(type | REQ_RECIPIENT_ENDPOINT, bRequest,
+				   	   	   	   	   	   	  bEndpointAddress(), this);
+}
 
-    default:
-    	XUsbInEndpoint::stall();
-        break;
-    }
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void XUsbSofClock::clockReset(UsbSpeedClass speed)
+{
+	_period = 0;
+	_anchorCycles = 0;
+	_anchorFrac = 0;
+	_anchorSof = 0;
+	_lastCycles = 0;
+	_sofNs = (speed == UsbSpeed_High) ? 125000 : 1000000;
+	_error = 0;
+	_anchorFrame = 0;
+	_frameMask = (speed == UsbSpeed_High) ? 0x3FFF : 0x07FF;
+	_samples = 0;
+	_lockCount = 0;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-bool XUsbZeroEndpoint::epDataOut(uint8_t * pdata)
+void XUsbSofClock::clockUpdate(uint32_t sof, uint16_t frame, uint32_t cycles)
 {
-	if ( _state == EP0_DATA_OUT)
+	_lastCycles = cycles;
+	uint32_t frames = sof - _anchorSof;
+
+	//! Захват: первый SOF - опорная точка, второй - начальный период
+	if(_samples < 2)
 	{
-		if(_outRemLength > XUsbOutEndpoint::wMaxPacketSize())
+		if((_samples == 1) && (frames != 0) && (cycles != _anchorCycles))
 		{
-			_outRemLength -=  XUsbOutEndpoint::wMaxPacketSize();
-			XUsbOutEndpoint::receive(pdata, MIN(_outRemLength , XUsbOutEndpoint::wMaxPacketSize()));
+			_period = (int64_t(uint32_t(cycles - _anchorCycles)) << 16) / frames;
+			_samples = 2;
 		}
 		else
-		{
-			if(isDeviceConfigured())
-				ep0RxReady(&_request);
-			ctlSendStatus();
-		}
+			_samples = 1;
+		_anchorCycles = cycles;
+		_anchorFrac = 0;
+		_anchorSof = sof;
+		_anchorFrame = frame;
+		_lockCount = 0;
+		return;
 	}
-	return true;
-}
+	if(frames == 0)
+		return;
 
-/////////////////////////////////////////////////////////////////////////////////////////
+	int64_t predicted = _period * frames;
+	int64_t error = sinceAnchor(cycles) - predicted;
+	_error = int32_t(error >> 16);
 
-bool XUsbZeroEndpoint::epDataIn(uint8_t * pdata)
-{
-	if (_state == EP0_DATA_IN)
+	//! Ошибка больше 1/16 периода - сбой (остановка SOF, перезапуск генератора), захват заново
+	int64_t limit = _period >> 4;
+	if((error > limit) || (error < -limit))
 	{
-		if(_inRemLength > XUsbOutEndpoint::wMaxPacketSize())
-		{
-			_inRemLength -=  XUsbOutEndpoint::wMaxPacketSize();
-			XUsbInEndpoint::transmit(pdata, _inRemLength);
+		_samples = 0;
+		clockUpdate(sof, frame, cycles);
+		return;
+	}
 
-			/* Prepare endpoint for premature end of transfer */
-			XUsbOutEndpoint::receive(nullptr, 0);
-		}
-		else
-		{ /* last packet is MPS multiple, so send ZLP packet */
-			if((_inTotalLength % XUsbOutEndpoint::wMaxPacketSize() == 0) &&
-				(_inTotalLength >= XUsbOutEndpoint::wMaxPacketSize()) &&
-				(_inTotalLength < _dataLength ))
-			{
-				XUsbInEndpoint::transmit(nullptr, 0);
-				_dataLength = 0;
+	int64_t anchor = int64_t(_anchorFrac) + predicted + (error >> USB_SOF_PLL_KP_SHIFT);
+	_anchorCycles += uint32_t(anchor >> 16);
+	_anchorFrac = uint32_t(anchor & 0xFFFF);
+	_anchorSof = sof;
+	_anchorFrame = frame;
+	_period += (error / int32_t(frames)) >> USB_SOF_PLL_KI_SHIFT;
 
-				/* Prepare endpoint for premature end of transfer */
-				XUsbOutEndpoint::receive(nullptr, 0);
-			}
-			else
-			{
-				if(isDeviceConfigured())
-					ep0TxSent(&_request);
-				ctlReceiveStatus();
-			}
-		}
+	int64_t lockLimit = _period >> 8;
+	if((error < lockLimit) && (error > -lockLimit))
+	{
+		if(_lockCount < LockSamples)
+			++_lockCount;
 	}
+	else
+		_lockCount = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
 
-	//! @attention нужно этот код активировать на всякий случай
-	/*
-	if (_dev_test_mode == 1)
+XUsbSofClock::BusTime XUsbSofClock::busTime(uint32_t cycles) const
+{
+	BusTime time = { _anchorSof, _anchorFrame, 0 };
+	if(_samples < 2)
+		return time;
+
+	int64_t since = sinceAnchor(cycles);
+	int64_t sofs = since / _period;
+	int64_t rest = since - sofs * _period;
+	if(rest < 0)
 	{
-		runTestMode();
-		_dev_test_mode = 0;
+		--sofs;
+		rest += _period;
 	}
-	*/
 
-	return true;
+	time.sof = _anchorSof + uint32_t(sofs);
+	time.frame = uint16_t(_anchorFrame + sofs) & _frameMask;
+	time.ns = uint32_t(rest * _sofNs / _period);
+	return time;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-#define MAX_PACKET 64
-
 XUsbDevice::XUsbDevice(void * handle, bool selfPowered) :
-		XUsbZeroEndpoint(handle, MAX_PACKET),
-		_handle(handle),
+		ZeroEndpoint(handle, USB_MAX_EP0_SIZE),
 		_dev_test_mode(false),
 		_dev_old_state(DEV_DEFAULT),
 		_dev_state(DEV_DEFAULT),
 		_dev_address(0),
-	    _dev_config_status(selfPowered),
+	    _dev_config_status(selfPowered ? CONFIG_SELF_POWERED : 0),
 	    _dev_remote_wakeup(0),
-	    _dev_config(1)
+	    _dev_config(0),
+	    _dev_speed(UsbSpeed_Full),
+	    _dev_link(LINK_L0),
+	    _dev_besl(0),
+	    _dev_l1_remote_wakeup(false),
+	    _suspendTick(0),
+	    _wakeQueued(0),
+	    _wakeEp(0xFF),
+	    _wakeEventTick(0),
+	    _sofTasks(nullptr),
+	    _sofCount(0),
+	    _sofBudget(0),
+	    _sofLast(0),
+	    _sofSynced(false),
+	    _devDesc(_devDescData),
+	    _claimProbes(0),
+	    _descProbes(0),
+	    _numConfigs(0),
+	    _descFallback(DESC_FALLBACK_NEUTRAL),
+	    _arenaUsed(0),
+	    _ctlOwner(nullptr)
 {
-	for(int i = 0; i < UsbInterfaceDescriptor::MaxEndpoints; ++i)
+	for(int dir = EP_DIR_OUT; dir <= EP_DIR_IN; ++dir)
+		for(int i = 0; i < USB_MAX_ENDPOINTS; ++i)
+		{
+			_epStates[dir][i].endpoint = nullptr;
+			_epStates[dir][i].flags = 0;
+		}
+
+	_wakeStats.count = 0;
+	_wakeStats.lastResumeMs = 0;
+	_wakeStats.lastDeliveryMs = 0;
+	_wakeStats.maxDeliveryMs = 0;
+
+	XUsbPort::enableCycleCounter(handle);
+
+	_sofStats.frames = 0;
+	_sofStats.missed = 0;
+	_sofStats.deferred = 0;
+	_sofStats.maxCycles = 0;
+
+	_fifoRx = 0;
+	for(int i = 0; i < USB_MAX_ENDPOINTS; ++i)
+		_fifoTx[i] = 0;
+
+	//! Нулевая точка открывается при сбросе шины
+	_epStates[EP_DIR_IN][0].endpoint = static_cast<XUsbInEndpoint*>(this);
+	XUsbInEndpoint::bind(&_epStates[EP_DIR_IN][0]);
+	_epStates[EP_DIR_OUT][0].endpoint = static_cast<XUsbOutEndpoint*>(this);
+	XUsbOutEndpoint::bind(&_epStates[EP_DIR_OUT][0]);
+
+	for(int i = 0; i < USB_MAX_REQUEST_CLAIMS; ++i)
 	{
-		_inEndpoints[i] = nullptr;
-		_outEndpoints[i] = nullptr;
+		_claims[i].key = 0;
+		_claims[i].handler = nullptr;
 	}
 
-	_inEndpoints[0] = this;
-	_outEndpoints[0] = this;
+	clearDescriptors();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDevice::clearDescriptors()
+{
+	if(_dev_state == DEV_CONFIGURED)
+		return false;
 
 	for(int i = 0; i < USB_MAX_CONFIGS; ++i)
 		_configs[i] = nullptr;
+	_numConfigs = 0;
+
+	for(int i = 0; i < USB_MAX_DESCRIPTORS; ++i)
+	{
+		_descriptors[i].key = 0;
+		_descriptors[i].data = nullptr;
+		_descriptors[i].length = 0;
+		_descriptors[i].kind = DESC_NONE;
+	}
+	_descProbes = 0;
+
+	_devDesc = _devDescData;
+	_arenaUsed = 0;
 
-	static uint8_t strDesc0[4];
-	static const uint16_t LANGID = 0x0409;
-	_strings[0] = UsbStringDescriptor(0, strDesc0, 4);
-	_strings[0].init(&LANGID, 1);
+	//! LANGID 0x0409 (English US)
+	static const uint8_t strDesc0[4] = { 4, UsbDescType_String, 0x09, 0x04 };
+	return setDescriptor(UsbDescType_String, 0, 0, strDesc0, sizeof(strDesc0));
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
 XUsbDevice::~XUsbDevice()
 {
-	for(int i = 0; i < USB_MAX_STRINGS; ++i)
-		if(_strings[i].isValid())
-			delete[] _strings[i].data();
+#ifdef XUSB_COMPACT_LAYOUT
+	XUsbEndpoint::releaseHandle();
+#endif
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
 bool  XUsbDevice::dataOutStage(uint8_t epnum, uint8_t * pdata)
 {
-	if((epnum == 0) || (_dev_state == DEV_CONFIGURED))
-		return _outEndpoints[epnum]->epDataOut(pdata);
+	if(epnum == 0)
+		return ZeroEndpoint::epDataOut(pdata);
+	if((_dev_state == DEV_CONFIGURED) &&
+		(epnum < USB_MAX_ENDPOINTS) &&
+		(_epStates[EP_DIR_OUT][epnum].endpoint != nullptr))
+		return static_cast<XUsbOutEndpoint*>(_epStates[EP_DIR_OUT][epnum].endpoint)->epDataOut(pdata);
 	return false;
 }
 
@@ -186,8 +285,13 @@ bool  XUsbDevice::dataOutStage(uint8_t epnum, uint8_t * pdata)
 
 bool  XUsbDevice::dataInStage(uint8_t epnum, uint8_t * pdata)
 {
-	if((epnum == 0) || (_dev_state == DEV_CONFIGURED))
-		return _inEndpoints[epnum]->epDataIn(pdata);
+	if(epnum == 0)
+		return ZeroEndpoint::epDataIn(pdata);
+	noteWakeupDelivery(epnum);
+	if((_dev_state == DEV_CONFIGURED) &&
+		(epnum < USB_MAX_ENDPOINTS) &&
+		(_epStates[EP_DIR_IN][epnum].endpoint != nullptr))
+		return static_cast<XUsbInEndpoint*>(_epStates[EP_DIR_IN][epnum].endpoint)->epDataIn(pdata);
 	return false;
 }
 
@@ -195,286 +299,1120 @@ bool  XUsbDevice::dataInStage(uint8_t epnum, uint8_t * pdata)
 
 void  XUsbDevice::SOF()
 {
-	if(_dev_state == DEV_CONFIGURED)
+	//! Номер SOF по модулю 2^11 кадров или 2^14 микрокадров. Скачок номера -
+	//! пропущенные прерывания, их SOF тоже учитываются в счётчике. Повтор номера
+	//! считается одним SOF. Если порт номер не сообщает, он ведётся здесь.
+	uint32_t stamp = XUsbPort::cycles(handle());
+	uint16_t mask = (_dev_speed == UsbSpeed_High) ? 0x3FFF : 0x07FF;
+	bool numbered = XUsbPort::hasFrameNumber(handle());
+	uint16_t frame = numbered ? XUsbPort::frameNumber(handle()) : uint16_t((_sofLast + 1) & mask);
+	uint16_t delta = 1;
+	if(_sofSynced && numbered)
 	{
+		delta = uint16_t(frame - _sofLast) & mask;
+		if(delta == 0)
+			delta = 1;
+		_sofStats.missed += delta - 1;
 	}
+	_sofSynced = true;
+	_sofLast = frame;
+	_sofCount += delta;
+	++_sofStats.frames;
+	clockUpdate(_sofCount, frame, stamp);
+
+	if((_dev_state == DEV_CONFIGURED) && (_sofTasks != nullptr))
+		runSofTasks(frame);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void  XUsbDevice::runSofTasks(uint16_t frame)
+{
+	uint32_t start = XUsbPort::cycles(handle());
+	uint32_t now = start;
+	bool first = true;
+
+	while((_sofTasks != nullptr) && (int32_t(_sofTasks->_due - _sofCount) <= 0))
+	{
+		if(!first && (_sofBudget != 0) && (now - start >= _sofBudget))
+		{
+			++_sofStats.deferred;
+			break;
+		}
+		first = false;
+
+		//! Задача переставляется до вызова, чтобы могла снять себя из sofTick.
+		//! Пропущенные запуски не догоняются: следующий - в ближайший срок после текущего SOF.
+		XUsbSofTask * task = _sofTasks;
+		_sofTasks = task->_next;
+		task->_due += task->_period;
+		if(int32_t(task->_due - _sofCount) <= 0)
+			task->_due += task->_period * ((_sofCount - task->_due) / task->_period + 1);
+		insertSofTask(task);
+
+		task->sofTick(frame);
+
+		uint32_t end = XUsbPort::cycles(handle());
+		if(end - now > task->_worstCycles)
+			task->_worstCycles = end - now;
+		now = end;
+	}
+
+	if(now - start > _sofStats.maxCycles)
+		_sofStats.maxCycles = now - start;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void  XUsbDevice::addSofTask(XUsbSofTask * task, uint16_t phase)
+{
+	if(task->_scheduled)
+		removeSofTask(task);
+	task->_due = _sofCount + 1 + phase;
+	task->_scheduled = true;
+	insertSofTask(task);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void  XUsbDevice::removeSofTask(XUsbSofTask * task)
+{
+	//! Голова списка - член упакованного класса, поэтому без указателя на указатель
+	if(_sofTasks == task)
+		_sofTasks = task->_next;
+	else
+	{
+		for(XUsbSofTask * prev = _sofTasks; prev != nullptr; prev = prev->_next)
+		{
+			if(prev->_next == task)
+			{
+				prev->_next = task->_next;
+				break;
+			}
+		}
+	}
+	task->_next = nullptr;
+	task->_scheduled = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void  XUsbDevice::insertSofTask(XUsbSofTask * task)
+{
+	if((_sofTasks == nullptr) || (int32_t(_sofTasks->_due - task->_due) > 0))
+	{
+		task->_next = _sofTasks;
+		_sofTasks = task;
+		return;
+	}
+
+	XUsbSofTask * prev = _sofTasks;
+	while((prev->_next != nullptr) && (int32_t(prev->_next->_due - task->_due) <= 0))
+		prev = prev->_next;
+	task->_next = prev->_next;
+	prev->_next = task;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void  XUsbDevice::clearSofTasks()
+{
+	while(_sofTasks != nullptr)
+		removeSofTask(_sofTasks);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
 void  XUsbDevice::suspend()
 {
-	_dev_old_state =  _dev_state;
-	_dev_state  = DEV_SUSPENDED;
+	//! Повторное прерывание suspend не должно затереть сохранённое состояние
+	if(_dev_state != DEV_SUSPENDED)
+	{
+		_dev_old_state =  _dev_state;
+		_dev_state  = DEV_SUSPENDED;
+		_suspendTick = XUsbPort::ticks(handle());
+	}
+	_dev_link = LINK_L2;
+	linkChanged(LINK_L2);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
 void  XUsbDevice::resume()
 {
-	_dev_state = _dev_old_state;
+	if(_dev_state == DEV_SUSPENDED)
+		_dev_state = _dev_old_state;
+	if(_dev_link != LINK_L0)
+	{
+		_dev_link = LINK_L0;
+		linkChanged(LINK_L0);
+	}
+	flushWakeupQueue();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void  XUsbDevice::lpmSleep(uint8_t besl, bool remoteWake)
+{
+	//! В L1 устройство остаётся в своём состоянии (адрес, конфигурация),
+	//! меняется только линия
+	_dev_besl = besl & 0x0F;
+	_dev_l1_remote_wakeup = remoteWake;
+	_dev_link = LINK_L1;
+	linkChanged(LINK_L1);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void  XUsbDevice::lpmWake()
+{
+	if(_dev_link == LINK_L1)
+	{
+		_dev_link = LINK_L0;
+		linkChanged(LINK_L0);
+	}
+	flushWakeupQueue();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+bool  XUsbDevice::remoteWakeup()
+{
+	if(_dev_link == LINK_L0)
+		return true;
+	if(!isRemoteWakeupEnabled())
+		return false;
+
+	//! Состояние линии и очередь меняет и прерывание USB (resume, LPM),
+	//! поэтому здесь они меняются только при запрещённых прерываниях
+	uint32_t state = XUsbPort::lock(handle());
+	if(_wakeQueued == 0)
+		_wakeEventTick = XUsbPort::ticks(handle());
+
+	if(_dev_link == LINK_L1)
+	{
+		//! Из L1 контроллер сам снимает сигнал через 50 мкс (TL1DevDrvResume)
+		XUsbPort::remoteWakeupSignal(handle(), true);
+		++_wakeStats.count;
+		_wakeStats.lastResumeMs = uint16_t(XUsbPort::ticks(handle()) - _wakeEventTick);
+		lpmWake();
+		XUsbPort::unlock(handle(), state);
+		return true;
+	}
+	XUsbPort::unlock(handle(), state);
+
+	//! Suspend наступает после 3 мс простоя, сигнал допустим после 5 мс.
+	//! Лишняя миллисекунда - на дискретность счётчика.
+	uint32_t idle = XUsbPort::ticks(handle()) - _suspendTick;
+	if(idle < 3)
+		XUsbPort::delay(handle(), 3 - idle);
+
+	//! За время ожидания хост мог сам вывести шину из suspend:
+	//! сигнал resume в L0 недопустим
+	state = XUsbPort::lock(handle());
+	if(_dev_link == LINK_L0)
+	{
+		XUsbPort::unlock(handle(), state);
+		return true;
+	}
+	XUsbPort::remoteWakeupSignal(handle(), true);
+	XUsbPort::unlock(handle(), state);
+	XUsbPort::delay(handle(), USB_REMOTE_WAKEUP_MS);
+	XUsbPort::remoteWakeupSignal(handle(), false);
+
+	//! Дальше resume ведёт хост, прерывания о нём контроллер не выдаёт
+	state = XUsbPort::lock(handle());
+	++_wakeStats.count;
+	_wakeStats.lastResumeMs = uint16_t(XUsbPort::ticks(handle()) - _wakeEventTick);
+	resume();
+	XUsbPort::unlock(handle(), state);
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+bool  XUsbDevice::wakeupTransmit(XUsbInEndpoint * ep, uint8_t * pbuf, uint16_t size)
+{
+	//! Проверка линии и запись в очередь неделимы относительно прерывания
+	//! resume: оно либо уже перевело линию в L0, либо увидит запись
+	uint32_t state = XUsbPort::lock(handle());
+	if(_dev_link == LINK_L0)
+	{
+		bool configured = (_dev_state == DEV_CONFIGURED);
+		if(configured)
+			ep->transmit(pbuf, size);
+		XUsbPort::unlock(handle(), state);
+		return configured;
+	}
+
+	if((_wakeQueued >= USB_MAX_WAKEUP_QUEUE) || !isRemoteWakeupEnabled())
+	{
+		XUsbPort::unlock(handle(), state);
+		return false;
+	}
+
+	uint8_t slot = _wakeQueued;
+	if(slot == 0)
+		_wakeEventTick = XUsbPort::ticks(handle());
+	_wakeQueue[slot].ep = ep;
+	_wakeQueue[slot].data = pbuf;
+	_wakeQueue[slot].size = size;
+	++_wakeQueued;
+	XUsbPort::unlock(handle(), state);
+
+	//! Очередь отправляется при выходе в L0: в remoteWakeup() или в прерывании resume
+	if(remoteWakeup())
+		return true;
+
+	//! Линия успела смениться и пробуждение запрещено: передача снимается,
+	//! если её ещё не отправил resume
+	state = XUsbPort::lock(handle());
+	bool pending = (_wakeQueued == slot + 1) && (_wakeQueue[slot].data == pbuf);
+	if(pending)
+		--_wakeQueued;
+	XUsbPort::unlock(handle(), state);
+	return !pending;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void  XUsbDevice::flushWakeupQueue()
+{
+	//! Вызывается при выходе в L0 (прерывание resume или remoteWakeup()),
+	//! после него очередь до следующего сна не пополняется
+	uint32_t state = XUsbPort::lock(handle());
+	if((_wakeQueued != 0) && (_dev_state == DEV_CONFIGURED))
+	{
+		_wakeEp = _wakeQueue[0].ep->address() & 0x7F;
+		for(uint8_t i = 0; i < _wakeQueued; ++i)
+			_wakeQueue[i].ep->transmit(_wakeQueue[i].data, _wakeQueue[i].size);
+		_wakeQueued = 0;
+	}
+	XUsbPort::unlock(handle(), state);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-void  XUsbDevice::isoOutIncomplete(uint8_t epnum)
+void  XUsbDevice::wakeupDelivered()
 {
-	//_outEndpoints[epnum & 0x7F]->isoOutIncomplete();
+	_wakeEp = 0xFF;
+	uint16_t latency = uint16_t(XUsbPort::ticks(handle()) - _wakeEventTick);
+	_wakeStats.lastDeliveryMs = latency;
+	if(latency > _wakeStats.maxDeliveryMs)
+		_wakeStats.maxDeliveryMs = latency;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void XUsbDevice::isoOutIncomplete(uint8_t epnum)
+{
+	epnum &= 0x7F;
+	if((_dev_state != DEV_CONFIGURED) || (epnum == 0) || (epnum >= USB_MAX_ENDPOINTS))
+		return;
+	const XUsbEndpointState & state = _epStates[EP_DIR_OUT][epnum];
+	if((state.endpoint != nullptr) && (state.type == UsbEPType_Isochronous))
+		static_cast<XUsbOutEndpoint*>(state.endpoint)->isoIncomplete(XUsbPort::frameNumber(handle()));
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
 void XUsbDevice::isoInIncomplete(uint8_t epnum)
 {
-	//_inEndpoints[epnum & 0x7F]->isoInIncomplete();
+	epnum &= 0x7F;
+	if((_dev_state != DEV_CONFIGURED) || (epnum == 0) || (epnum >= USB_MAX_ENDPOINTS))
+		return;
+	const XUsbEndpointState & state = _epStates[EP_DIR_IN][epnum];
+	if((state.endpoint != nullptr) && (state.type == UsbEPType_Isochronous))
+		static_cast<XUsbInEndpoint*>(state.endpoint)->isoIncomplete(XUsbPort::frameNumber(handle()));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Слов FIFO под микрокадр точки (с дополнительными транзакциями high-bandwidth)
+static inline uint16_t fifoPacketWords(const XUsbEndpointState & state)
+{
+	return uint16_t((uint32_t(state.maxPacket) * state.transactions + 3) / 4);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Учитывает в плане FIFO точку альтернативной настройки, ещё не привязанную к устройству
+static inline void reserveAltFifo(const UsbEPDescriptor * ep,
+								  UsbSpeedClass native,
+								  UsbSpeedClass speed,
+								  uint16_t & words,
+								  bool & used,
+								  bool & bulk)
+{
+	if(ep == nullptr)
+		return;
+	uint8_t type = ep->bmAttributes() & UsbEPTypeMask;
+	uint16_t maxPacket = UsbEPDescriptor::speedMaxPacket(type, ep->wMaxPacketSize(), native, speed);
+	uint16_t packetWords = uint16_t((uint32_t(maxPacket & 0x07FF) * (((maxPacket >> 11) & 0x03) + 1) + 3) / 4);
+	if(packetWords > words)
+		words = packetWords;
+	used = true;
+	bulk = bulk || (type == UsbEPType_Bulk);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+uint16_t XUsbDevice::rxFifoWords() const
+{
+	//! Наибольший OUT-пакет всех конфигураций и их альтернативных настроек
+	//! на скорости шины: выбор конфигурации RX FIFO не меняет
+	uint16_t words[USB_MAX_ENDPOINTS];
+	bool used[USB_MAX_ENDPOINTS];
+	for(int epnum = 0; epnum < USB_MAX_ENDPOINTS; ++epnum)
+	{
+		words[epnum] = 0;
+		used[epnum] = false;
+	}
+	words[0] = fifoPacketWords(_epStates[EP_DIR_OUT][0]);
+	used[0] = true;
+
+	for(int cfg = 0; cfg < USB_MAX_CONFIGS; ++cfg)
+	{
+		const XUsbConfiguration * config = _configs[cfg];
+		for(int i = 0; (config != nullptr) && (i < USB_MAX_IFACES); ++i)
+		{
+			const XUsbIface * iface = config->iface(i);
+			for(int alt = 0; (iface != nullptr) && (alt < USB_MAX_ALT_SETTINGS); ++alt)
+			{
+				const UsbInterfaceDescriptor * setting = iface->altSetting(alt);
+				for(int epnum = 1; (setting != nullptr) && (epnum < USB_MAX_ENDPOINTS); ++epnum)
+				{
+					bool bulk = false;
+					reserveAltFifo(setting->getOutEndpoint(epnum), config->speed(), _dev_speed,
+								   words[epnum], used[epnum], bulk);
+				}
+			}
+		}
+	}
+
+	uint16_t largestOut = 0;
+	uint8_t numOut = 0;
+	for(int epnum = 0; epnum < USB_MAX_ENDPOINTS; ++epnum)
+	{
+		if(!used[epnum])
+			continue;
+		++numOut;
+		if(words[epnum] > largestOut)
+			largestOut = words[epnum];
+	}
+
+	//! Общий RX FIFO (RM0090, "FIFO RAM allocation"): 5 * число control-точек + 8
+	//! под SETUP, наибольший пакет со словом статуса, по 2 слова на OUT-точку
+	//! и слово под глобальный NAK
+	return uint16_t((5 * 1 + 8) + (largestOut + 1) + 2 * numOut + 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDevice::planFifos()
+{
+	//! Наибольший пакет каждой точки по всем альтернативным настройкам интерфейсов
+	//! конфигурации: SET_INTERFACE открывает точки без перераспределения FIFO
+	uint16_t words[USB_MAX_ENDPOINTS];
+	bool used[USB_MAX_ENDPOINTS];
+	bool bulk[USB_MAX_ENDPOINTS];
+	for(int epnum = 0; epnum < USB_MAX_ENDPOINTS; ++epnum)
+	{
+		const XUsbEndpointState & state = _epStates[EP_DIR_IN][epnum];
+		used[epnum] = (state.endpoint != nullptr);
+		words[epnum] = used[epnum] ? fifoPacketWords(state) : 0;
+		bulk[epnum] = used[epnum] && (state.type == UsbEPType_Bulk);
+	}
+
+	if((_dev_state == DEV_CONFIGURED) && (_configs[_dev_config] != nullptr))
+	{
+		const XUsbConfiguration * config = _configs[_dev_config];
+		for(int i = 0; i < USB_MAX_IFACES; ++i)
+		{
+			const XUsbIface * iface = config->iface(i);
+			if((iface == nullptr) || !iface->isInitialized())
+				continue;
+			for(int alt = 1; alt < USB_MAX_ALT_SETTINGS; ++alt)
+			{
+				const UsbInterfaceDescriptor * setting = iface->altSetting(alt);
+				for(int epnum = 1; (setting != nullptr) && (epnum < USB_MAX_ENDPOINTS); ++epnum)
+					reserveAltFifo(setting->getInEndpoint(epnum), config->speed(), _dev_speed,
+								   words[epnum], used[epnum], bulk[epnum]);
+			}
+		}
+	}
+
+	//! RX FIFO размечен при сбросе шины, конфигурация, добавленная позже,
+	//! в него может не поместиться
+	if(rxFifoWords() > _fifoRx)
+		return false;
+
+	//! RX FIFO и FIFO нулевой точки не меняются,
+	//! если двойная буферизация bulk не помещается - второй проход без неё
+	uint16_t budget = XUsbPort::fifoWords(handle());
+	for(int pass = 0; pass < 2; ++pass)
+	{
+		uint16_t total = _fifoRx + _fifoTx[0];
+		for(int epnum = 1; epnum < USB_MAX_ENDPOINTS; ++epnum)
+		{
+			uint16_t depth = 0;
+			if(used[epnum])
+			{
+				depth = words[epnum];
+				if((pass == 0) && bulk[epnum])
+					depth *= 2;
+				if(depth < 16)
+					depth = 16;
+			}
+			_fifoTx[epnum] = depth;
+			total += depth;
+		}
+
+		if(total <= budget)
+			return true;
+	}
+
+	return false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDevice::adaptEndpoint(XUsbEndpointState & state)
+{
+	//! Точки описаны для скорости конфигурации, пакеты - для скорости шины
+	UsbSpeedClass native = _dev_speed;
+	if((_dev_config < USB_MAX_CONFIGS) && (_configs[_dev_config] != nullptr))
+		native = _configs[_dev_config]->speed();
+	uint16_t maxPacket = UsbEPDescriptor::speedMaxPacket(state.type, state.endpoint->wMaxPacketSize(),
+														 native, _dev_speed);
+	uint8_t transactions = uint8_t(((maxPacket >> 11) & 0x03) + 1);
+	if(uint32_t(maxPacket & 0x07FF) * transactions > state.endpoint->capacity(_dev_speed))
+		return false;
+
+	state.maxPacket = maxPacket & 0x07FF;
+	state.transactions = transactions;
+	state.interval = UsbEPDescriptor::speedInterval(state.type, state.endpoint->bInterval(),
+													native, _dev_speed);
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDevice::openEndpoints()
+{
+	for(int dir = EP_DIR_OUT; dir <= EP_DIR_IN; ++dir)
+		for(int epnum = 1; epnum < USB_MAX_ENDPOINTS; ++epnum)
+			if((_epStates[dir][epnum].endpoint != nullptr) && !adaptEndpoint(_epStates[dir][epnum]))
+				return false;
+
+	if(!planFifos())
+		return false;
+
+	XUsbPort::setTxFifos(handle(), _fifoTx, USB_MAX_ENDPOINTS);
+
+	for(int dir = EP_DIR_OUT; dir <= EP_DIR_IN; ++dir)
+		for(int epnum = 0; epnum < USB_MAX_ENDPOINTS; ++epnum)
+			if(_epStates[dir][epnum].endpoint != nullptr)
+				_epStates[dir][epnum].endpoint->open();
+
+	return true;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
 void XUsbDevice::reset()
 {
-    /* Open EP0 OUT */
-	_inEndpoints[0]->open();
+	//! Интерфейсы снимаются до закрытия точек, чтобы успеть остановить потоки на них
+	if((_dev_config < USB_MAX_CONFIGS) && (_configs[_dev_config] != nullptr))
+		_configs[_dev_config]->deInit();
+	_dev_config = 0;
 
-    /* Open EP0 IN */
-	_outEndpoints[0]->open();
+	//! Сброс шины деактивирует все точки в контроллере
+	for(int epnum = 1; epnum < USB_MAX_ENDPOINTS; ++epnum)
+	{
+		bindEndpoint(EP_DIR_IN, epnum, nullptr);
+		bindEndpoint(EP_DIR_OUT, epnum, nullptr);
+	}
+	_epStates[EP_DIR_IN][0].flags = 0;
+	_epStates[EP_DIR_OUT][0].flags = 0;
+
+	//! Скорость известна после сброса. На high-speed пакет нулевой точки -
+	//! 64 байта, на full-speed - bMaxPacketSize0 дескриптора устройства.
+	_dev_speed = XUsbPort::isHighSpeed(handle()) ? UsbSpeed_High : UsbSpeed_Full;
+	uint8_t ep0Packet = USB_MAX_EP0_SIZE;
+	const DescEntry * device = findDescriptor(descKey(UsbDescType_Device, 0, 0));
+	if(_dev_speed == UsbSpeed_High)
+		ep0Packet = 64;
+	else if((device != nullptr) && (device->kind == DESC_DATA))
+		ep0Packet = device->data[7];
+	if(ep0Packet > USB_MAX_EP0_SIZE)
+		ep0Packet = USB_MAX_EP0_SIZE;
+	_epStates[EP_DIR_IN][0].maxPacket = ep0Packet;
+	_epStates[EP_DIR_OUT][0].maxPacket = ep0Packet;
+
+	//! RX FIFO и FIFO нулевой точки программируются только здесь: SET_CONFIGURATION
+	//! перераспределяет FIFO остальных точек, не трогая ожидающий статус нулевой.
+	//! Минимальная глубина TX FIFO - 16 слов.
+	_fifoRx = rxFifoWords();
+	_fifoTx[0] = fifoPacketWords(_epStates[EP_DIR_IN][0]);
+	if(_fifoTx[0] < 16)
+		_fifoTx[0] = 16;
+	XUsbPort::setFifos(handle(), _fifoRx, _fifoTx[0]);
+
+    /* Open EP0 IN and OUT */
+	openEndpoints();
 
     /* Upon Reset call user call back */
     _dev_state = DEV_DEFAULT;
-
-    _configs[_dev_config]->deInit();
+    _dev_link = LINK_L0;
+    _dev_remote_wakeup = 0;
+    _wakeQueued = 0;
+    _wakeEp = 0xFF;
+    _sofSynced = false;
+    clockReset(_dev_speed);
+    clearSofTasks();
     //resetEvent();
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-void  XUsbDevice::stdDevReq(UsbSetupRequest * req)
+const XUsbDevice::StdRequest XUsbDevice::StdRequests[REQ_RECIPIENT_ENDPOINT + 1][REQ_SYNCH_FRAME + 1] =
 {
-    switch (req->bRequest) {
-    case REQ_GET_DESCRIPTOR:
-        getDescriptor (req);
-        break;
+	/* REQ_RECIPIENT_DEVICE */
+	{
+		&XUsbDevice::getStatus,			/* REQ_GET_STATUS */
+		&XUsbDevice::clrFeature,		/* REQ_CLEAR_FEATURE */
+		nullptr,
+		&XUsbDevice::setFeature,		/* REQ_SET_FEATURE */
+		nullptr,
+		&XUsbDevice::setAddress,		/* REQ_SET_ADDRESS */
+		&XUsbDevice::getDescriptor,		/* REQ_GET_DESCRIPTOR */
+		nullptr,						/* REQ_SET_DESCRIPTOR */
+		&XUsbDevice::getConfig,			/* REQ_GET_CONFIGURATION */
+		&XUsbDevice::setConfig,			/* REQ_SET_CONFIGURATION */
+		nullptr,
+		nullptr,
+		nullptr
+	},
+
+	/* REQ_RECIPIENT_INTERFACE */
+	{
+		&XUsbDevice::getItfStatus,		/* REQ_GET_STATUS */
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		&XUsbDevice::getItfDescriptor,	/* REQ_GET_DESCRIPTOR */
+		nullptr,
+		nullptr,
+		nullptr,
+		&XUsbDevice::getInterface,		/* REQ_GET_INTERFACE */
+		&XUsbDevice::setInterface,		/* REQ_SET_INTERFACE */
+		nullptr
+	},
+
+	/* REQ_RECIPIENT_ENDPOINT */
+	{
+		&XUsbDevice::getEPStatus,		/* REQ_GET_STATUS */
+		&XUsbDevice::clrEPFeature,		/* REQ_CLEAR_FEATURE */
+		nullptr,
+		&XUsbDevice::setEPFeature,		/* REQ_SET_FEATURE */
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr							/* REQ_SYNCH_FRAME */
+	}
+};
 
-    case REQ_SET_ADDRESS:
-        setAddress(req);
-        break;
+/////////////////////////////////////////////////////////////////////////////////////////
 
-    case REQ_SET_CONFIGURATION:
-        setConfig (req);
-        break;
+void XUsbDevice::dispatchRequest(UsbSetupRequest * req)
+{
+	uint8_t recipient = req->bmRequest & 0x1F;
+	uint8_t type = req->bmRequest & REQ_TYPE_MASK;
 
-    case REQ_GET_CONFIGURATION:
-        getConfig (req);
-        break;
+	_ctlOwner = nullptr;
 
-    case REQ_GET_STATUS:
-        getStatus (req);
-        break;
+	if(recipient > REQ_RECIPIENT_ENDPOINT)
+	{
+		ctlError();
+		return;
+	}
 
-    case REQ_SET_FEATURE:
-        setFeature (req);
-        break;
+	if(type == REQ_TYPE_STANDARD)
+	{
+		StdRequest handler = (req->bRequest <= REQ_SYNCH_FRAME) ?
+							 StdRequests[recipient][req->bRequest] : nullptr;
+		if(handler != nullptr)
+			(this->*handler)(req);
+		else
+			ctlError();
+		return;
+	}
 
-    case REQ_CLEAR_FEATURE:
-        clrFeature (req);
-        break;
+	//! Запросы к интерфейсам и точкам принимаются только в сконфигурированном состоянии
+	if((recipient != REQ_RECIPIENT_DEVICE) && (_dev_state != DEV_CONFIGURED))
+	{
+		ctlError();
+		return;
+	}
 
-    default:
-        ctlError();
-        break;
-    }
+	XUsbRequestHandler * handler = findClaim(req);
+
+	//! Незакреплённые запросы класса направляются интерфейсу или точке по wIndex
+	if((handler == nullptr) && (type == REQ_TYPE_CLASS))
+	{
+		if(recipient == REQ_RECIPIENT_INTERFACE)
+			handler = _configs[_dev_config]->iface(LOBYTE(req->wIndex));
+		else if(recipient == REQ_RECIPIENT_ENDPOINT)
+			handler = findEndpoint(LOBYTE(req->wIndex));
+	}
+
+	delegateRequest(handler, req);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-void  XUsbDevice::stdItfReq(UsbSetupRequest * req)
+void XUsbDevice::delegateRequest(XUsbRequestHandler * handler, UsbSetupRequest * req)
 {
-	static uint8_t ifalt = 0;
-    bool ret = true;
+	_ctlOwner = handler;
+	if((handler == nullptr) || !handler->setupRequest(req))
+	{
+		_ctlOwner = nullptr;
+		ctlError();
+		return;
+	}
 
-    switch (_dev_state)
-    {
-    case DEV_CONFIGURED:
-    {
-    	switch (req->bmRequest & REQ_TYPE_MASK)
-        {
-        case REQ_TYPE_CLASS :
-        {
-        	if(!_configs[_dev_config]->setupRequest(LOBYTE(req->wIndex), req))
-        		ctlError();
-        	break;
-        }
+	if(req->wLength == 0)
+		ctlSendStatus();
+}
 
-        case REQ_TYPE_STANDARD:
-        {
-        	switch (req->bRequest)
-        	{
-        	case REQ_GET_INTERFACE :
-        		ctlTransmit(&ifalt, 1);
-        		break;
-
-        	case REQ_SET_INTERFACE :
-        	{
-        		break;
-        	}
-        	}
-        }
-        }
+/////////////////////////////////////////////////////////////////////////////////////////
 
-        if((req->wLength == 0) && ret)
-        	ctlSendStatus();
+XUsbRequestHandler * XUsbDevice::findClaim(const UsbSetupRequest * req) const
+{
+	uint32_t key = claimKey(req->bmRequest, req->bRequest, LOBYTE(req->wIndex));
+	uint8_t slot = claimSlot(key);
 
-        break;
-    }
+	for(uint8_t probe = 0; probe < _claimProbes; ++probe)
+	{
+		const RequestClaim & claim = _claims[(slot + probe) & (USB_MAX_REQUEST_CLAIMS - 1)];
+		if((claim.handler != nullptr) && (claim.key == key))
+			return claim.handler;
+	}
+	return nullptr;
+}
 
-    default:
-        ctlError();
-        break;
-    }
+/////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDevice::claimRequest(uint8_t bmRequestType,
+							  uint8_t bRequest,
+							  uint8_t index,
+							  XUsbRequestHandler * handler)
+{
+	//! Стандартные запросы обрабатывает само устройство
+	if(((bmRequestType & REQ_TYPE_MASK) == REQ_TYPE_STANDARD) ||
+		((bmRequestType & 0x1F) > REQ_RECIPIENT_ENDPOINT))
+		return false;
+
+	uint32_t key = claimKey(bmRequestType, bRequest, index);
+	uint8_t slot = claimSlot(key);
+	RequestClaim * free = nullptr;
+	uint8_t freeProbe = 0;
+
+	for(uint8_t probe = 0; probe < USB_MAX_REQUEST_CLAIMS; ++probe)
+	{
+		RequestClaim & claim = _claims[(slot + probe) & (USB_MAX_REQUEST_CLAIMS - 1)];
+		if(claim.handler == nullptr)
+		{
+			if(free == nullptr)
+			{
+				free = &claim;
+				freeProbe = probe;
+			}
+		}
+		else if(claim.key == key)
+		{
+			claim.handler = handler;
+			return true;
+		}
+	}
+
+	if(handler == nullptr)
+		return true;
+
+	if(free == nullptr)
+		return false;
+
+	free->key = key;
+	free->handler = handler;
+
+	//! Поиск никогда не просматривает больше _claimProbes ячеек
+	if(freeProbe >= _claimProbes)
+		_claimProbes = freeProbe + 1;
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void XUsbDevice::releaseRequests(XUsbRequestHandler * handler)
+{
+	for(int i = 0; i < USB_MAX_REQUEST_CLAIMS; ++i)
+		if(_claims[i].handler == handler)
+			_claims[i].handler = nullptr;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+XUsbEndpoint * XUsbDevice::findEndpoint(uint8_t ep_addr) const
+{
+	uint8_t epnum = ep_addr & 0x7F;
+	if(epnum >= USB_MAX_ENDPOINTS)
+		return nullptr;
+
+	return _epStates[(ep_addr & 0x80) ? EP_DIR_IN : EP_DIR_OUT][epnum].endpoint;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+XUsbEndpoint * XUsbDevice::stdEndpoint(UsbSetupRequest * req) const
+{
+	uint8_t ep_addr = LOBYTE(req->wIndex);
+
+	switch(_dev_state)
+	{
+	case DEV_ADDRESSED:
+		//! До конфигурации доступна только нулевая точка
+		return ((ep_addr & 0x7F) == 0) ? findEndpoint(ep_addr) : nullptr;
+
+	case DEV_CONFIGURED:
+		return findEndpoint(ep_addr);
+
+	default:
+		return nullptr;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void XUsbDevice::getEPStatus(UsbSetupRequest * req)
+{
+	if(XUsbEndpoint * ep = stdEndpoint(req))
+		ep->reportStatus(this);
+	else
+		ctlError();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void XUsbDevice::setEPFeature(UsbSetupRequest * req)
+{
+	XUsbEndpoint * ep = stdEndpoint(req);
+	if(ep == nullptr)
+	{
+		ctlError();
+		return;
+	}
+
+	if((req->wValue == UsbFeature_EP_HALT) &&
+		((ep->address() & 0x7F) != 0x00))
+		ep->stall();
+
+	ctlSendStatus();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void XUsbDevice::clrEPFeature(UsbSetupRequest * req)
+{
+	XUsbEndpoint * ep = stdEndpoint(req);
+	if(ep == nullptr)
+	{
+		ctlError();
+		return;
+	}
+
+	if((req->wValue == UsbFeature_EP_HALT) &&
+		((ep->address() & 0x7F) != 0x00))
+		ep->clearStall();
+
+	ctlSendStatus();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void XUsbDevice::getItfStatus(UsbSetupRequest * req)
+{
+	static const uint8_t itfStatus[2] = { 0, 0 };
+
+	if((_dev_state != DEV_CONFIGURED) ||
+		(_configs[_dev_config]->iface(LOBYTE(req->wIndex)) == nullptr) ||
+		(req->wLength != 2))
+		ctlError();
+	else
+		ctlTransmit(const_cast<uint8_t*>(itfStatus), 2);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void XUsbDevice::getItfDescriptor(UsbSetupRequest * req)
+{
+	//! Дескрипторы класса (HID, report) отдаёт интерфейс из wIndex
+	XUsbIface * iface = (_dev_state == DEV_CONFIGURED) ? _configs[_dev_config]->iface(LOBYTE(req->wIndex)) : nullptr;
+
+	if((iface == nullptr) || !iface->isInitialized())
+		ctlError();
+	else
+		delegateRequest(iface, req);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-void  XUsbDevice::stdEPReq(UsbSetupRequest * req)
+void XUsbDevice::getInterface(UsbSetupRequest * req)
 {
-    uint8_t ep_addr  = LOBYTE(req->wIndex);
-
-    XUsbEndpoint * ep;
-    if(ep_addr & 0x80)
-    	ep = _inEndpoints[ep_addr & 0x7F];
-    else
-    	ep = _outEndpoints[ep_addr & 0x7F];
+	XUsbIface * iface = (_dev_state == DEV_CONFIGURED) ? _configs[_dev_config]->iface(LOBYTE(req->wIndex)) : nullptr;
 
-    if ((req->bmRequest & 0x60) == 0x20)
-    {
-    	ep->setupRequest(req);
-    	return;
-    }
+	if((iface == nullptr) || !iface->isInitialized() || (req->wLength != 1))
+		ctlError();
+	else
+		ctlTransmit(&iface->_alt, 1);
+}
 
-    switch(_dev_state)
-    {
-    case DEV_ADDRESSED :
-    {
-    	if ((ep_addr != 0x00) && (ep_addr != 0x80))
-    		ep->stall();
-    	return;
-    }
+/////////////////////////////////////////////////////////////////////////////////////////
 
-    case DEV_CONFIGURED :
-    {
-    	switch (req->bRequest)
-    	{
-    	case REQ_SET_FEATURE :
-    	{
-    		if ((req->wValue == UsbFeature_EP_HALT) &&
-    			(ep_addr != 0x00) && (ep_addr != 0x80))
-    				ep->stall();
+void XUsbDevice::setInterface(UsbSetupRequest * req)
+{
+	XUsbIface * iface = (_dev_state == DEV_CONFIGURED) ? _configs[_dev_config]->iface(LOBYTE(req->wIndex)) : nullptr;
 
-    		ctlSendStatus();
-    		break;
-    	}
+	if((iface == nullptr) || !iface->isInitialized() || !selectAlternate(iface, LOBYTE(req->wValue)))
+		ctlError();
+	else
+		ctlSendStatus();
+}
 
-    	case REQ_CLEAR_FEATURE :
-    	{
-    		if ((req->wValue == UsbFeature_EP_HALT) &&
-    			((ep_addr & 0x7F) != 0x00))
-    			ep->clearStall();
+/////////////////////////////////////////////////////////////////////////////////////////
 
-    		ctlSendStatus();
-    		break;
-    	}
+bool XUsbDevice::selectAlternate(XUsbIface * iface, uint8_t alt)
+{
+	const XUsbConfiguration * config = _configs[_dev_config];
+	if(iface->altSetting(alt) == nullptr)
+		return false;
+
+	//! Полоса зарезервирована под наибольшую нагрузку настроек интерфейса
+	//! (XUsbConfiguration::periodicRemaining), любая настройка в неё укладывается
+	if(config->periodicRemaining(_dev_speed) < 0)
+		return false;
+
+	//! Точки остальных интерфейсов и FIFO не затрагиваются: FIFO разбито
+	//! под наибольшие пакеты всех настроек (planFifos). Повторный выбор
+	//! текущей настройки тоже переоткрывает точки - сбрасывает DATA0 и STALL.
+	uint8_t previous = iface->_alt;
+	iface->altDeselected(previous);
+	iface->bindAlternate(false);
+	iface->_alt = alt;
+	if(!iface->bindAlternate(true) || !openIfaceEndpoints(iface))
+	{
+		//! Номер точки занят другим интерфейсом или пакет не помещается
+		//! в буфер: интерфейс возвращается к прежней настройке
+		iface->bindAlternate(false);
+		iface->_alt = previous;
+		iface->bindAlternate(true);
+		openIfaceEndpoints(iface);
+		iface->altSelected(previous);
+		return false;
+	}
 
-    	case REQ_GET_STATUS:
-    		ep->reportStatus(this);
-    		break;
+	iface->altSelected(alt);
+	return true;
+}
 
-    	}
-    	break;
-    }
+/////////////////////////////////////////////////////////////////////////////////////////
 
-    default :
-    	ctlError();
-    	break;
-    }
+bool XUsbDevice::openIfaceEndpoints(XUsbIface * iface)
+{
+	for(int dir = EP_DIR_OUT; dir <= EP_DIR_IN; ++dir)
+		for(int epnum = 1; epnum < USB_MAX_ENDPOINTS; ++epnum)
+		{
+			XUsbEndpointState & state = _epStates[dir][epnum];
+			if((state.endpoint == nullptr) || (state.endpoint->iface() != iface) ||
+			   (state.flags & XUsbEndpointState::OPENED))
+				continue;
+			if(!adaptEndpoint(state))
+				return false;
+			state.endpoint->open();
+		}
+	return true;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-void XUsbDevice::ep0RxReady(UsbSetupRequest * req)
+void XUsbDevice::ep0RxReady(UsbSetupRequest * req, const XUsbCtlData & data)
 {
-	_configs[_dev_config]->ep0RxReady(req);
+	if(_ctlOwner != nullptr)
+		_ctlOwner->ep0RxReady(req, data);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
 void XUsbDevice::ep0TxSent(UsbSetupRequest * req)
 {
-	_configs[_dev_config]->ep0TxSent(req);
+	if(_ctlOwner != nullptr)
+		_ctlOwner->ep0TxSent(req);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
 void XUsbDevice::getDescriptor(UsbSetupRequest *req)
 {
-    uint16_t len = 0;
-    uint8_t * pbuf = nullptr;
+	uint8_t type = HIBYTE(req->wValue);
+	uint8_t index = LOBYTE(req->wValue);
+
+	//! Без точного совпадения - вариант с langid 0: при STALL только для основного языка
+	const DescEntry * entry = findDescriptor(descKey(type, index, req->wIndex));
+	if((entry == nullptr) && (req->wIndex != 0) &&
+	   ((_descFallback == DESC_FALLBACK_NEUTRAL) || (req->wIndex == primaryLangId())))
+		entry = findDescriptor(descKey(type, index, 0));
+
+	//! Если не зарегистрированы явно, квалификатор и конфигурации другой скорости
+	//! строятся из дескрипторов устройства и конфигураций. Устройство только
+	//! для full-speed на эти запросы отвечает STALL (USB 2.0, 9.6.2).
+	uint8_t speedLength = 0;
+	if((entry == nullptr) && isHighSpeedCapable())
+	{
+		if(type == UsbDescType_DeviceQualifier)
+			speedLength = buildSpeedDescriptor(type);
+		else if(type == UsbDescType_OtherSpeedConfiguration)
+		{
+			entry = findDescriptor(descKey(UsbDescType_Configuration, index, 0));
+			if((entry != nullptr) && (entry->kind != DESC_CONFIG))
+				entry = nullptr;
+		}
+	}
+	else if((entry != nullptr) && (type == UsbDescType_Device) && (entry->kind == DESC_DATA) &&
+			(((_dev_speed == UsbSpeed_High) && (entry->data[7] != 64)) ||
+			 (bcdUSB(entry->data) != uint16_t(entry->data[2] | (entry->data[3] << 8)))))
+		speedLength = buildSpeedDescriptor(type);
 
-    switch (req->wValue >> 8)
-    {
-  #if (USBD_LPM_ENABLED == 1)
-    case UsbDesc::DescBOS:
-      pbuf = getBOSDescriptor(_dev_speed, &len);
-      break;
-  #endif
-    case UsbDescType_Device:
-    {
-    	pbuf = _devDescData;
-    	len = UsbDeviceDescriptor::SIZE;
-    	break;
-    }
+	//! BOS без явной регистрации - только ради LPM
+	if((entry == nullptr) && (type == UsbDescType_BOS) && (index == 0) && isLpmCapable())
+		speedLength = buildBosDescriptor();
 
-    case UsbDescType_Configuration :
-    {
-    	if(XUsbConfiguration * config = _configs[_dev_config])
-    	{
-    		pbuf = config->data();
-    		len = config->wTotalLength();
-    	}
-        break;
+	if((entry == nullptr) && (speedLength == 0))
+	{
+		ctlError();
+		return;
+	}
 
-    }
+	if(req->wLength == 0)
+	{
+		ctlSendStatus();
+		return;
+	}
 
-    case UsbDescType_String :
-    {
-    	uint8_t str_idx = (uint8_t)(req->wValue);
-    	if((str_idx < USB_MAX_STRINGS) && (_strings[str_idx].isValid()))
-    	{
-    		pbuf = _strings[str_idx].data();
-    		len = _strings[str_idx].bLength();
-    	}
-    	else
-    		ctlError();
-    	break;
-    }
+	if(speedLength != 0)
+	{
+		ctlTransmit(_speedDesc, MIN(speedLength, req->wLength));
+		return;
+	}
 
-    case UsbDescType_DeviceQualifier :
-        ctlError();
-        break;
+	switch(entry->kind)
+	{
+	case DESC_CONFIG:
+	{
+		XUsbConfiguration * config = entry->config;
+		UsbSpeedClass target = _dev_speed;
+		if(type == UsbDescType_OtherSpeedConfiguration)
+			target = (_dev_speed == UsbSpeed_High) ? UsbSpeed_Full : UsbSpeed_High;
 
-    case UsbDescType_OtherSpeedConfiguration :
-    	ctlError();
-    	break;
+		if((type == UsbDescType_Configuration) && (target == config->speed()))
+			ctlTransmit(config->fragments(), MIN(config->wTotalLength(), req->wLength));
+		else
+			ctlTransmitConfig(config->fragments(), MIN(config->wTotalLength(), req->wLength),
+							  type, config->speed(), target);
+		break;
+	}
 
-    default:
-        ctlError();
-        return;
-    }
+	case DESC_UTF8:
+		ctlTransmitString(entry->utf8, req->wLength);
+		break;
 
-    if((len != 0)&& (req->wLength != 0))
-    {
-        len = MIN(len , req->wLength);
-        ctlTransmit(pbuf, len);
-    }
+	default:
+		ctlTransmit(const_cast<uint8_t*>(entry->data), MIN(entry->length, req->wLength));
+		break;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+uint8_t XUsbDevice::buildSpeedDescriptor(uint8_t type)
+{
+	const DescEntry * device = findDescriptor(descKey(UsbDescType_Device, 0, 0));
+	if((device == nullptr) || (device->kind != DESC_DATA) ||
+		(device->length < UsbDeviceDescriptor::SIZE))
+		return 0;
+
+	const uint8_t * src = device->data;
+	uint16_t bcd = bcdUSB(src);
+	if(type == UsbDescType_Device)
+	{
+		memcpy(_speedDesc, src, UsbDeviceDescriptor::SIZE);
+		if(_dev_speed == UsbSpeed_High)
+			_speedDesc[7] = 64;
+		_speedDesc[2] = LOBYTE(bcd);
+		_speedDesc[3] = HIBYTE(bcd);
+		return UsbDeviceDescriptor::SIZE;
+	}
+
+	//! Поля дескриптора устройства, каким он был бы на другой скорости
+	_speedDesc[0] = 10;
+	_speedDesc[1] = UsbDescType_DeviceQualifier;
+	memcpy(_speedDesc + 2, src + 2, 5);
+	_speedDesc[2] = LOBYTE(bcd);
+	_speedDesc[3] = HIBYTE(bcd);
+	_speedDesc[7] = (_dev_speed == UsbSpeed_High) ? src[7] : 64;
+	_speedDesc[8] = src[17];
+	_speedDesc[9] = 0;
+	return 10;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+uint8_t XUsbDevice::buildBosDescriptor()
+{
+	const uint32_t attributes = USB_LPM_ATTRIBUTES;
+
+	_speedDesc[0] = 5;
+	_speedDesc[1] = UsbDescType_BOS;
+	_speedDesc[2] = 12;
+	_speedDesc[3] = 0;
+	_speedDesc[4] = 1;
+
+	_speedDesc[5] = 7;
+	_speedDesc[6] = UsbDescType_DeviceCapability;
+	_speedDesc[7] = UsbDevCap_USB20Extension;
+	_speedDesc[8] = uint8_t(attributes);
+	_speedDesc[9] = uint8_t(attributes >> 8);
+	_speedDesc[10] = uint8_t(attributes >> 16);
+	_speedDesc[11] = uint8_t(attributes >> 24);
+	return 12;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+uint16_t XUsbDevice::bcdUSB(const uint8_t * device) const
+{
+	uint16_t bcd = uint16_t(device[2] | (device[3] << 8));
+	//! Хосты не запрашивают BOS у устройств с bcdUSB 2.00
+	if((bcd < UsbDeviceDescriptor::USB_2_1) &&
+		((findDescriptor(descKey(UsbDescType_BOS, 0, 0)) != nullptr) || XUsbPort::isLpmCapable(handle())))
+		bcd = UsbDeviceDescriptor::USB_2_1;
+	return bcd;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -492,7 +1430,7 @@ void XUsbDevice::setAddress(UsbSetupRequest *req)
         else
         {
             _dev_address = dev_addr;
-            HAL_XUsbDevice_SetAddress(_handle, dev_addr);
+            XUsbPort::setAddress(handle(), dev_addr);
             ctlSendStatus();
 
             if (dev_addr != 0)
@@ -509,10 +1447,13 @@ void XUsbDevice::setAddress(UsbSetupRequest *req)
 
 void XUsbDevice::setConfig(UsbSetupRequest *req)
 {
-    static uint8_t  cfgidx = (uint8_t)(req->wValue);
+    uint8_t cfgidx = LOBYTE(req->wValue);
 
-    if (cfgidx > USB_MAX_CONFIGS ||
-    	_configs[cfgidx] == nullptr)
+    //! Конфигурация, не укладывающаяся в периодическую полосу, не устанавливается
+    if (cfgidx >= USB_MAX_CONFIGS ||
+    	(cfgidx != 0 &&
+    	 (_configs[cfgidx] == nullptr ||
+    	  _configs[cfgidx]->periodicRemaining(_dev_speed) < 0)))
     {
         ctlError();
         return;
@@ -524,9 +1465,7 @@ void XUsbDevice::setConfig(UsbSetupRequest *req)
     {
     	if (cfgidx)
     	{
-    		_dev_config = cfgidx;
-    		_dev_state = DEV_CONFIGURED;
-    		if(!_configs[cfgidx]->initDefaultIface(this))
+    		if(!applyConfig(cfgidx))
     		{
     			ctlError();
     			return;
@@ -542,16 +1481,13 @@ void XUsbDevice::setConfig(UsbSetupRequest *req)
     {
     	if (cfgidx == 0)
     	{
-    		_dev_state = DEV_ADDRESSED;
-    		_configs[_dev_config]->deInit();
-    		_dev_config = cfgidx;
+    		releaseConfig();
     		ctlSendStatus();
     	}
     	else  if (cfgidx != _dev_config)
     	{
-    		_configs[_dev_config]->deInit();
-    		_dev_config = cfgidx;
-    		if(!_configs[cfgidx]->initDefaultIface(this))
+    		releaseConfig();
+    		if(!applyConfig(cfgidx))
     		{
     			ctlError();
     			return;
@@ -572,6 +1508,34 @@ void XUsbDevice::setConfig(UsbSetupRequest *req)
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
+bool XUsbDevice::applyConfig(uint8_t cfgidx)
+{
+	//! Все интерфейсы конфигурации подключаются до разбиения FIFO,
+	//! точки открываются одним проходом
+	_dev_config = cfgidx;
+	_dev_state = DEV_CONFIGURED;
+	if(!_configs[cfgidx]->initIfaces(this) || !openEndpoints())
+	{
+		releaseConfig();
+		return false;
+	}
+	_configs[cfgidx]->startIfaces();
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void XUsbDevice::releaseConfig()
+{
+	clearSofTasks();
+	if(_configs[_dev_config] != nullptr)
+		_configs[_dev_config]->deInit();
+	_dev_config = 0;
+	_dev_state = DEV_ADDRESSED;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
 void XUsbDevice::getConfig(UsbSetupRequest *req)
 {
 
@@ -602,12 +1566,8 @@ void XUsbDevice::getStatus(UsbSetupRequest *)
     case DEV_ADDRESSED:
     case DEV_CONFIGURED:
 
-  #if ( USBD_SELF_POWERED == 1)
-        _dev_config_status = CONFIG_SELF_POWERED;
-  #else
-        _dev_config_status = 0;
-  #endif
-
+        //! Бит питания задан в конструкторе, меняется только бит remote wakeup
+        _dev_config_status &= CONFIG_SELF_POWERED;
         if (_dev_remote_wakeup)
             _dev_config_status |= CONFIG_REMOTE_WAKEUP;
 
@@ -628,7 +1588,8 @@ void XUsbDevice::setFeature(UsbSetupRequest * req)
     if (req->wValue == UsbFeature_REMOTE_WAKEUP)
     {
         _dev_remote_wakeup = 1;
-        _configs[_dev_config]->setupRequest(0, req);
+        if(XUsbConfiguration * config = _configs[_dev_config])
+        	config->broadcastRequest(req);
         ctlSendStatus();
     }
 }
@@ -644,7 +1605,8 @@ void XUsbDevice::clrFeature(UsbSetupRequest * req)
         if (req->wValue == UsbFeature_REMOTE_WAKEUP)
         {
             _dev_remote_wakeup = 0;
-            _configs[_dev_config]->setupRequest(0, req);
+            if(XUsbConfiguration * config = _configs[_dev_config])
+            	config->broadcastRequest(req);
             ctlSendStatus();
         }
         break;
@@ -660,32 +1622,379 @@ void XUsbDevice::clrFeature(UsbSetupRequest * req)
 
 UsbStringDescriptor XUsbDevice::createStr(const char * str)
 {
-	size_t len = strlen(str);
-	for(int i = 0; i < USB_MAX_STRINGS; ++i)
-		if(!_strings[i].isValid())
-		{
-			//! Аллоцируется новый буфер под дескриптор строки
-			//! Его длина равна длине стандартного заголовка usb(2 байта) +
-			//! длина строки в символах * 2 (кодировка в юникоде)
-			UsbStringDescriptor desc(i, new uint8_t[2 + len * 2], 2 + len * 2);
-			if(!desc.init(str))
-			{
-				delete[] desc.data();
-				return UsbStringDescriptor();
-			}
+	//! Пустая цель в индексе дескрипторов означает снятие регистрации
+	if(str == nullptr)
+		return UsbStringDescriptor();
 
-			_strings[i] = desc;
-			return _strings[i];
+	for(int i = 1; i < USB_MAX_STRINGS; ++i)
+		if(findDescriptor(descKey(UsbDescType_String, i, 0)) == nullptr)
+		{
+			if(!insertDescriptor(descKey(UsbDescType_String, i, 0), DESC_UTF8, str, 0))
+				break;
+			return UsbStringDescriptor(i, nullptr, 0);
 		}
 	return UsbStringDescriptor();
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-void XUsbDevice::addConfig(XUsbConfiguration * config)
+UsbStringDescriptor XUsbDevice::createStrCopy(const char * str)
+{
+	if(str == nullptr)
+		return UsbStringDescriptor();
+
+	uint16_t size = uint16_t(strlen(str) + 1);
+	char * copy = reinterpret_cast<char*>(allocate(size));
+	if(copy == nullptr)
+		return UsbStringDescriptor();
+
+	memcpy(copy, str, size);
+	UsbStringDescriptor result = createStr(copy);
+	if(result.idx() == 0xFF)
+		_arenaUsed -= size;
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDevice::setStr(uint8_t idx, const uint8_t * descriptor, uint16_t langid)
+{
+	if(descriptor[1] != UsbDescType_String)
+		return false;
+
+	if(langid != 0)
+		return setDescriptor(UsbDescType_String, idx, langid, descriptor, descriptor[0]);
+
+	return (idx < USB_MAX_STRINGS) &&
+		   setDescriptor(UsbDescType_String, idx, 0, descriptor, descriptor[0]);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDevice::addConfig(XUsbConfiguration * config)
 {
 	uint8_t idx = config->bConfigurationValue();
 	assert((idx < USB_MAX_CONFIGS) && (_configs[idx] == nullptr));
+	if(!config->fitsCapacity(UsbSpeed_Full) || (config->periodicRemaining(UsbSpeed_Full) < 0))
+		return false;
+	if(XUsbPort::isHighSpeedCapable(handle()) &&
+	   (!config->fitsCapacity(UsbSpeed_High) || (config->periodicRemaining(UsbSpeed_High) < 0)))
+		return false;
 	_configs[idx] = config;
+
+	//! GET_DESCRIPTOR адресует конфигурации по порядку добавления
+	bool indexed = insertDescriptor(descKey(UsbDescType_Configuration, _numConfigs++, 0),
+									DESC_CONFIG, config, 0);
+	assert(indexed);
+	return indexed;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDevice::insertDescriptor(uint32_t key,
+								  DescKind kind,
+								  const void * target,
+								  uint16_t length)
+{
+	uint8_t slot = descSlot(key);
+	DescEntry * free = nullptr;
+	uint8_t freeProbe = 0;
+
+	for(uint8_t probe = 0; probe < USB_MAX_DESCRIPTORS; ++probe)
+	{
+		DescEntry & entry = _descriptors[(slot + probe) & (USB_MAX_DESCRIPTORS - 1)];
+		if(entry.kind == DESC_NONE)
+		{
+			if(free == nullptr)
+			{
+				free = &entry;
+				freeProbe = probe;
+			}
+		}
+		else if(entry.key == key)
+		{
+			free = &entry;
+			freeProbe = probe;
+			break;
+		}
+	}
+
+	if(target == nullptr)
+	{
+		if((free != nullptr) && (free->key == key))
+			free->kind = DESC_NONE;
+		return true;
+	}
+
+	if(free == nullptr)
+		return false;
+
+	free->key = key;
+	free->kind = kind;
+	free->length = length;
+	switch(kind)
+	{
+	case DESC_CONFIG:
+		free->config = static_cast<XUsbConfiguration*>(const_cast<void*>(target));
+		break;
+
+	case DESC_UTF8:
+		free->utf8 = static_cast<const char*>(target);
+		break;
+
+	default:
+		free->data = static_cast<const uint8_t*>(target);
+		break;
+	}
+
+	if(freeProbe >= _descProbes)
+		_descProbes = freeProbe + 1;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+const XUsbDevice::DescEntry * XUsbDevice::findDescriptor(uint32_t key) const
+{
+	uint8_t slot = descSlot(key);
+
+	for(uint8_t probe = 0; probe < _descProbes; ++probe)
+	{
+		const DescEntry & entry = _descriptors[(slot + probe) & (USB_MAX_DESCRIPTORS - 1)];
+		if((entry.kind != DESC_NONE) && (entry.key == key))
+			return &entry;
+	}
+	return nullptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint16_t XUsbDevice::primaryLangId() const
+{
+	const DescEntry * entry = findDescriptor(descKey(UsbDescType_String, 0, 0));
+	if((entry == nullptr) || (entry->kind != DESC_DATA) || (entry->length < 4))
+		return 0;
+	return uint16_t(entry->data[2] | (entry->data[3] << 8));
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool appendImage(uint8_t * buf, uint16_t size, uint16_t & pos,
+						const uint8_t * data, uint16_t length)
+{
+	if(uint32_t(pos) + length > size)
+		return false;
+	memcpy(buf + pos, data, length);
+	pos += length;
+	return true;
+}
+
+uint16_t XUsbDevice::exportImage(uint8_t * buf, uint16_t size)
+{
+	uint16_t pos = XUsbDescriptorImage::HEADER_SIZE;
+	if(size < pos)
+		return 0;
+
+	if(!appendImage(buf, size, pos, _devDesc, UsbDeviceDescriptor::SIZE))
+		return 0;
+
+	for(int i = 0; i < USB_MAX_CONFIGS; ++i)
+		if(_configs[i] != nullptr)
+			for(const XUsbFragment * frag = _configs[i]->fragments(); frag != nullptr; frag = frag->next())
+				if(!appendImage(buf, size, pos, frag->data(), frag->size()))
+					return 0;
+
+	uint8_t numStrings = 0;
+	for(int i = 0; i < USB_MAX_STRINGS; ++i)
+		if(findDescriptor(descKey(UsbDescType_String, i, 0)) != nullptr)
+			numStrings = i + 1;
+
+	static const uint8_t NO_STRING[2] = { 2, 0 };
+	for(int i = 0; i < numStrings; ++i)
+	{
+		const DescEntry * entry = findDescriptor(descKey(UsbDescType_String, i, 0));
+		if(entry == nullptr)
+		{
+			if(!appendImage(buf, size, pos, NO_STRING, sizeof(NO_STRING)))
+				return 0;
+		}
+		else if(entry->kind == DESC_UTF8)
+		{
+			uint8_t length = 2 + UsbUtf16Encoder::units(entry->utf8) * 2;
+			if(uint32_t(pos) + length > size)
+				return 0;
+			UsbStringDescriptor(i, buf + pos, length).init(entry->utf8);
+			pos += length;
+		}
+		else if(!appendImage(buf, size, pos, entry->data, entry->length))
+			return 0;
+	}
+
+	//! Переводы - строки, зарегистрированные с langid != 0
+	for(int i = 0; i < USB_MAX_DESCRIPTORS; ++i)
+	{
+		const DescEntry & entry = _descriptors[i];
+		if((entry.kind != DESC_DATA) || ((entry.key >> 24) != UsbDescType_String) || ((entry.key & 0xFFFF) == 0))
+			continue;
+		const uint8_t record[3] = { uint8_t(entry.key >> 16), LOBYTE(entry.key), HIBYTE(entry.key) };
+		if(!appendImage(buf, size, pos, record, sizeof(record)) ||
+		   !appendImage(buf, size, pos, entry.data, entry.length))
+			return 0;
+	}
+
+	buf[0] = LOBYTE(XUsbDescriptorImage::MAGIC);
+	buf[1] = HIBYTE(XUsbDescriptorImage::MAGIC);
+	buf[2] = LOBYTE(XUsbDescriptorImage::MAGIC >> 16);
+	buf[3] = HIBYTE(XUsbDescriptorImage::MAGIC >> 16);
+	buf[4] = LOBYTE(pos);
+	buf[5] = HIBYTE(pos);
+	buf[6] = XUsbDescriptorImage::VERSION;
+	buf[7] = numStrings;
+	return pos;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDevice::loadImage(const XUsbDescriptorImage & image)
+{
+	if(!image.isValid() || !init(image.deviceDescriptor()))
+		return false;
+
+	for(uint8_t i = 0; (i < image.numStrings()) && (i < USB_MAX_STRINGS); ++i)
+		if(const uint8_t * str = image.string(i))
+			setStr(i, str);
+
+	uint8_t idx;
+	uint16_t langid;
+	for(uint8_t n = 0; const uint8_t * str = image.translation(n, idx, langid); ++n)
+		if(!setStr(idx, str, langid))
+			return false;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool XUsbDescriptorImage::isValid() const
+{
+	return (_data != nullptr) &&
+		   (uint32_t(_data[0] | (_data[1] << 8) | (_data[2] << 16) | (uint32_t(_data[3]) << 24)) == MAGIC) &&
+		   (_data[6] >= 1) && (_data[6] <= VERSION) &&
+		   (size() >= HEADER_SIZE + UsbDeviceDescriptor::SIZE) &&
+		   (deviceDescriptor()[0] == UsbDeviceDescriptor::SIZE) &&
+		   (deviceDescriptor()[1] == UsbDescType_Device);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+const uint8_t * XUsbDescriptorImage::configuration(uint8_t value) const
+{
+	uint16_t pos = HEADER_SIZE + UsbDeviceDescriptor::SIZE;
+	while((pos + 9 <= size()) && (_data[pos + 1] == UsbDescType_Configuration))
+	{
+		uint16_t length = SWAPBYTE(_data + pos + 2);
+		if(length < 9)
+			break;
+		if(_data[pos + 5] == value)
+			return _data + pos;
+		pos += length;
+	}
+	return nullptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+const uint8_t * XUsbDescriptorImage::string(uint8_t idx) const
+{
+	if(idx >= numStrings())
+		return nullptr;
+
+	uint16_t pos = HEADER_SIZE + UsbDeviceDescriptor::SIZE;
+	while((pos + 9 <= size()) && (_data[pos + 1] == UsbDescType_Configuration))
+	{
+		uint16_t length = SWAPBYTE(_data + pos + 2);
+		if(length < 9)
+			return nullptr;
+		pos += length;
+	}
+
+	for(uint8_t i = 0; (pos + 2 <= size()) && (_data[pos] >= 2); ++i)
+	{
+		if(i == idx)
+			return (_data[pos + 1] == UsbDescType_String) ? (_data + pos) : nullptr;
+		pos += _data[pos];
+	}
+	return nullptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint16_t XUsbDescriptorImage::translationsOffset() const
+{
+	if(numStrings() == 0)
+	{
+		uint16_t pos = HEADER_SIZE + UsbDeviceDescriptor::SIZE;
+		while((pos + 9 <= size()) && (_data[pos + 1] == UsbDescType_Configuration))
+		{
+			uint16_t length = SWAPBYTE(_data + pos + 2);
+			if(length < 9)
+				return size();
+			pos += length;
+		}
+		return pos;
+	}
+
+	const uint8_t * last = string(numStrings() - 1);
+	return (last != nullptr) ? uint16_t(last - _data + last[0]) : size();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+const uint8_t * XUsbDescriptorImage::translation(uint8_t n, uint8_t & idx, uint16_t & langid) const
+{
+	uint16_t pos = translationsOffset();
+	for(uint8_t i = 0; (pos + 5 <= size()) && (_data[pos + 3] >= 2) &&
+					   (pos + 3 + _data[pos + 3] <= size()); ++i)
+	{
+		if(i == n)
+		{
+			if(_data[pos + 4] != UsbDescType_String)
+				return nullptr;
+			idx = _data[pos];
+			langid = uint16_t(_data[pos + 1] | (_data[pos + 2] << 8));
+			return _data + pos + 3;
+		}
+		pos += 3 + _data[pos + 3];
+	}
+	return nullptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef XUSB_NO_HEAP
+//! Сборка без кучи: operator new ссылается на неопределённый символ,
+//! поэтому любое его использование в программе даёт ошибку компоновки.
+//! Неиспользуемые определения удаляются при -ffunction-sections -Wl,--gc-sections.
+#include <new>
+
+extern "C" void xusb_no_heap_operator_new_referenced(void) __attribute__((noreturn));
+
+void * operator new(size_t)
+{
+	xusb_no_heap_operator_new_referenced();
 }
 
+void * operator new[](size_t)
+{
+	xusb_no_heap_operator_new_referenced();
+}
+
+void * operator new(size_t, const std::nothrow_t &) noexcept
+{
+	xusb_no_heap_operator_new_referenced();
+}
+
+void * operator new[](size_t, const std::nothrow_t &) noexcept
+{
+	xusb_no_heap_operator_new_referenced();
+}
+#endif
@@ -12,70 +12,382 @@
 #include "XUsbDevice_Config.h"
 #include <assert.h>
 
+#ifndef USB_EP0_BUFFER_SIZE
+#define USB_EP0_BUFFER_SIZE USB_MAX_EP0_SIZE
+#endif
+
+#ifndef USB_MAX_REQUEST_CLAIMS
+#define USB_MAX_REQUEST_CLAIMS 8
+#endif
+
+//! Точек в каждом направлении, включая нулевую
+#ifndef USB_MAX_ENDPOINTS
+#define USB_MAX_ENDPOINTS 8
+#endif
+
+#ifndef USB_MAX_DESCRIPTORS
+#define USB_MAX_DESCRIPTORS 32
+#endif
+
+#ifndef USB_MAX_CONFIG_SIZE
+#define USB_MAX_CONFIG_SIZE 128
+#endif
+
+#ifndef USB_MAX_STRING_SIZE
+#define USB_MAX_STRING_SIZE 16
+#endif
+
+//! Альтернативных настроек интерфейса, включая нулевую
+#ifndef USB_MAX_ALT_SETTINGS
+#define USB_MAX_ALT_SETTINGS 4
+#endif
+
+//! Длительность сигнала resume при remote wakeup из suspend, мс (USB 2.0, 7.1.7.7: 1..15)
+#ifndef USB_REMOTE_WAKEUP_MS
+#define USB_REMOTE_WAKEUP_MS 2
+#endif
+
+//! Передач, ожидающих выхода шины из suspend
+#ifndef USB_MAX_WAKEUP_QUEUE
+#define USB_MAX_WAKEUP_QUEUE 4
+#endif
+
+//! Коэффициенты ФАПЧ часов SOF (XUsbSofClock): поправка фазы - ошибка >> KP,
+//! периода - ошибка >> KI. Меньше сдвиг - быстрее захват, больше шум.
+#ifndef USB_SOF_PLL_KP_SHIFT
+#define USB_SOF_PLL_KP_SHIFT 3
+#endif
+
+#ifndef USB_SOF_PLL_KI_SHIFT
+#define USB_SOF_PLL_KI_SHIFT 7
+#endif
+
+//! bmAttributes USB 2.0 Extension в BOS, который строится при включённом в контроллере LPM
+#ifndef USB_LPM_ATTRIBUTES
+#define USB_LPM_ATTRIBUTES (UsbLpm_Supported | UsbLpm_BESL)
+#endif
+
+#ifndef USB_ARENA_SIZE
+#define USB_ARENA_SIZE (USB_MAX_CONFIGS * USB_MAX_CONFIG_SIZE + USB_MAX_STRINGS * USB_MAX_STRING_SIZE)
+#endif
+
 /////////////////////////////////////////////////////////////////////////////////////////
 
 class XUsbIface;
-class XUsbZeroEndpoint;
+class XUsbDevice;
+
+//! Фрагмент данных фазы IN нулевой точки. Фрагменты связываются в цепочку,
+//! каждый пакет заполняется из них в момент отправки, поэтому данные
+//! могут лежать частями во flash и в RAM.
+class __packed XUsbFragment
+{
+public:
+	XUsbFragment(const uint8_t * data = nullptr,
+				 uint16_t size = 0,
+				 const XUsbFragment * next = nullptr) :
+		_data(data),
+		_size(size),
+		_next(next)
+	{}
+
+	inline const uint8_t * data() const { return _data; }
+
+	inline uint16_t size() const { return _size; }
+
+	inline const XUsbFragment * next() const { return _next; }
+
+	inline void setNext(const XUsbFragment * next) { _next = next; }
+
+	inline uint32_t chainLength() const
+	{
+		uint32_t result = 0;
+		for(const XUsbFragment * frag = this; frag != nullptr; frag = frag->next())
+			result += frag->size();
+		return result;
+	}
+
+	//! Байт цепочки по смещению от её начала, за концом - 0
+	inline uint8_t chainByte(uint32_t offset) const
+	{
+		for(const XUsbFragment * frag = this; frag != nullptr; frag = frag->next())
+		{
+			if(offset < frag->size())
+				return frag->data()[offset];
+			offset -= frag->size();
+		}
+		return 0;
+	}
+
+private:
+	const uint8_t *			_data;
+	uint16_t				_size;
+	const XUsbFragment *	_next;
+};
+
+//! Порция данных фазы control OUT, переданная обработчику
+class __packed XUsbCtlData
+{
+public:
+	XUsbCtlData(const uint8_t * data,
+				uint16_t size,
+				uint32_t offset,
+				bool last) :
+		_data(data),
+		_size(size),
+		_offset(offset),
+		_last(last)
+	{}
+
+	inline const uint8_t * data() const { return _data; }
+
+	inline uint16_t size() const { return _size; }
+
+	//! Смещение порции от начала фазы данных
+	inline uint32_t offset() const { return _offset; }
+
+	//! Последняя порция, после неё отправляется статус
+	inline bool isLast() const { return _last; }
+
+private:
+	const uint8_t *	_data;
+	uint16_t		_size;
+	uint32_t		_offset;
+	bool			_last;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Получатель запросов class/vendor и их фаз данных
+class XUsbRequestHandler
+{
+public:
+	virtual ~XUsbRequestHandler() {}
+
+	//! false - запрос не поддерживается, нулевая точка будет остановлена.
+	//! Если у запроса нет фазы данных, статус отправляется библиотекой.
+	virtual bool setupRequest(UsbSetupRequest * req) = 0;
+
+	virtual void ep0RxReady(UsbSetupRequest *, const XUsbCtlData &) {}
+
+	virtual void ep0TxSent(UsbSetupRequest *) {}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Периодическая работа, привязанная к SOF: дозаполнение iso-буферов,
+//! отправка отчётов interrupt, таймауты неполных bulk-пакетов.
+//! Период - в SOF текущей скорости: кадрах (1 мс) на full-speed, микрокадрах
+//! (125 мкс) на high-speed. Задачи выполняются в прерывании SOF в порядке
+//! сроков, см. XUsbDevice::addSofTask().
+class XUsbSofTask
+{
+public:
+	explicit XUsbSofTask(uint16_t period = 1) :
+		_next(nullptr),
+		_due(0),
+		_worstCycles(0),
+		_period(period ? period : 1),
+		_scheduled(false)
+	{}
+
+	virtual ~XUsbSofTask() {}
+
+	//! frame - номер SOF из контроллера: кадр на full-speed,
+	//! кадр * 8 + микрокадр на high-speed
+	virtual void sofTick(uint16_t frame) = 0;
+
+	inline uint16_t period() const { return _period; }
+
+	//! Новый период действует со следующего запуска
+	inline void setPeriod(uint16_t period) { _period = period ? period : 1; }
+
+	//! Наибольшее время выполнения sofTick в тактах XUsbPort::cycles()
+	inline uint32_t worstCycles() const { return _worstCycles; }
+
+	inline bool isScheduled() const { return _scheduled; }
+
+private:
+	friend class XUsbDevice;
+
+	XUsbSofTask *	_next;
+	uint32_t		_due;			//!< номер SOF следующего запуска (счётчик XUsbDevice)
+	uint32_t		_worstCycles;
+	uint16_t		_period;
+	bool			_scheduled;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+class XUsbEndpoint;
+
+//! Состояние открытой точки в плотной таблице устройства (направление, номер).
+//! Адрес, тип и размер пакета декодируются из дескриптора один раз при
+//! привязке, путь завершения транзакций упакованные дескрипторы не читает.
+struct XUsbEndpointState
+{
+	enum
+	{
+		STALLED	= 0x01,
+		OPENED	= 0x02
+	};
+
+	XUsbEndpoint *	endpoint;
+	uint16_t		maxPacket;		//!< размер пакета без битов 12..11
+	uint8_t			address;
+	uint8_t			type;
+	uint8_t			flags;
+	uint8_t			transactions;	//!< пакетов в микрокадре, 1..3
+	uint8_t			interval;		//!< bInterval для скорости шины
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
 
 class XUsbEndpoint :
-		public UsbEPDescriptor
+		public UsbEPDescriptor,
+		public XUsbRequestHandler
 {
 public:
 	XUsbEndpoint(const UsbEPDescriptor & descriptor,
 				 XUsbIface * iface);
 
+	//! Точка над готовым дескриптором address интерфейса iface
+	//! (см. XUsbDescriptorImage), сразу привязывается к интерфейсу
+	XUsbEndpoint(XUsbIface * iface,
+				 uint8_t address);
+
 	virtual ~XUsbEndpoint() {}
 
-	virtual bool setupRequest(UsbSetupRequest *) { return false; }
+	virtual bool setupRequest(UsbSetupRequest *) override { return false; }
+
+	//! Байт за (микро)кадр, которые примут буферы точки на скорости speed.
+	//! По умолчанию - описанные в дескрипторе: пакет, увеличенный при смене
+	//! скорости (bulk 64 -> 512 на high-speed), не помещается, и конфигурация
+	//! не регистрируется (XUsbDevice::addConfig). Точка с буфером под обе
+	//! скорости переопределяет.
+	virtual uint16_t capacity(UsbSpeedClass /*speed*/) const
+	{
+		return uint16_t(packetSize() * UsbEPDescriptor::transactions());
+	}
 
+	//! Закрепляет за точкой запрос type/bRequest с получателем "endpoint",
+	//! действует до снятия конфигурации
+	bool claimRequest(UsbReqType type, uint8_t bRequest);
+
+	//! Открывает точку, привязанную к устройству (bind)
 	inline void open()
 	{
-		if(!_opened)
+		if((_state != nullptr) && !(_state->flags & XUsbEndpointState::OPENED))
 		{
-			HAL_XUsbDevice_OpenEP(_handle, bEndpointAddress(), wMaxPacketSize(), bmAttributes() & UsbEPTypeMask);
-			_opened = true;
+			XUsbPort::openEP(handle(), _state->address, _state->maxPacket, _state->type);
+			_state->flags |= XUsbEndpointState::OPENED;
 		}
 	}
 
 	inline void close()
 	{
-		if(_opened)
+		if((_state != nullptr) && (_state->flags & XUsbEndpointState::OPENED))
 		{
-			HAL_XUsbDevice_CloseEP(_handle, bEndpointAddress());
-			_opened = false;
+			XUsbPort::closeEP(handle(), _state->address);
+			_state->flags &= ~XUsbEndpointState::OPENED;
 		}
 	}
 
 	inline void stall()
 	{
-		HAL_XUsbDevice_StallEP(_handle, bEndpointAddress());
-		_status = 0x0001;
+		XUsbPort::stallEP(handle(), address());
+		if(_state != nullptr)
+			_state->flags |= XUsbEndpointState::STALLED;
 	}
 
 	inline void clearStall()
 	{
-		HAL_XUsbDevice_ClearStallEP(_handle, bEndpointAddress());
-		_status = 0x0001;
+		XUsbPort::clearStallEP(handle(), address());
+		if(_state != nullptr)
+			_state->flags &= ~XUsbEndpointState::STALLED;
 	}
 
 	inline void flush()
 	{
-		HAL_XUsbDevice_Flush(_handle, bEndpointAddress());
+		XUsbPort::flushEP(handle(), address());
+	}
+
+	//! Привязывает точку к записи таблицы устройства и декодирует в неё
+	//! дескриптор, nullptr - отвязывает. Вызывается устройством.
+	inline void bind(XUsbEndpointState * state)
+	{
+		_state = state;
+		if(state == nullptr)
+			return;
+		state->address = bEndpointAddress();
+		state->type = bmAttributes() & UsbEPTypeMask;
+		state->maxPacket = packetSize();
+		state->transactions = UsbEPDescriptor::transactions();
+		state->interval = bInterval();
+		state->flags = 0;
+	}
+
+	inline uint8_t address() const { return (_state != nullptr) ? _state->address : bEndpointAddress(); }
+
+	inline uint16_t maxPacket() const { return (_state != nullptr) ? _state->maxPacket : packetSize(); }
+
+	inline uint8_t transactions() const
+	{
+		return (_state != nullptr) ? _state->transactions : UsbEPDescriptor::transactions();
+	}
+
+	inline uint8_t type() const
+	{
+		return (_state != nullptr) ? _state->type : uint8_t(bmAttributes() & UsbEPTypeMask);
+	}
+
+	inline uint8_t interval() const { return (_state != nullptr) ? _state->interval : bInterval(); }
+
+	//! Период обслуживания изохронной точки в SOF текущей скорости: 2^(bInterval-1)
+	inline uint16_t isoPeriod() const
+	{
+		uint8_t exponent = interval();
+		return uint16_t(1u << (((exponent > 0) ? exponent - 1 : 0) & 0x0F));
+	}
+
+	//! Передача изохронной точки не состоялась в своём (микро)кадре. Контроллер
+	//! передаёт пакет, только если чётность кадра совпадает с заданной, поэтому
+	//! ожидающая передача перенацеливается на следующий (микро)кадр.
+	inline void isoRetarget()
+	{
+		XUsbPort::isoNextFrame(handle(), address());
+	}
+
+	void reportStatus(XUsbDevice * device);
+
+#ifdef XUSB_COMPACT_LAYOUT
+	//! Второе устройство с другим контроллером подменило бы handle первого
+	inline void setHandle(void * handle)
+	{
+		assert((_sharedHandle == nullptr) || (_sharedHandle == handle));
+		_sharedHandle = handle;
 	}
 
-	void reportStatus(XUsbZeroEndpoint * ep0);
+	//! Освобождает общий handle, вызывается при удалении устройства
+	static inline void releaseHandle() { _sharedHandle = nullptr; }
 
+	inline void * handle() const { return _sharedHandle; }
+#else
 	inline void setHandle(void * handle) { _handle = handle; }
 
 	inline void * handle() const { return _handle; }
+#endif
 
 	XUsbIface * iface() const { return _iface; }
 
 private:
+#ifdef XUSB_COMPACT_LAYOUT
+	//! Компактная раскладка: один контроллер на программу, handle общий
+	static void *	_sharedHandle;
+#else
 	void * 		_handle;
-	uint16_t	_status;
-	XUsbIface *	_iface;
-	bool		_opened;
+#endif
+	XUsbIface *			_iface;
+	XUsbEndpointState *	_state;
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -99,9 +411,23 @@ public:
 
 	virtual bool epDataIn(uint8_t * pdata) = 0;
 
+	//! Прерывание incomplete isochronous IN, frame - текущий номер SOF
+	virtual void isoIncomplete(uint16_t /*frame*/) { isoRetarget(); }
+
+	//! Для high-bandwidth точки size - данные одного микрокадра, до
+	//! transactions() пакетов (DATA2/DATA1/DATA0 формирует контроллер)
 	inline void transmit(uint8_t * pbuf, uint16_t size)
 	{
-		HAL_XUsbDevice_Transmit(handle(), bEndpointAddress(), pbuf, size);
+		if(transactions() > 1)
+			XUsbPort::transmitPeriodic(handle(), address(), pbuf, size, periodicCount(size, maxPacket()));
+		else
+			XUsbPort::transmit(handle(), address(), pbuf, size);
+	}
+
+	//! Число транзакций микрокадра для size байт, не меньше одной (ZLP)
+	static inline uint8_t periodicCount(uint16_t size, uint16_t packet)
+	{
+		return uint8_t((size == 0) ? 1 : (size + packet - 1) / packet);
 	}
 };
 
@@ -126,14 +452,73 @@ public:
 
 	virtual bool epDataOut(uint8_t * pdata) = 0;
 
+	//! Прерывание incomplete isochronous OUT, frame - текущий номер SOF
+	virtual void isoIncomplete(uint16_t /*frame*/) { isoRetarget(); }
+
 	inline void receive(uint8_t * pbuf, uint16_t size)
 	{
-		HAL_XUsbDevice_Receive(handle(), bEndpointAddress(), pbuf, size);
+		XUsbPort::receive(handle(), address(), pbuf, size);
+	}
+
+	//! Количество байт, принятых последней транзакцией
+	inline uint16_t rxCount() const
+	{
+		return uint16_t(XUsbPort::rxCount(handle(), address()));
+	}
+
+	//! Для high-bandwidth точки: все транзакции микрокадра, объявленные хостом
+	//! PID последнего пакета (DATA0 - одна, DATA1 - две, DATA2 - три), приняты.
+	//! Последний принятый MDATA означает, что завершающий пакет потерян.
+	inline bool rxComplete() const
+	{
+		if(transactions() <= 1)
+			return true;
+		uint8_t announced = XUsbPort::rxTransactions(handle(), address());
+		return (announced != 0) &&
+			   (XUsbInEndpoint::periodicCount(rxCount(), maxPacket()) == announced);
+	}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Точки со статическим полиморфизмом: Derived::dataIn/dataOut вызываются
+//! напрямую и могут быть встроены. В сочетании с XUsbStaticDevice
+//! путь завершения транзакции обходится без виртуальных вызовов.
+template<class Derived>
+class __packed XUsbStaticInEndpoint :
+		public XUsbInEndpoint
+{
+public:
+	explicit XUsbStaticInEndpoint(const XUsbEndpoint & source) :
+		XUsbInEndpoint(source)
+	{}
+
+	virtual bool epDataIn(uint8_t * pdata) final override
+	{
+		return static_cast<Derived*>(this)->dataIn(pdata);
+	}
+};
+
+template<class Derived>
+class __packed XUsbStaticOutEndpoint :
+		public XUsbOutEndpoint
+{
+public:
+	explicit XUsbStaticOutEndpoint(const XUsbEndpoint & source) :
+		XUsbOutEndpoint(source)
+	{}
+
+	virtual bool epDataOut(uint8_t * pdata) final override
+	{
+		return static_cast<Derived*>(this)->dataOut(pdata);
 	}
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
+//! Нулевая точка. Обработчики запросов и фаз данных вызываются у Device
+//! статически (CRTP), без виртуальных вызовов на пути завершения транзакций.
+template<class Device>
 class __packed XUsbZeroEndpoint :
 		public XUsbInEndpoint,
 		public XUsbOutEndpoint
@@ -141,42 +526,119 @@ class __packed XUsbZeroEndpoint :
 public:
 	XUsbZeroEndpoint(void * handle,
 					uint8_t max_packet) :
+#ifdef XUSB_COMPACT_LAYOUT
+		XUsbInEndpoint(XUsbEndpoint(UsbEPDescriptor(ep0Descriptor(0x80, max_packet), UsbEPDescriptor::DEFAULT_LENGTH), nullptr)),
+		XUsbOutEndpoint(XUsbEndpoint(UsbEPDescriptor(ep0Descriptor(0x00, max_packet), UsbEPDescriptor::DEFAULT_LENGTH), nullptr)),
+#else
 		XUsbInEndpoint(XUsbEndpoint(UsbEPDescriptor(_inEpData, UsbEPDescriptor::DEFAULT_LENGTH), nullptr)),
 		XUsbOutEndpoint(XUsbEndpoint(UsbEPDescriptor(_outEpData, UsbEPDescriptor::DEFAULT_LENGTH), nullptr)),
+#endif
 	    _state(EP0_IDLE),
+	    _inFrag(nullptr),
+	    _inFragOffset(0),
+	    _inUnit(0),
+	    _inStringLength(0),
 	    _inTotalLength(0),
-	    _inRemLength(0),
+	    _inOffset(0),
+	    _inZlp(false),
+	    _inChain(nullptr),
+	    _inRewriteType(0),
+	    _inRewriteFrom(0),
+	    _inRewriteTo(0),
+	    _inNextDesc(0),
+	    _inDescStart(0),
+	    _inDescIsEP(false),
+	    _outBuf(nullptr),
+	    _outShared(false),
 	    _outTotalLength(0),
-	    _outRemLength(0),
-	    _dataLength(0)
+	    _outOffset(0),
+	    _outFill(0)
 	{
 		XUsbInEndpoint::setHandle(handle);
 		XUsbOutEndpoint::setHandle(handle);
 
+#ifndef XUSB_COMPACT_LAYOUT
 		XUsbInEndpoint::init(UsbEPDescriptor::DEFAULT_LENGTH, 0x80, 0x00, max_packet, 0);
 		XUsbOutEndpoint::init(UsbEPDescriptor::DEFAULT_LENGTH, 0x00, 0x00, max_packet, 0);
+#endif
+	}
+
+	//! Данные передаются пакетами по wMaxPacketSize, смещение ведётся здесь,
+	//! а не в HAL. Если ответ короче wLength и кратен размеру пакета,
+	//! после данных отправляется ZLP.
+	inline void ctlTransmit(const XUsbFragment * chain, uint16_t len)
+	{
+		uint32_t available = (chain != nullptr) ? chain->chainLength() : 0;
+		if(len > available)
+			len = uint16_t(available);
+
+		_inFrag			= chain;
+		_inFragOffset	= 0;
+		_inString		= UsbUtf16Encoder();
+		_inRewriteType	= 0;
+		startTransmit(len);
+	}
+
+	//! Дескриптор конфигурации, описанный для скорости from, отправляется как
+	//! дескриптор type (Configuration или OtherSpeedConfiguration) для скорости to.
+	//! Дескрипторы точек пересчитываются по мере отправки пакетов.
+	inline void ctlTransmitConfig(const XUsbFragment * chain,
+								  uint16_t len,
+								  uint8_t type,
+								  UsbSpeedClass from,
+								  UsbSpeedClass to)
+	{
+		uint32_t available = (chain != nullptr) ? chain->chainLength() : 0;
+		if(len > available)
+			len = uint16_t(available);
+
+		_inFrag			= chain;
+		_inFragOffset	= 0;
+		_inString		= UsbUtf16Encoder();
+		_inChain		= chain;
+		_inRewriteType	= type;
+		_inRewriteFrom	= uint8_t(from);
+		_inRewriteTo	= uint8_t(to);
+		_inNextDesc		= 0;
+		_inDescStart	= 0;
+		_inDescIsEP		= false;
+		startTransmit(len);
+	}
+
+	//! Дескриптор строки формируется из UTF-8 по мере отправки пакетов
+	inline void ctlTransmitString(const char * utf8, uint16_t len)
+	{
+		_inStringLength = 2 + UsbUtf16Encoder::units(utf8) * 2;
+		if(len > _inStringLength)
+			len = _inStringLength;
+
+		_inFrag			= nullptr;
+		_inString		= UsbUtf16Encoder(utf8);
+		startTransmit(len);
 	}
 
 	inline void ctlTransmit(uint8_t * pdata, uint16_t len)
 	{
-		/* Set EP0 State */
-		_state      	= EP0_DATA_IN;
-		_inTotalLength 	= len;
-		_inRemLength	= len;
-		/* Start the transfer */
-		XUsbInEndpoint::transmit(pdata, len);
+		_inSingle = XUsbFragment(pdata, len);
+		ctlTransmit(&_inSingle, len);
 	}
 
+	//! Приём в буфер вызывающего, обработчик получит данные целиком
 	inline void ctlReceive(uint8_t * pdata, uint16_t len)
 	{
-		/* Set EP0 State */
-		_state = EP0_DATA_OUT;
-		_outTotalLength = len;
-		_outRemLength   = len;
-		/* Start the transfer */
-		XUsbOutEndpoint::receive(pdata, len);
+		startReceive(pdata, len, false);
+	}
+
+	//! Приём через общий буфер нулевой точки. Обработчик получает данные
+	//! порциями до USB_EP0_BUFFER_SIZE байт по мере заполнения буфера.
+	inline void ctlReceive(uint16_t len)
+	{
+		startReceive(_ctlBuffer, len, true);
 	}
 
+	//! Количество байт, принятых в текущей фазе данных control OUT
+	inline uint32_t ctlRxCount() const { return _outOffset; }
+
 	inline void ctlSendStatus()
 	{
 		/* Set EP0 State */
@@ -203,23 +665,39 @@ public:
 	}
 
 protected:
-	virtual bool isDeviceConfigured() const = 0;
-
-	virtual void stdDevReq(UsbSetupRequest * req) = 0;
-
-	virtual void stdItfReq(UsbSetupRequest * req) = 0;
-
-	virtual void stdEPReq(UsbSetupRequest * req) = 0;
-
-	virtual void ep0TxSent(UsbSetupRequest * req) = 0;
-
-	virtual void ep0RxReady(UsbSetupRequest * req) = 0;
-
 	virtual bool epDataOut(uint8_t * pdata) final override;
 
 	virtual bool epDataIn(uint8_t * pdata) final override;
 
 private:
+    inline Device * device() { return static_cast<Device*>(this); }
+
+#ifdef XUSB_COMPACT_LAYOUT
+    //! Дескрипторы нулевой точки во flash для допустимых bMaxPacketSize0
+    static uint8_t * ep0Descriptor(uint8_t address, uint8_t max_packet)
+    {
+    	static const uint8_t Descriptors[2][4][UsbEPDescriptor::DEFAULT_LENGTH] =
+    	{
+    		{
+    			{ UsbEPDescriptor::DEFAULT_LENGTH, UsbDescType_Endpoint, 0x00, 0x00, 8, 0, 0 },
+    			{ UsbEPDescriptor::DEFAULT_LENGTH, UsbDescType_Endpoint, 0x00, 0x00, 16, 0, 0 },
+    			{ UsbEPDescriptor::DEFAULT_LENGTH, UsbDescType_Endpoint, 0x00, 0x00, 32, 0, 0 },
+    			{ UsbEPDescriptor::DEFAULT_LENGTH, UsbDescType_Endpoint, 0x00, 0x00, 64, 0, 0 }
+    		},
+    		{
+    			{ UsbEPDescriptor::DEFAULT_LENGTH, UsbDescType_Endpoint, 0x80, 0x00, 8, 0, 0 },
+    			{ UsbEPDescriptor::DEFAULT_LENGTH, UsbDescType_Endpoint, 0x80, 0x00, 16, 0, 0 },
+    			{ UsbEPDescriptor::DEFAULT_LENGTH, UsbDescType_Endpoint, 0x80, 0x00, 32, 0, 0 },
+    			{ UsbEPDescriptor::DEFAULT_LENGTH, UsbDescType_Endpoint, 0x80, 0x00, 64, 0, 0 }
+    		}
+    	};
+
+    	assert((max_packet == 8) || (max_packet == 16) || (max_packet == 32) || (max_packet == 64));
+    	uint8_t idx = (max_packet == 8) ? 0 : (max_packet == 16) ? 1 : (max_packet == 32) ? 2 : 3;
+    	return const_cast<uint8_t*>(Descriptors[(address & 0x80) ? 1 : 0][idx]);
+    }
+#endif
+
     typedef enum
 	{
         EP0_IDLE,
@@ -232,107 +710,812 @@ private:
     }
     EP0State;
 
+    inline void startTransmit(uint16_t len)
+    {
+		/* Set EP0 State */
+		_state      	= EP0_DATA_IN;
+		_inTotalLength 	= len;
+		_inOffset		= 0;
+		_inZlp			= (len != 0) &&
+						  (len < _request.wLength) &&
+						  (len % XUsbInEndpoint::maxPacket() == 0);
+		/* Start the transfer */
+		transmitChunk();
+    }
+
+    //! Если пакет целиком лежит в одном фрагменте, он передаётся прямо
+    //! из него, иначе собирается в _inPacket
+    inline void transmitChunk()
+    {
+    	uint32_t chunk = _inTotalLength - _inOffset;
+    	if(chunk > XUsbInEndpoint::maxPacket())
+    		chunk = XUsbInEndpoint::maxPacket();
+
+    	if(_inString.isValid())
+    	{
+    		encodeChunk(chunk);
+    		return;
+    	}
+
+    	while((_inFrag != nullptr) && (_inFragOffset >= _inFrag->size()))
+    	{
+    		_inFrag = _inFrag->next();
+    		_inFragOffset = 0;
+    	}
+
+    	uint8_t * pbuf = nullptr;
+    	if((chunk == 0) ||
+    	   ((_inRewriteType == 0) && (uint32_t(_inFrag->size() - _inFragOffset) >= chunk)))
+    	{
+    		if(_inFrag != nullptr)
+    			pbuf = const_cast<uint8_t*>(_inFrag->data()) + _inFragOffset;
+    		_inFragOffset += chunk;
+    	}
+    	else
+    	{
+    		uint32_t copied = 0;
+    		while(copied < chunk)
+    		{
+    			uint32_t part = _inFrag->size() - _inFragOffset;
+    			if(part > chunk - copied)
+    				part = chunk - copied;
+    			//! Пустой фрагмент может не иметь данных (nullptr)
+    			if(part != 0)
+    				memcpy(_inPacket + copied, _inFrag->data() + _inFragOffset, part);
+    			copied += part;
+    			_inFragOffset += part;
+    			if(_inFragOffset >= _inFrag->size())
+    			{
+    				_inFrag = _inFrag->next();
+    				_inFragOffset = 0;
+    			}
+    		}
+    		pbuf = _inPacket;
+    		if(_inRewriteType != 0)
+    			rewriteChunk(chunk);
+    	}
+
+    	XUsbInEndpoint::transmit(pbuf, uint16_t(chunk));
+    	_inOffset += chunk;
+    }
+
+    //! Заголовку подставляется тип, дескрипторам точек - значения для другой
+    //! скорости. Начало каждого дескриптора отслеживается через пакеты.
+    inline void rewriteChunk(uint32_t chunk)
+    {
+    	for(uint32_t i = 0; i < chunk; ++i)
+    	{
+    		uint32_t offset = _inOffset + i;
+    		if((offset == _inNextDesc) && (_inPacket[i] >= 2))
+    		{
+    			_inDescStart = uint16_t(offset);
+    			_inNextDesc = uint16_t(offset + _inPacket[i]);
+    			_inDescIsEP = (_inPacket[i] >= UsbEPDescriptor::DEFAULT_LENGTH) &&
+    						  (_inChain->chainByte(offset + 1) == UsbDescType_Endpoint);
+    			if(_inDescIsEP)
+    			{
+    				for(uint8_t j = 0; j < UsbEPDescriptor::DEFAULT_LENGTH; ++j)
+    					_inEpPatch[j] = _inChain->chainByte(offset + j);
+    				UsbEPDescriptor::convertSpeed(_inEpPatch, UsbSpeedClass(_inRewriteFrom),
+    											  UsbSpeedClass(_inRewriteTo));
+    			}
+    		}
+
+    		if(offset == 1)
+    			_inPacket[i] = _inRewriteType;
+    		else if(_inDescIsEP && (offset - _inDescStart < UsbEPDescriptor::DEFAULT_LENGTH))
+    			_inPacket[i] = _inEpPatch[offset - _inDescStart];
+    	}
+    }
+
+    inline void encodeChunk(uint32_t chunk)
+    {
+    	for(uint32_t i = 0; i < chunk; ++i)
+    	{
+    		uint32_t offset = _inOffset + i;
+    		if(offset == 0)
+    			_inPacket[i] = _inStringLength;
+    		else if(offset == 1)
+    			_inPacket[i] = UsbDescType_String;
+    		else if(offset & 1)
+    			_inPacket[i] = uint8_t(_inUnit >> 8);
+    		else
+    		{
+    			_inUnit = _inString.next();
+    			_inPacket[i] = uint8_t(_inUnit);
+    		}
+    	}
+
+    	XUsbInEndpoint::transmit(_inPacket, uint16_t(chunk));
+    	_inOffset += chunk;
+    }
+
+    inline void startReceive(uint8_t * pdata, uint16_t len, bool shared)
+    {
+		/* Set EP0 State */
+		_state = EP0_DATA_OUT;
+		_outBuf = pdata;
+		_outShared = shared;
+		_outTotalLength = len;
+		_outOffset = 0;
+		_outFill = 0;
+		/* Start the transfer */
+		receiveChunk();
+    }
+
+    inline void receiveChunk()
+    {
+    	uint32_t chunk = _outTotalLength - _outOffset;
+    	if(chunk > XUsbOutEndpoint::maxPacket())
+    		chunk = XUsbOutEndpoint::maxPacket();
+    	XUsbOutEndpoint::receive(_outBuf + _outFill, uint16_t(chunk));
+    }
+
     EP0State 		_state;
+    const XUsbFragment * _inFrag;
+    uint16_t		_inFragOffset;
+    XUsbFragment	_inSingle;
+    UsbUtf16Encoder	_inString;
+    uint16_t		_inUnit;
+    uint8_t			_inStringLength;
     uint32_t		_inTotalLength;
-    uint32_t		_inRemLength;
+    uint32_t		_inOffset;
+    bool			_inZlp;
+    const XUsbFragment * _inChain;
+    uint8_t			_inRewriteType;
+    uint8_t			_inRewriteFrom;
+    uint8_t			_inRewriteTo;
+    uint16_t		_inNextDesc;
+    uint16_t		_inDescStart;
+    bool			_inDescIsEP;
+    uint8_t			_inEpPatch[UsbEPDescriptor::DEFAULT_LENGTH];
+    uint8_t *		_outBuf;
+    bool			_outShared;
     uint32_t		_outTotalLength;
-    uint32_t		_outRemLength;
-    uint16_t		_dataLength;
+    uint32_t		_outOffset;
+    uint16_t		_outFill;
     UsbSetupRequest _request;
+#ifndef XUSB_COMPACT_LAYOUT
     uint8_t 		_inEpData[UsbEPDescriptor::DEFAULT_LENGTH];
     uint8_t 		_outEpData[UsbEPDescriptor::DEFAULT_LENGTH];
+#endif
+    uint8_t			_inPacket[USB_MAX_EP0_SIZE];
+    uint8_t			_ctlBuffer[USB_EP0_BUFFER_SIZE];
+
+    static_assert(USB_EP0_BUFFER_SIZE >= USB_MAX_EP0_SIZE,
+    			  "USB_EP0_BUFFER_SIZE must hold at least one EP0 packet");
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
-class XUsbConfiguration;
-
-class __packed XUsbDevice :
-	public XUsbZeroEndpoint
+template<class Device>
+inline void XUsbZeroEndpoint<Device>::setupStage(uint8_t * pdata)
 {
-	friend class XUsbIface;
+    _request.bmRequest     = *(uint8_t *)  (pdata);
+    _request.bRequest      = *(uint8_t *)  (pdata +  1);
+    _request.wValue        = uint16_t(pdata[2] | (pdata[3] << 8));
+    _request.wIndex        = uint16_t(pdata[4] | (pdata[5] << 8));
+    _request.wLength       = uint16_t(pdata[6] | (pdata[7] << 8));
 
-public:
-    typedef enum
-	{
-        USBD_SPEED_HIGH  = 0,
-        USBD_SPEED_FULL  = 1,
-        USBD_SPEED_LOW   = 2,
-    }
-    Speed;
+    _state = EP0_SETUP;
 
-    enum DevConfig
+    device()->dispatchRequest(&_request);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+template<class Device>
+inline bool XUsbZeroEndpoint<Device>::epDataOut(uint8_t *)
+{
+	switch(_state)
 	{
-        CONFIG_REMOTE_WAKEUP    = 0x0002,
-        CONFIG_SELF_POWERED     = 0x0001
-    };
+	case EP0_DATA_OUT:
+	{
+		uint16_t count = XUsbOutEndpoint::rxCount();
+		_outOffset += count;
+		_outFill += count;
 
+		//! Короткий пакет досрочно завершает фазу данных
+		if((_outOffset < _outTotalLength) &&
+			(count == XUsbOutEndpoint::maxPacket()))
+		{
+			//! Общий буфер не вместит следующий пакет - отдаём накопленное
+			if(_outShared &&
+				(_outFill + XUsbOutEndpoint::maxPacket() > USB_EP0_BUFFER_SIZE))
+			{
+				device()->ep0RxReady(&_request, XUsbCtlData(_outBuf, _outFill, _outOffset - _outFill, false));
+				_outFill = 0;
+			}
+			receiveChunk();
+		}
+		else
+		{
+			device()->ep0RxReady(&_request, XUsbCtlData(_outBuf, _outFill, _outOffset - _outFill, true));
+			ctlSendStatus();
+		}
+		break;
+	}
 
-	explicit XUsbDevice(void * handle, bool selfPowered);
+	case EP0_STATUS_OUT:
+		_state = EP0_IDLE;
+		break;
 
-	bool init(uint16_t bcd,
-              uint8_t deviceClass,
-              uint8_t deviceSubClass,
-              uint8_t deviceProtocol,
-              uint8_t maxPacketSize,
-              uint16_t vendorID,
-              uint16_t productID,
-              uint16_t bcdDev,
-              const char * manufacturerStr,
-              const char * productStr,
-			  const char * serial,
-              uint8_t numConfigs)
-	{
-		return UsbDeviceDescriptor((uint8_t*)(_devDescData), UsbDeviceDescriptor::SIZE).
-					init(bcd, deviceClass, deviceSubClass, deviceProtocol,
-						 maxPacketSize, vendorID, productID, bcdDev,
-						 createStr(manufacturerStr), createStr(productStr),
-						 createStr(serial), numConfigs);
+	default:
+		break;
 	}
+	return true;
+}
 
-	virtual ~XUsbDevice();
+/////////////////////////////////////////////////////////////////////////////////////////
 
-    bool dataOutStage(uint8_t epnum, uint8_t * pdata);
+template<class Device>
+inline bool XUsbZeroEndpoint<Device>::epDataIn(uint8_t *)
+{
+	switch(_state)
+	{
+	case EP0_DATA_IN:
+	{
+		if(_inOffset < _inTotalLength)
+		{
+			transmitChunk();
 
-    bool dataInStage(uint8_t epnum, uint8_t * pdata);
+			/* Prepare endpoint for premature end of transfer */
+			XUsbOutEndpoint::receive(nullptr, 0);
+		}
+		else if(_inZlp)
+		{ /* last packet is MPS multiple, so send ZLP packet */
+			_inZlp = false;
+			XUsbInEndpoint::transmit(nullptr, 0);
 
-    void SOF();
+			/* Prepare endpoint for premature end of transfer */
+			XUsbOutEndpoint::receive(nullptr, 0);
+		}
+		else
+		{
+			device()->ep0TxSent(&_request);
+			ctlReceiveStatus();
+		}
+		break;
+	}
 
-    void reset();
+	case EP0_STATUS_IN:
+		_state = EP0_IDLE;
+		break;
+
+	default:
+		break;
+	}
+
+	//! @attention нужно этот код активировать на всякий случай
+	/*
+	if (_dev_test_mode == 1)
+	{
+		runTestMode();
+		_dev_test_mode = 0;
+	}
+	*/
+
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Образ дескрипторов устройства, подготовленный XUsbDevice::exportImage().
+//! Образ лежит во flash и используется без копирования:
+//! заголовок, дескриптор устройства, дескрипторы конфигураций (каждый
+//! длиной wTotalLength), затем дескрипторы строк по порядку индексов.
+//! Отсутствующая строка хранится как заглушка {2, 0}. В конце - переводы
+//! строк (setStr() с langid): индекс, LANGID (LE) и дескриптор строки.
+//! Образ версии 1 переводов не содержит.
+class __packed XUsbDescriptorImage
+{
+public:
+	static const uint32_t MAGIC = 0x49445558;	//!< "XUDI"
+	static const uint8_t VERSION = 2;
+	static const uint8_t HEADER_SIZE = 8;
+
+	explicit XUsbDescriptorImage(const uint8_t * data) :
+		_data(data)
+	{}
+
+	inline const uint8_t * data() const { return _data; }
+
+	inline uint16_t size() const { return uint16_t(_data[4] | (_data[5] << 8)); }
+
+	inline uint8_t numStrings() const { return _data[7]; }
+
+	bool isValid() const;
+
+	inline const uint8_t * deviceDescriptor() const { return _data + HEADER_SIZE; }
+
+	//! Дескриптор конфигурации с bConfigurationValue == value или nullptr
+	const uint8_t * configuration(uint8_t value) const;
+
+	//! Дескриптор строки idx или nullptr
+	const uint8_t * string(uint8_t idx) const;
+
+	//! Перевод номер n: дескриптор строки, её индекс и LANGID, nullptr - переводов меньше
+	const uint8_t * translation(uint8_t n, uint8_t & idx, uint16_t & langid) const;
+
+private:
+	//! Смещение после основных строк
+	uint16_t translationsOffset() const;
+
+	const uint8_t * _data;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+class XUsbConfiguration;
+
+//! Часы шины по SOF: на каждом SOF фиксируется счётчик тактов XUsbPort::cycles(),
+//! ФАПЧ второго порядка оценивает период SOF в тактах и момент последнего SOF.
+//! Номер кадра на шине общий для всех устройств одного хоста, поэтому busTime()
+//! выравнивает отметки времени разных устройств без отдельной синхронизации.
+//! Точность ограничена разбросом задержки прерывания SOF, который фильтр усредняет.
+//! Неупакованный базовый класс XUsbDevice: 64-битные поля должны быть выровнены.
+class XUsbSofClock
+{
+public:
+	//! Момент на шине: SOF и наносекунды после него
+	typedef struct
+	{
+		uint32_t	sof;			//!< счётчик SOF устройства (XUsbDevice::sofCount)
+		uint16_t	frame;			//!< номер SOF на шине: кадр или кадр * 8 + микрокадр
+		uint32_t	ns;				//!< от начала этого SOF
+	}
+	BusTime;
+
+	XUsbSofClock()
+	{
+		clockReset(UsbSpeed_Full);
+	}
+
+	//! Ошибка фазы мала последние LockSamples SOF
+	inline bool isClockLocked() const { return _lockCount >= LockSamples; }
+
+	//! Оценка тактов на SOF, 16 дробных бит. Отношение к номиналу - уход
+	//! локального генератора относительно хоста.
+	inline int64_t sofPeriod() const { return _period; }
+
+	//! Ошибка фазы на последнем SOF, такты
+	inline int32_t sofPhaseError() const { return _error; }
+
+	//! Такты на входе в последнее прерывание SOF
+	inline uint32_t sofCycles() const { return _lastCycles; }
+
+	//! Локальная отметка XUsbPort::cycles() во время шины. До захвата
+	//! (isClockLocked) результат приблизителен, до второго SOF - нулевой.
+	BusTime busTime(uint32_t cycles) const;
+
+protected:
+	enum
+	{
+		LockSamples = 16
+	};
+
+	void clockReset(UsbSpeedClass speed);
+
+	void clockUpdate(uint32_t sof, uint16_t frame, uint32_t cycles);
+
+private:
+	//! Смещение от опорной точки в тактах с 16 дробными битами
+	inline int64_t sinceAnchor(uint32_t cycles) const
+	{
+		return (int64_t(int32_t(cycles - _anchorCycles)) << 16) - _anchorFrac;
+	}
+
+	int64_t		_period;
+	uint32_t	_anchorCycles;		//!< оценка момента SOF _anchorSof
+	uint32_t	_anchorFrac;
+	uint32_t	_anchorSof;
+	uint32_t	_lastCycles;
+	uint32_t	_sofNs;
+	int32_t		_error;
+	uint16_t	_anchorFrame;
+	uint16_t	_frameMask;
+	uint8_t		_samples;
+	uint8_t		_lockCount;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Плотная таблица состояний точек. Вынесена в неупакованный базовый класс,
+//! чтобы записи сохраняли естественное выравнивание внутри XUsbDevice.
+class XUsbEndpointTable
+{
+public:
+	enum
+	{
+		EP_DIR_OUT	= 0,
+		EP_DIR_IN	= 1
+	};
+
+protected:
+	XUsbEndpointState	_epStates[2][USB_MAX_ENDPOINTS];
+	//! Разбиение FIFO контроллера в 32-битных словах (XUsbPort::setFifos)
+	uint16_t			_fifoRx;
+	uint16_t			_fifoTx[USB_MAX_ENDPOINTS];
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+class __packed XUsbDevice :
+	public XUsbZeroEndpoint<XUsbDevice>,
+	public XUsbEndpointTable,
+	public XUsbSofClock
+{
+	friend class XUsbIface;
+	friend class XUsbZeroEndpoint<XUsbDevice>;
+
+	typedef XUsbZeroEndpoint<XUsbDevice> ZeroEndpoint;
+
+public:
+    enum DevConfig
+	{
+        CONFIG_REMOTE_WAKEUP    = 0x0002,
+        CONFIG_SELF_POWERED     = 0x0001
+    };
+
+
+	//! Поведение GET_DESCRIPTOR, если нет дескриптора для запрошенного langid
+	typedef enum
+	{
+		DESC_FALLBACK_NEUTRAL,	//!< отдаётся вариант, зарегистрированный с langid 0
+		DESC_FALLBACK_STALL		//!< только точное совпадение или основной язык
+	}
+	DescFallback;
+
+	//! Состояние линии (USB 2.0 LPM ECN): L1 - сон на микросекунды по токену LPM,
+	//! L2 - suspend после 3 мс простоя шины
+	typedef enum
+	{
+		LINK_L0,
+		LINK_L1,
+		LINK_L2
+	}
+	LinkState;
+
+	//! Задержки remote wakeup в мс от события (remoteWakeup(), wakeupTransmit())
+	//! до выхода шины в L0 и до первого отправленного пакета
+	typedef struct
+	{
+		uint16_t	count;				//!< пробуждений по инициативе устройства
+		uint16_t	lastResumeMs;
+		uint16_t	lastDeliveryMs;
+		uint16_t	maxDeliveryMs;
+	}
+	WakeupStats;
+
+	//! Работа планировщика SOF
+	typedef struct
+	{
+		uint32_t	frames;				//!< обработано прерываний SOF
+		uint32_t	missed;				//!< SOF без прерывания (скачок номера)
+		uint32_t	deferred;			//!< SOF, в которых задачи не уложились в лимит
+		uint32_t	maxCycles;			//!< наибольшее время всех задач одного SOF
+	}
+	SofStats;
+
+	explicit XUsbDevice(void * handle, bool selfPowered);
+
+	bool init(uint16_t bcd,
+              uint8_t deviceClass,
+              uint8_t deviceSubClass,
+              uint8_t deviceProtocol,
+              uint8_t maxPacketSize,
+              uint16_t vendorID,
+              uint16_t productID,
+              uint16_t bcdDev,
+              const char * manufacturerStr,
+              const char * productStr,
+			  const char * serial,
+              uint8_t numConfigs)
+	{
+		//! Порядок вычисления аргументов не определён, индексы строк назначаются здесь.
+		//! Строка nullptr - индекс 0, строки нет.
+		UsbStringDescriptor manufacturerDesc = optionalStr(manufacturerStr);
+		UsbStringDescriptor productDesc = optionalStr(productStr);
+		UsbStringDescriptor serialDesc = optionalStr(serial);
+		return UsbDeviceDescriptor((uint8_t*)(_devDescData), UsbDeviceDescriptor::SIZE).
+					init(bcd, deviceClass, deviceSubClass, deviceProtocol,
+						 maxPacketSize, vendorID, productID, bcdDev,
+						 manufacturerDesc, productDesc,
+						 serialDesc, numConfigs) &&
+			   setDescriptor(UsbDescType_Device, 0, 0, _devDescData, UsbDeviceDescriptor::SIZE);
+	}
+
+	//! Готовый дескриптор устройства во flash (usbstaticdescriptors.h)
+	bool init(const uint8_t * deviceDescriptor)
+	{
+		if((deviceDescriptor[0] != UsbDeviceDescriptor::SIZE) ||
+			(deviceDescriptor[1] != UsbDescType_Device))
+			return false;
+		_devDesc = deviceDescriptor;
+		return setDescriptor(UsbDescType_Device, 0, 0, deviceDescriptor, UsbDeviceDescriptor::SIZE);
+	}
+
+	virtual ~XUsbDevice();
+
+    inline bool isConfigured() const { return _dev_state == DEV_CONFIGURED; }
+
+    //! Скорость, на которой работает устройство, определяется при сбросе шины
+    inline UsbSpeedClass speed() const { return _dev_speed; }
+
+    //! Контроллер и PHY допускают high-speed: устройство отвечает на
+    //! DEVICE_QUALIFIER и OTHER_SPEED_CONFIGURATION на любой скорости
+    inline bool isHighSpeedCapable() { return XUsbPort::isHighSpeedCapable(handle()); }
+
+    //! Контроллер принимает LPM: устройство отдаёт BOS с USB 2.0 Extension,
+    //! если BOS не зарегистрирован явно, и bcdUSB не меньше 2.01
+    inline bool isLpmCapable() { return XUsbPort::isLpmCapable(handle()); }
+
+    inline LinkState linkState() const { return _dev_link; }
+
+    //! BESL из последнего принятого токена LPM
+    inline uint8_t lpmBesl() const { return _dev_besl; }
+
+    bool dataOutStage(uint8_t epnum, uint8_t * pdata);
+
+    bool dataInStage(uint8_t epnum, uint8_t * pdata);
+
+    void SOF();
+
+    void reset();
 
     void suspend();
 
     void resume();
 
+    //! Токен LPM принят (ACK) - линия в L1. Конфигурация и состояние точек
+    //! сохраняются, besl - допустимая задержка выхода, см. usbBeslMicroseconds()
+    //! remoteWake - хост разрешил выход из L1 по инициативе устройства (bRemoteWake)
+    void lpmSleep(uint8_t besl, bool remoteWake);
+
+    //! Выход из L1 по resume хоста или устройства
+    void lpmWake();
+
     void isoOutIncomplete(uint8_t epnum);
 
     void isoInIncomplete(uint8_t epnum);
 
+    //! Ставит задачу в планировщик SOF: первый запуск через phase SOF после
+    //! следующего, затем каждые task->period(). Задачи выполняются только
+    //! в сконфигурированном состоянии и снимаются при сбросе шины и смене
+    //! конфигурации. Вызывается из контекста USB (обработчики запросов, SOF).
+    void addSofTask(XUsbSofTask * task, uint16_t phase = 0);
+
+    void removeSofTask(XUsbSofTask * task);
+
+    //! Лимит тактов XUsbPort::cycles() на задачи одного SOF, 0 - без лимита.
+    //! Первая задача выполняется всегда, не уложившиеся откладываются
+    //! и выполняются первыми в следующем SOF.
+    inline void setSofBudget(uint32_t cycles) { _sofBudget = cycles; }
+
+    //! Счётчик SOF с момента сброса шины, с учётом пропущенных прерываний
+    inline uint32_t sofCount() const { return _sofCount; }
+
+    inline SofStats sofStats() const { return _sofStats; }
+
+    //! Будит хост, если он это разрешил: SET_FEATURE(DEVICE_REMOTE_WAKEUP) для
+    //! suspend, bRemoteWake токена LPM для L1. Из suspend сигнал resume начинается
+    //! не раньше 5 мс простоя шины и длится USB_REMOTE_WAKEUP_MS, поэтому функция
+    //! блокирующая и вызывается не из прерывания USB. false - пробуждение запрещено.
+    bool remoteWakeup();
+
+    //! Передача, которая уходит сразу после выхода шины из suspend или L1.
+    //! В L0 отправляется немедленно, иначе ставится в очередь и вызывает
+    //! remoteWakeup(). false - передача не принята: устройство не
+    //! сконфигурировано, очередь заполнена или хост не разрешил remote wakeup
+    //! (данные остаются у вызывающего до resume от хоста).
+    bool wakeupTransmit(XUsbInEndpoint * ep, uint8_t * pbuf, uint16_t size);
+
+    inline bool isRemoteWakeupEnabled() const
+    {
+    	return (_dev_link == LINK_L1) ? _dev_l1_remote_wakeup : (_dev_remote_wakeup != 0);
+    }
+
+    inline WakeupStats wakeupStats() const { return _wakeStats; }
+
+    //! Первый пакет после пробуждения ушёл - фиксирует задержку доставки
+    inline void noteWakeupDelivery(uint8_t epnum)
+    {
+    	if(epnum == _wakeEp)
+    		wakeupDelivered();
+    }
+
     virtual void connected() {}
 
     virtual void disconnected() {}
 
-    inline void * handle() const { return _handle; }
+    //! Переход линии в L0, L1 или L2. Вызывается из прерывания: в L1 можно
+    //! только остановить то, что успевает запуститься за время BESL.
+    virtual void linkChanged(LinkState /*state*/) {}
 
+    inline void * handle() const { return XUsbInEndpoint::handle(); }
+
+    //! Регистрирует строку в UTF-8 под первым свободным индексом.
+    //! Строка не копируется и должна существовать всё время работы устройства,
+    //! дескриптор в UTF-16LE формируется при каждом запросе.
+    //! Возвращает дескриптор без данных, пригодный только как индекс строки.
+    //! Для str == nullptr и при заполненном индексе - недействительный дескриптор.
     UsbStringDescriptor createStr(const char * str);
 
-    void addConfig(XUsbConfiguration * config);
+    //! То же, что createStr, но строка копируется в арену устройства
+    UsbStringDescriptor createStrCopy(const char * str);
+
+    //! Буфер для построителя дескриптора конфигурации из арены устройства.
+    //! Если места нет, дескриптор невалиден.
+    inline UsbConfigDescriptor createConfigDescriptor(uint16_t size)
+    {
+    	uint8_t * data = allocate(size);
+    	return UsbConfigDescriptor(data, (data != nullptr) ? size : 0);
+    }
+
+    //! Память из арены устройства (без выравнивания), nullptr - арена заполнена.
+    //! Освобождается только вся сразу в clearDescriptors().
+    inline uint8_t * allocate(uint16_t size)
+    {
+    	if((size == 0) || (uint32_t(_arenaUsed) + size > USB_ARENA_SIZE))
+    		return nullptr;
+    	uint8_t * result = _arena + _arenaUsed;
+    	_arenaUsed += size;
+    	return result;
+    }
+
+    inline uint16_t arenaUsed() const { return _arenaUsed; }
+
+    //! Слов FIFO, не занятых разбиением текущей конфигурации (XUsbPort::fifoWords)
+    inline uint16_t fifoFree() const
+    {
+    	uint16_t used = _fifoRx;
+    	uint16_t total = XUsbPort::fifoWords(handle());
+    	for(int i = 0; i < USB_MAX_ENDPOINTS; ++i)
+    		used += _fifoTx[i];
+    	return (used < total) ? uint16_t(total - used) : 0;
+    }
+
+    //! Снимает регистрацию всех дескрипторов и конфигураций и освобождает арену.
+    //! Сброс шины арену не освобождает. В сконфигурированном состоянии недоступно.
+    bool clearDescriptors();
+
+    //! Устанавливает готовый дескриптор строки idx (например, во flash).
+    //! Дескриптор не копируется и не освобождается.
+    //! langid != 0 добавляет перевод строки, основная таблица не меняется.
+    bool setStr(uint8_t idx, const uint8_t * descriptor, uint16_t langid = 0);
+
+    //! Регистрирует ответ на GET_DESCRIPTOR (type, index, langid).
+    //! data == nullptr снимает регистрацию.
+    inline bool setDescriptor(uint8_t type, uint8_t index, uint16_t langid,
+    						  const uint8_t * data, uint16_t length)
+    {
+    	return insertDescriptor(descKey(type, index, langid), DESC_DATA, data, length);
+    }
+
+    //! При DESC_FALLBACK_STALL вариант с langid 0 считается переводом на первый
+    //! LANGID дескриптора строки 0 (основной язык устройства)
+    inline void setDescFallback(DescFallback policy) { _descFallback = policy; }
+
+    //! Записывает дескрипторы устройства, конфигураций и строк в buf
+    //! в формате XUsbDescriptorImage. Возвращает размер образа, 0 - не хватило места.
+    uint16_t exportImage(uint8_t * buf, uint16_t size);
+
+    //! Подключает дескриптор устройства, строки и их переводы из образа без копирования.
+    //! Конфигурации создаются поверх image.configuration().
+    bool loadImage(const XUsbDescriptorImage & image);
+
+    //! false - пакет, который дескрипторы объявят хосту на одной из доступных
+    //! скоростей, не помещается в буфер точки (XUsbEndpoint::capacity), или
+    //! периодические точки превышают полосу (XUsbConfiguration::periodicRemaining).
+    //! Такая конфигурация не регистрируется: отказ в SET_CONFIGURATION после
+    //! GET_DESCRIPTOR хост не исправит.
+    bool addConfig(XUsbConfiguration * config);
+
+    //! Закрепляет запрос class/vendor за обработчиком.
+    //! index - номер интерфейса или адрес точки для соответствующих получателей,
+    //! для получателя "device" не используется. handler == nullptr снимает закрепление.
+    //! Закрепления за интерфейсами конфигурации и их точками (с любым получателем)
+    //! снимаются при снятии конфигурации и сбросе шины, за остальными
+    //! обработчиками - постоянны.
+    bool claimRequest(uint8_t bmRequestType,
+    				  uint8_t bRequest,
+    				  uint8_t index,
+    				  XUsbRequestHandler * handler);
+
+    //! Снимает все закрепления обработчика
+    void releaseRequests(XUsbRequestHandler * handler);
 
 protected:
 	virtual void runTestMode() {}
 
 private:
-	virtual bool isDeviceConfigured() const final override { return _dev_state == DEV_CONFIGURED; }
+	typedef void (XUsbDevice::*StdRequest)(UsbSetupRequest * req);
+
+	//! Стандартные запросы: [получатель][bRequest]
+	static const StdRequest StdRequests[REQ_RECIPIENT_ENDPOINT + 1][REQ_SYNCH_FRAME + 1];
+
+	typedef struct __packed
+	{
+		uint32_t				key;
+		XUsbRequestHandler *	handler;
+	}
+	RequestClaim;
+
+	static_assert((USB_MAX_REQUEST_CLAIMS & (USB_MAX_REQUEST_CLAIMS - 1)) == 0,
+				  "USB_MAX_REQUEST_CLAIMS must be a power of two");
+
+	static inline uint32_t claimKey(uint8_t bmRequestType, uint8_t bRequest, uint8_t index)
+	{
+		if((bmRequestType & REQ_RECIPIENT_MASK) == REQ_RECIPIENT_DEVICE)
+			index = 0;
+		return (uint32_t(bmRequestType & (REQ_TYPE_MASK | REQ_RECIPIENT_MASK)) << 16) |
+			   (uint32_t(bRequest) << 8) | index;
+	}
+
+	static inline uint8_t claimSlot(uint32_t key)
+	{
+		return uint8_t((key ^ (key >> 8) ^ (key >> 13)) & (USB_MAX_REQUEST_CLAIMS - 1));
+	}
+
+	XUsbRequestHandler * findClaim(const UsbSetupRequest * req) const;
+
+	//! Передаёт запрос получателю, он же получает фазы данных
+	void delegateRequest(XUsbRequestHandler * handler, UsbSetupRequest * req);
+
+	typedef enum
+	{
+		DESC_NONE,			//!< свободная запись
+		DESC_DATA,			//!< готовый дескриптор data/length
+		DESC_CONFIG,		//!< цепочка фрагментов конфигурации config
+		DESC_UTF8			//!< дескриптор строки, формируется из utf8 при отправке
+	}
+	DescKind;
+
+	//! Запись индекса дескрипторов
+	typedef struct __packed
+	{
+		uint32_t	key;
+		union
+		{
+			const uint8_t *		data;
+			const char *		utf8;
+			XUsbConfiguration *	config;
+		};
+		uint16_t	length;
+		uint8_t		kind;
+	}
+	DescEntry;
+
+	static_assert((USB_MAX_DESCRIPTORS & (USB_MAX_DESCRIPTORS - 1)) == 0,
+				  "USB_MAX_DESCRIPTORS must be a power of two");
+
+	static inline uint32_t descKey(uint8_t type, uint8_t index, uint16_t langid)
+	{
+		return (uint32_t(type) << 24) | (uint32_t(index) << 16) | langid;
+	}
+
+	static inline uint8_t descSlot(uint32_t key)
+	{
+		return uint8_t((key ^ (key >> 5) ^ (key >> 16) ^ (key >> 24)) & (USB_MAX_DESCRIPTORS - 1));
+	}
+
+	//! target == nullptr снимает регистрацию
+	bool insertDescriptor(uint32_t key, DescKind kind, const void * target, uint16_t length);
+
+	const DescEntry * findDescriptor(uint32_t key) const;
+
+	//! Первый LANGID дескриптора строки 0, 0 - дескриптора нет
+	uint16_t primaryLangId() const;
 
-    virtual void stdDevReq(UsbSetupRequest * req) final override;
+	void	dispatchRequest(UsbSetupRequest * req);
 
-    virtual void stdItfReq(UsbSetupRequest * req) final override;
+	XUsbEndpoint * findEndpoint(uint8_t ep_addr) const;
 
-    virtual void stdEPReq(UsbSetupRequest * req) final override;
+	XUsbEndpoint * stdEndpoint(UsbSetupRequest * req) const;
 
-	virtual void ep0TxSent(UsbSetupRequest * req) final override;
+	void	ep0TxSent(UsbSetupRequest * req);
 
-	virtual void ep0RxReady(UsbSetupRequest * req) final override;
+	void	ep0RxReady(UsbSetupRequest * req, const XUsbCtlData & data);
 
     void 	setAddress(UsbSetupRequest * req);
 
@@ -348,36 +1531,110 @@ private:
 
     void 	getDescriptor(UsbSetupRequest * req);
 
-    inline void	setInEndpoint(uint8_t epnum, XUsbInEndpoint * ep)
-    {
-    	assert(epnum < UsbInterfaceDescriptor::MaxEndpoints);
+    void	getItfStatus(UsbSetupRequest * req);
 
-    	if(_inEndpoints[epnum] != nullptr)
-    		_inEndpoints[epnum]->close();
+    void	getItfDescriptor(UsbSetupRequest * req);
 
-    	_inEndpoints[epnum] = ep;
-    	if(ep != nullptr)
-    	{
-    		ep->setHandle(_handle);
-    		ep->open();
-    	}
+    void	getInterface(UsbSetupRequest * req);
+
+    void	setInterface(UsbSetupRequest * req);
+
+    void	getEPStatus(UsbSetupRequest * req);
+
+    void	setEPFeature(UsbSetupRequest * req);
+
+    void	clrEPFeature(UsbSetupRequest * req);
+
+    inline void	setInEndpoint(uint8_t epnum, XUsbInEndpoint * ep)
+    {
+    	bindEndpoint(EP_DIR_IN, epnum, ep);
     }
 
     inline void setOutEndpoint(uint8_t epnum, XUsbOutEndpoint * ep)
     {
-    	assert(epnum < UsbInterfaceDescriptor::MaxEndpoints);
+    	bindEndpoint(EP_DIR_OUT, epnum, ep);
+    }
 
-    	if(_outEndpoints[epnum] != nullptr)
-    		_outEndpoints[epnum]->close();
+    //! open == false - точка открывается позже, в openEndpoints(),
+    //! после разбиения FIFO под всю конфигурацию
+    inline void bindEndpoint(uint8_t dir, uint8_t epnum, XUsbEndpoint * ep, bool open = true)
+    {
+    	assert(epnum < USB_MAX_ENDPOINTS);
+
+    	XUsbEndpointState & state = _epStates[dir][epnum];
+    	if(state.endpoint != nullptr)
+    	{
+    		state.endpoint->close();
+    		state.endpoint->bind(nullptr);
+    	}
 
-    	_outEndpoints[epnum] = ep;
+    	state.endpoint = ep;
     	if(ep != nullptr)
     	{
-    		ep->setHandle(_handle);
-    		ep->open();
+    		ep->setHandle(handle());
+    		ep->bind(&state);
+    		if(open)
+    			ep->open();
     	}
     }
 
+    //! Строка дескриптора устройства, nullptr - индекс 0
+    inline UsbStringDescriptor optionalStr(const char * str)
+    {
+    	return (str != nullptr) ? createStr(str) : UsbStringDescriptor(0, nullptr, 0);
+    }
+
+    //! Слов RX FIFO под SETUP и наибольший OUT-пакет всех конфигураций на скорости
+    //! шины. Размечается при сбросе шины, поэтому конфигурации добавляются до подключения.
+    uint16_t rxFifoWords() const;
+
+    //! Разбивает остаток FIFO под привязанные IN-точки: по пакету на точку,
+    //! для bulk - по два
+    bool planFifos();
+
+    //! Пакет и интервал привязанной точки для скорости шины.
+    //! false - пакет на этой скорости больше буфера точки (capacity()).
+    bool adaptEndpoint(XUsbEndpointState & state);
+
+    //! Программирует TX FIFO по planFifos() и открывает привязанные точки
+    bool openEndpoints();
+
+    //! Подключает интерфейсы конфигурации cfgidx и открывает их точки,
+    //! при ошибке устройство остаётся в состоянии DEV_ADDRESSED
+    bool applyConfig(uint8_t cfgidx);
+
+    //! Снимает текущую конфигурацию: DEV_ADDRESSED, конфигурация 0
+    void releaseConfig();
+
+    //! SET_INTERFACE: закрывает точки текущей настройки интерфейса
+    //! и открывает точки настройки alt
+    bool selectAlternate(XUsbIface * iface, uint8_t alt);
+
+    //! Открывает привязанные, но не открытые точки интерфейса
+    bool openIfaceEndpoints(XUsbIface * iface);
+
+    //! Дескриптор устройства для high-speed или DEVICE_QUALIFIER в _speedDesc,
+    //! возвращает длину, 0 - нет дескриптора устройства
+    uint8_t buildSpeedDescriptor(uint8_t type);
+
+    //! BOS с единственным USB 2.0 Extension (USB_LPM_ATTRIBUTES) в _speedDesc
+    uint8_t buildBosDescriptor();
+
+    //! Отправляет передачи, дождавшиеся выхода из suspend или L1
+    void flushWakeupQueue();
+
+    void wakeupDelivered();
+
+    //! Вставка по сроку, при равных сроках - после уже стоящих
+    void insertSofTask(XUsbSofTask * task);
+
+    void runSofTasks(uint16_t frame);
+
+    void clearSofTasks();
+
+    //! bcdUSB, который нужно объявить: не меньше 2.01, если у устройства есть BOS
+    uint16_t bcdUSB(const uint8_t * device) const;
+
     enum DeviceState
 	{
         DEV_DEFAULT,
@@ -386,51 +1643,279 @@ private:
         DEV_SUSPENDED
     };
 
-    void *				_handle;
     bool				_dev_test_mode;
     DeviceState         _dev_old_state;
     DeviceState         _dev_state;
     uint8_t				_dev_address;
-    uint32_t            _dev_config_status;
-    uint32_t            _dev_remote_wakeup;
+    uint16_t            _dev_config_status;
+    uint8_t             _dev_remote_wakeup;
     uint8_t				_dev_config;
-    UsbStringDescriptor	_strings[USB_MAX_STRINGS];
+    UsbSpeedClass		_dev_speed;
+    LinkState			_dev_link;
+    uint8_t				_dev_besl;
+    bool				_dev_l1_remote_wakeup;
+    //! Время входа в suspend, от него отсчитываются 5 мс простоя перед remote wakeup
+    uint32_t			_suspendTick;
+    struct
+    {
+    	XUsbInEndpoint * ep;
+    	uint8_t * data;
+    	uint16_t size;
+    }					_wakeQueue[USB_MAX_WAKEUP_QUEUE];
+    uint8_t				_wakeQueued;
+    //! Точка, завершение передачи которой фиксирует задержку, 0xFF - не ждём
+    uint8_t				_wakeEp;
+    uint32_t			_wakeEventTick;
+    WakeupStats			_wakeStats;
+    //! Задачи SOF по возрастанию срока
+    XUsbSofTask *		_sofTasks;
+    uint32_t			_sofCount;
+    uint32_t			_sofBudget;
+    uint16_t			_sofLast;
+    bool				_sofSynced;
+    SofStats			_sofStats;
     XUsbConfiguration *	_configs[USB_MAX_CONFIGS];
-    XUsbInEndpoint *	_inEndpoints[UsbInterfaceDescriptor::MaxEndpoints];
-    XUsbOutEndpoint *	_outEndpoints[UsbInterfaceDescriptor::MaxEndpoints];
     uint8_t				_devDescData[UsbDeviceDescriptor::SIZE];
+    //! Дескриптор устройства, DEVICE_QUALIFIER или BOS, собираемый при запросе
+    uint8_t				_speedDesc[UsbDeviceDescriptor::SIZE];
+    const uint8_t *		_devDesc;
+    RequestClaim		_claims[USB_MAX_REQUEST_CLAIMS];
+    uint8_t				_claimProbes;
+    DescEntry			_descriptors[USB_MAX_DESCRIPTORS];
+    uint8_t				_descProbes;
+    uint8_t				_numConfigs;
+    DescFallback		_descFallback;
+    uint8_t				_arena[USB_ARENA_SIZE];
+    uint16_t			_arenaUsed;
+    XUsbRequestHandler *	_ctlOwner;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Устройство с набором точек, известным на этапе компиляции.
+//! Derived может определить
+//!		bool endpointDataIn(uint8_t epnum, uint8_t * pdata);
+//!		bool endpointDataOut(uint8_t epnum, uint8_t * pdata);
+//! и вызывать в них обработчики конкретных точек по имени объекта,
+//! тогда компилятор может встроить весь путь от прерывания до обработчика.
+//! Порт вызывает эти методы, если класс устройства указан в XUSB_DEVICE_CLASS.
+template<class Derived>
+class __packed XUsbStaticDevice :
+	public XUsbDevice
+{
+public:
+	explicit XUsbStaticDevice(void * handle, bool selfPowered) :
+		XUsbDevice(handle, selfPowered)
+	{}
+
+	inline bool dataOutStage(uint8_t epnum, uint8_t * pdata)
+	{
+		if(epnum == 0)
+			return XUsbZeroEndpoint<XUsbDevice>::epDataOut(pdata);
+		return isConfigured() && static_cast<Derived*>(this)->endpointDataOut(epnum, pdata);
+	}
+
+	inline bool dataInStage(uint8_t epnum, uint8_t * pdata)
+	{
+		if(epnum == 0)
+			return XUsbZeroEndpoint<XUsbDevice>::epDataIn(pdata);
+		noteWakeupDelivery(epnum);
+		return isConfigured() && static_cast<Derived*>(this)->endpointDataIn(epnum, pdata);
+	}
+
+protected:
+	//! По умолчанию точки вызываются через таблицы устройства
+	inline bool endpointDataOut(uint8_t epnum, uint8_t * pdata)
+	{
+		return XUsbDevice::dataOutStage(epnum, pdata);
+	}
+
+	inline bool endpointDataIn(uint8_t epnum, uint8_t * pdata)
+	{
+		return XUsbDevice::dataInStage(epnum, pdata);
+	}
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
 class XUsbIface :
-		public UsbInterfaceDescriptor
+		public UsbInterfaceDescriptor,
+		public XUsbRequestHandler
 {
 public:
 	explicit XUsbIface(const UsbInterfaceDescriptor & self) :
 		UsbInterfaceDescriptor(self),
-		_device(nullptr)
-	{}
+		_device(nullptr),
+		_alt(0),
+		_started(false)
+	{
+		for(int i = 0; i < USB_MAX_ALT_SETTINGS; ++i)
+			_alts[i] = nullptr;
+	}
 
-	virtual bool setupRequest(UsbSetupRequest * req) = 0;
+	//! Кроме запросов класса сюда приходит стандартный GET_DESCRIPTOR
+	//! с получателем "interface" (дескрипторы HID и report)
+	virtual bool setupRequest(UsbSetupRequest * req) override = 0;
 
-	virtual void ep0RxReady(UsbSetupRequest * req) = 0;
+	//! Вызывается для каждой порции фазы данных control OUT,
+	//! последняя порция помечена isLast()
+	virtual void ep0RxReady(UsbSetupRequest * req, const XUsbCtlData & data) override = 0;
 
-	virtual void ep0TxSent(UsbSetupRequest * req) = 0;
+	virtual void ep0TxSent(UsbSetupRequest * req) override = 0;
 
-	void build(XUsbDevice * dev)
+	//! Смена альтернативной настройки (SET_INTERFACE и установка конфигурации,
+	//! где выбирается нулевая). altDeselected - до закрытия точек прежней
+	//! настройки: здесь останавливаются потоки на них; altSelected - после
+	//! открытия точек новой: здесь потоки запускаются.
+	virtual void altDeselected(uint8_t /*alt*/) {}
+
+	virtual void altSelected(uint8_t /*alt*/) {}
+
+	//! Привязывает к устройству точки нулевой настройки, открываются они
+	//! в XUsbDevice::openEndpoints(). false - номер точки уже занят
+	//! другим интерфейсом конфигурации.
+	bool build(XUsbDevice * dev)
 	{
 		_device = dev;
-		for(int epnum = 1; epnum < UsbInterfaceDescriptor::MaxEndpoints; ++epnum)
+		_alt = 0;
+		_started = false;
+		return bindAlternate(true);
+	}
+
+	inline bool isInitialized() const { return _device != nullptr; }
+
+	//! Добавляет альтернативную настройку 1..USB_MAX_ALT_SETTINGS-1 того же интерфейса
+	inline bool addAlternate(UsbInterfaceDescriptor & alt)
+	{
+		uint8_t number = alt.bAlternateSetting();
+		if(!alt.isValid() ||
+		   (alt.bInterfaceNumber() != bInterfaceNumber()) ||
+		   (number == 0) || (number >= USB_MAX_ALT_SETTINGS) ||
+		   (_alts[number] != nullptr))
+			return false;
+		_alts[number] = &alt;
+		return true;
+	}
+
+	//! Дескриптор с точками настройки alt, nullptr - настройки нет
+	inline const UsbInterfaceDescriptor * altSetting(uint8_t alt) const
+	{
+		if(alt == 0)
+			return this;
+		return (alt < USB_MAX_ALT_SETTINGS) ? _alts[alt] : nullptr;
+	}
+
+	//! Текущая альтернативная настройка
+	inline uint8_t alternate() const { return _alt; }
+
+	//! Время шины, резервируемое точками текущей настройки в (микро)кадре
+	//! на скорости speed, байт. native - скорость, для которой описаны точки.
+	inline uint16_t periodicLoad(UsbSpeedClass speed, UsbSpeedClass native) const
+	{
+		return periodicLoad(speed, native, _alt);
+	}
+
+	inline uint16_t periodicLoad(UsbSpeedClass speed, UsbSpeedClass native, uint8_t alt) const
+	{
+		const UsbInterfaceDescriptor * setting = altSetting(alt);
+		uint16_t load = 0;
+		for(int epnum = 1; (setting != nullptr) && (epnum < UsbInterfaceDescriptor::MaxEndpoints); ++epnum)
 		{
-			_device->setInEndpoint(epnum, static_cast<XUsbInEndpoint*>(getInEndpoint(epnum)));
-			_device->setOutEndpoint(epnum, static_cast<XUsbOutEndpoint*>(getOutEndpoint(epnum)));
+			for(int dir = 0; dir < 2; ++dir)
+			{
+				const UsbEPDescriptor * ep = dir ? setting->getInEndpoint(epnum) : setting->getOutEndpoint(epnum);
+				if(ep == nullptr)
+					continue;
+				uint16_t maxPacket = UsbEPDescriptor::speedMaxPacket(ep->bmAttributes(), ep->wMaxPacketSize(),
+																	 native, speed);
+				load += usbPeriodicBytes(ep->bmAttributes(), maxPacket, speed);
+			}
 		}
+		return load;
 	}
 
-	inline bool isInitialized() const { return _device != nullptr; }
+	//! Наибольшая нагрузка среди альтернативных настроек: полоса резервируется
+	//! под неё, поэтому SET_INTERFACE не может превысить бюджет
+	inline uint16_t periodicPeak(UsbSpeedClass speed, UsbSpeedClass native) const
+	{
+		uint16_t peak = 0;
+		for(int alt = 0; alt < USB_MAX_ALT_SETTINGS; ++alt)
+		{
+			uint16_t load = periodicLoad(speed, native, uint8_t(alt));
+			if(load > peak)
+				peak = load;
+		}
+		return peak;
+	}
 
-	inline void release() { _device = nullptr; }
+	//! Пакеты точек всех настроек на скорости speed, объявляемые хосту в дескрипторах
+	//! (UsbEPDescriptor::speedMaxPacket), помещаются в буферы точек (XUsbEndpoint::capacity)
+	inline bool fitsCapacity(UsbSpeedClass speed, UsbSpeedClass native) const
+	{
+		for(int alt = 0; alt < USB_MAX_ALT_SETTINGS; ++alt)
+		{
+			const UsbInterfaceDescriptor * setting = altSetting(alt);
+			for(int epnum = 1; (setting != nullptr) && (epnum < UsbInterfaceDescriptor::MaxEndpoints); ++epnum)
+			{
+				for(int dir = 0; dir < 2; ++dir)
+				{
+					const XUsbEndpoint * ep = static_cast<const XUsbEndpoint*>(dir ? setting->getInEndpoint(epnum)
+																				   : setting->getOutEndpoint(epnum));
+					if(ep == nullptr)
+						continue;
+					uint16_t maxPacket = UsbEPDescriptor::speedMaxPacket(ep->bmAttributes(), ep->wMaxPacketSize(),
+																		 native, speed);
+					if(uint32_t(maxPacket & 0x07FF) * (((maxPacket >> 11) & 0x03) + 1) > ep->capacity(speed))
+						return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	inline XUsbDevice * device() const { return _device; }
+
+	//! Закрепляет за интерфейсом запрос type/bRequest с получателем "interface".
+	//! Доступно после build(), действует до снятия конфигурации (release).
+	inline bool claimRequest(UsbReqType type, uint8_t bRequest)
+	{
+		return isInitialized() &&
+			   _device->claimRequest(type | REQ_RECIPIENT_INTERFACE, bRequest, bInterfaceNumber(), this);
+	}
+
+	//! Периодическая работа интерфейса по SOF. Доступно после build().
+	inline bool scheduleSof(XUsbSofTask & task, uint16_t phase = 0)
+	{
+		if(!isInitialized())
+			return false;
+		_device->addSofTask(&task, phase);
+		return true;
+	}
+
+	//! Отвязывает интерфейс от устройства (снятие конфигурации, сброс шины)
+	//! и снимает закрепления запросов за ним и точками всех его настроек
+	inline void release()
+	{
+		for(int alt = 0; (_device != nullptr) && (alt < USB_MAX_ALT_SETTINGS); ++alt)
+		{
+			const UsbInterfaceDescriptor * setting = altSetting(alt);
+			for(int epnum = 1; (setting != nullptr) && (epnum < UsbInterfaceDescriptor::MaxEndpoints); ++epnum)
+			{
+				for(int dir = 0; dir < 2; ++dir)
+				{
+					XUsbEndpoint * ep = static_cast<XUsbEndpoint*>(dir ? setting->getInEndpoint(epnum)
+																	   : setting->getOutEndpoint(epnum));
+					if(ep != nullptr)
+						_device->releaseRequests(ep);
+				}
+			}
+		}
+		if(_device != nullptr)
+			_device->releaseRequests(this);
+		_device = nullptr;
+		_alt = 0;
+		_started = false;
+	}
 
 	inline XUsbEndpoint beginEP()
 	{
@@ -450,13 +1935,92 @@ protected:
 		_device->ctlReceive(pbuf, size);
 	}
 
+	inline void ep0Receive(uint16_t size)
+	{
+		_device->ctlReceive(size);
+	}
+
 private:
-	XUsbDevice * _device;
+	friend class XUsbDevice;
+	friend class XUsbConfiguration;
+
+	//! Привязывает к устройству точки текущей настройки (без открытия)
+	//! или отвязывает их с закрытием. Точки других интерфейсов не трогаются.
+	bool bindAlternate(bool bind)
+	{
+		const UsbInterfaceDescriptor * setting = altSetting(_alt);
+		bool bound = true;
+		for(int epnum = 1; epnum < UsbInterfaceDescriptor::MaxEndpoints; ++epnum)
+		{
+			for(int dir = XUsbDevice::EP_DIR_OUT; dir <= XUsbDevice::EP_DIR_IN; ++dir)
+			{
+				XUsbEndpoint * ep = static_cast<XUsbEndpoint*>(dir ? setting->getInEndpoint(epnum)
+																   : setting->getOutEndpoint(epnum));
+				if(ep == nullptr)
+					continue;
+				if(epnum >= USB_MAX_ENDPOINTS)
+				{
+					assert(false);
+					bound = false;
+					continue;
+				}
+				XUsbEndpoint * current = _device->_epStates[dir][epnum].endpoint;
+				if(bind && (current != nullptr) && (current->iface() != this))
+					bound = false;
+				else if(bind)
+					_device->bindEndpoint(dir, epnum, ep, false);
+				else if(current == ep)
+					_device->bindEndpoint(dir, epnum, nullptr, false);
+			}
+		}
+		return bound;
+	}
+
+	XUsbDevice *					_device;
+	uint8_t							_alt;
+	bool							_started;	//!< получил altSelected при установке конфигурации
+	UsbInterfaceDescriptor *		_alts[USB_MAX_ALT_SETTINGS];	//!< [0] не используется: нулевая - сам интерфейс
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////
 
+//! Альтернативная настройка интерфейса iface со своими точками. Точки
+//! принадлежат интерфейсу и обслуживаются им, пока настройка выбрана.
+//!
+//!	XUsbAltSetting alt(cfg.beginInterface(), itf);
+//!	alt.init(0, 1, ...);
+//!	XUsbEndpoint ep = alt.beginEP(); ...; alt.endEP(stream);
+//!	cfg.endAlternate(itf, alt);
+class XUsbAltSetting :
+		public UsbInterfaceDescriptor
+{
+public:
+	XUsbAltSetting(const UsbInterfaceDescriptor & self, XUsbIface & iface) :
+		UsbInterfaceDescriptor(self),
+		_iface(&iface)
+	{}
+
+	inline XUsbEndpoint beginEP()
+	{
+		return XUsbEndpoint(UsbInterfaceDescriptor::beginEP(), _iface);
+	}
+
+	inline bool endEP(XUsbEndpoint & ep) { return UsbInterfaceDescriptor::endEP(ep); }
+
+	inline XUsbIface * iface() const { return _iface; }
+
+private:
+	XUsbIface *	_iface;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Интерфейсов в конфигурации (номера 0..USB_MAX_IFACES-1)
+#ifdef USB_MAX_INTERFACES
+#define USB_MAX_IFACES USB_MAX_INTERFACES
+#else
 #define USB_MAX_IFACES 8
+#endif
 
 class __packed XUsbConfiguration :
 	public UsbConfigDescriptor
@@ -472,9 +2036,26 @@ public:
 	}
 	ErrCode;
 
-	explicit XUsbConfiguration(const UsbConfigDescriptor & other) :
+	explicit XUsbConfiguration(const UsbConfigDescriptor & other,
+							   UsbSpeedClass speed = UsbSpeed_Full) :
 		UsbConfigDescriptor(other),
-		_iface(0)
+		_speed(speed),
+		_tail(&_head),
+		_fragLength(0)
+	{
+		for(int i = 0; i < USB_MAX_IFACES; ++i)
+			_interfaces[i] = nullptr;
+	}
+
+	//! Конфигурация поверх готового дескриптора во flash (usbstaticdescriptors.h).
+	//! Дескриптор не изменяется, интерфейсы подключаются через bindInterface().
+	explicit XUsbConfiguration(const uint8_t * descriptor,
+							   UsbSpeedClass speed = UsbSpeed_Full) :
+		UsbConfigDescriptor(const_cast<uint8_t*>(descriptor),
+							uint16_t(descriptor[2] | (descriptor[3] << 8))),
+		_speed(speed),
+		_tail(&_head),
+		_fragLength(0)
 	{
 		for(int i = 0; i < USB_MAX_IFACES; ++i)
 			_interfaces[i] = nullptr;
@@ -482,15 +2063,14 @@ public:
 
 	virtual ~XUsbConfiguration() {}
 
+	//! Скорость, для которой описаны точки. На другой скорости дескриптор
+	//! и точки пересчитываются (UsbEPDescriptor::speedMaxPacket).
+	inline UsbSpeedClass speed() const { return _speed; }
+
 	inline bool initIface(uint8_t idx, XUsbDevice * device) const
 	{
-		if((idx < USB_MAX_IFACES) && (_interfaces[idx] != nullptr))
-		{
-			_interfaces[idx]->build(device);
-			return true;
-		}
-
-		return false;
+		return (idx < USB_MAX_IFACES) && (_interfaces[idx] != nullptr) &&
+			   _interfaces[idx]->build(device);
 	}
 
 	inline bool initDefaultIface(XUsbDevice * device) const
@@ -498,39 +2078,175 @@ public:
 		return initIface(DefaultIface, device);
 	}
 
+	//! Подключает к устройству все интерфейсы конфигурации (составное устройство).
+	//! false - нет интерфейсов или два интерфейса используют один номер точки.
+	inline bool initIfaces(XUsbDevice * device) const
+	{
+		bool found = false;
+		for(int i = 0; i < USB_MAX_IFACES; ++i)
+		{
+			if(_interfaces[i] == nullptr)
+				continue;
+			if(!_interfaces[i]->build(device))
+				return false;
+			found = true;
+		}
+		return found;
+	}
+
+	//! Снимает интерфейсы конфигурации с устройства: точки текущих
+	//! настроек закрываются и отвязываются. altDeselected получают только
+	//! интерфейсы, запущенные startIfaces(): при отказе openEndpoints()
+	//! в установке конфигурации потоки ещё не запускались.
 	inline void deInit()
 	{
-		//! @todo
+		for(int i = 0; i < USB_MAX_IFACES; ++i)
+		{
+			XUsbIface * target = _interfaces[i];
+			if((target == nullptr) || !target->isInitialized())
+				continue;
+			if(target->_started)
+				target->altDeselected(target->alternate());
+			target->bindAlternate(false);
+			target->release();
+		}
+	}
+
+	//! Сообщает интерфейсам о выбранной настройке после открытия точек
+	inline void startIfaces()
+	{
+		for(int i = 0; i < USB_MAX_IFACES; ++i)
+		{
+			XUsbIface * target = _interfaces[i];
+			if((target == nullptr) || !target->isInitialized())
+				continue;
+			target->_started = true;
+			target->altSelected(target->alternate());
+		}
 	}
 
-	inline bool setupRequest(uint8_t iface, UsbSetupRequest * req)
+	inline XUsbIface * iface(uint8_t idx) const
 	{
-		return _interfaces[iface]->setupRequest(req);
+		return (idx < USB_MAX_IFACES) ? _interfaces[idx] : nullptr;
 	}
 
-	inline void ep0RxReady(UsbSetupRequest * req)
+	inline bool setupRequest(uint8_t idx, UsbSetupRequest * req)
 	{
-		_interfaces[_iface]->ep0RxReady(req);
+		XUsbIface * target = iface(idx);
+		return (target != nullptr) && target->setupRequest(req);
 	}
 
-	inline void ep0TxSent(UsbSetupRequest * req)
+	//! Запрос ко всему устройству (SET/CLEAR_FEATURE DEVICE_REMOTE_WAKEUP)
+	//! сообщается каждой функции составного устройства
+	inline void broadcastRequest(UsbSetupRequest * req)
 	{
-		_interfaces[_iface]->ep0TxSent(req);
+		for(int i = 0; i < USB_MAX_IFACES; ++i)
+			if((_interfaces[i] != nullptr) && _interfaces[i]->isInitialized())
+				_interfaces[i]->setupRequest(req);
 	}
 
 	inline bool endInterface(XUsbIface & iface)
+	{
+		//! Интерфейсы в буфере дескриптора должны идти до внешних фрагментов
+		if(_fragLength != 0)
+			return false;
+		if(!registerIface(iface))
+			return false;
+		return UsbConfigDescriptor::endInterface(iface);
+	}
+
+	//! IAD добавляется перед первым интерфейсом функции:
+	//!
+	//!	UsbIfaceAssocDescriptor iad(cfg.beginAssociation());
+	//!	iad.init(0, 2, 0x02, 0x02, 0x01, UsbStringDescriptor());
+	//!	cfg.endAssociation(iad);
+	inline bool endAssociation(const UsbIfaceAssocDescriptor & iad)
+	{
+		if((_fragLength != 0) || (iad.bInterfaceCount() == 0) ||
+		   (uint16_t(iad.bFirstInterface()) + iad.bInterfaceCount() > USB_MAX_IFACES))
+			return false;
+		return UsbConfigDescriptor::endAssociation(iad);
+	}
+
+	//! Завершает альтернативную настройку интерфейса, добавленного endInterface()
+	inline bool endAlternate(XUsbIface & iface, XUsbAltSetting & alt)
+	{
+		if((_fragLength != 0) || (alt.iface() != &iface) || (iface.bInterfaceNumber() >= USB_MAX_IFACES) ||
+		   (_interfaces[iface.bInterfaceNumber()] != &iface))
+			return false;
+		return iface.addAlternate(alt) && UsbConfigDescriptor::endAlternate(alt);
+	}
+
+	//! Регистрирует альтернативную настройку, дескриптор которой уже входит в конфигурацию
+	inline bool bindAlternate(XUsbIface & iface, XUsbAltSetting & alt)
+	{
+		return (alt.iface() == &iface) && iface.addAlternate(alt);
+	}
+
+	//! Остаток периодической полосы (микро)кадра при скорости speed, байт.
+	//! Интерфейс занимает наибольшую нагрузку среди своих альтернативных
+	//! настроек, как в usbPeriodicRemaining(). Отрицательное значение -
+	//! конфигурация не может быть установлена.
+	inline int32_t periodicRemaining(UsbSpeedClass speed) const
+	{
+		int32_t remaining = usbPeriodicBudget(speed);
+		for(int i = 0; i < USB_MAX_IFACES; ++i)
+			if(_interfaces[i] != nullptr)
+				remaining -= _interfaces[i]->periodicPeak(speed, _speed);
+		return remaining;
+	}
+
+	//! Точки всех интерфейсов принимают пакеты, объявляемые для скорости speed
+	inline bool fitsCapacity(UsbSpeedClass speed) const
+	{
+		for(int i = 0; i < USB_MAX_IFACES; ++i)
+			if((_interfaces[i] != nullptr) && !_interfaces[i]->fitsCapacity(speed, _speed))
+				return false;
+		return true;
+	}
+
+	//! Регистрирует интерфейс, дескриптор которого уже входит в конфигурацию
+	inline bool bindInterface(XUsbIface & iface) { return registerIface(iface); }
+
+	//! Добавляет в конец дескриптора конфигурации внешний фрагмент.
+	//! Если передан iface, фрагмент начинается с его дескриптора интерфейса.
+	//! Размер фрагмента после добавления меняться не должен, содержимое - может.
+	inline bool appendFragment(XUsbFragment & frag, XUsbIface * iface = nullptr)
+	{
+		if((iface != nullptr) && !registerIface(*iface))
+			return false;
+		if(!UsbConfigDescriptor::extend(frag.size(), (iface != nullptr) ? 1 : 0))
+			return false;
+		frag.setNext(nullptr);
+		_tail->setNext(&frag);
+		_tail = &frag;
+		_fragLength += frag.size();
+		return true;
+	}
+
+	//! Полный дескриптор конфигурации: буфер построителя и внешние фрагменты
+	inline const XUsbFragment * fragments()
+	{
+		_head = XUsbFragment(data(), wTotalLength() - _fragLength, _head.next());
+		return &_head;
+	}
+
+private:
+	inline bool registerIface(XUsbIface & iface)
 	{
 		uint8_t ifaceNum = iface.bInterfaceNumber();
-		if((ifaceNum > USB_MAX_INTERFACES) ||
+		if((ifaceNum >= USB_MAX_IFACES) ||
 			(_interfaces[ifaceNum] != nullptr))
 			return false;
 		_interfaces[ifaceNum] = &iface;
-		return UsbConfigDescriptor::endInterface(iface);
+		return true;
 	}
 
-private:
-	uint8_t			_iface;
+	UsbSpeedClass	_speed;
 	XUsbIface 	* 	_interfaces[USB_MAX_IFACES];
+	XUsbFragment	_head;
+	XUsbFragment *	_tail;
+	uint16_t		_fragLength;
 };
 
 #endif /* XUSBDEVICE_H_ */
@@ -0,0 +1,327 @@
+/*
+ * XUsbIsoStream.h
+ */
+
+#ifndef XUSBISOSTREAM_H_
+#define XUSBISOSTREAM_H_
+
+//! Изохронные потоки: кольцо пакетов, передача по кадрам и учёт потерь.
+//!
+//!	class MicIn : public XUsbIsoInStream<192, 8>
+//!	{
+//!		...
+//!		virtual void isoEvent(XUsbIsoEvent event, uint16_t frame) override;
+//!	};
+//!
+//! Приложение заполняет кольцо (acquire/commit или write), поток отправляет
+//! по пакету в интервал точки. Интерфейс запускает поток start() в altSelected()
+//! настройки, к которой относится точка, и останавливает stop() в altDeselected().
+//! Каждая потеря учитывается в isoStats() и сообщается классу через isoEvent().
+//! Индексы кольца пишет только одна сторона: голову - производитель,
+//! хвост - потребитель, поэтому кольцо не требует запрета прерываний.
+
+#include "XUsbDevice.h"
+#include <string.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+typedef enum
+{
+	ISO_INCOMPLETE,		//!< передача не состоялась в своём кадре (прерывание incomplete iso)
+	ISO_MISSED,			//!< OUT: за интервал не принято ни одного пакета
+	ISO_UNDERRUN,		//!< IN: к интервалу в кольце нет данных
+	ISO_OVERRUN			//!< OUT: кольцо заполнено, принятый пакет отброшен
+}
+XUsbIsoEvent;
+
+typedef struct
+{
+	uint32_t	packets;		//!< переданных (принятых) пакетов, high-bandwidth - микрокадров
+	uint32_t	incomplete;
+	uint32_t	missed;
+	uint32_t	underruns;
+	uint32_t	overruns;
+}
+XUsbIsoStats;
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Общая часть потоков: задача SOF с периодом обслуживания точки и счётчики
+template<uint16_t PayloadSize, uint8_t Depth>
+class XUsbIsoRing :
+		public XUsbSofTask
+{
+	static_assert((Depth >= 2) && (Depth <= 128) && ((Depth & (Depth - 1)) == 0),
+				  "ring depth must be a power of two, 2..128");
+
+public:
+	//! Шаг кольца кратен слову: буферы DMA ядра OTG выровнены
+	static const uint16_t Stride = (PayloadSize + 3) & ~3;
+
+	inline XUsbIsoStats isoStats() const { return _stats; }
+
+	//! Пакетов в кольце
+	inline uint8_t queued() const { return uint8_t(_head - _tail); }
+
+	inline bool isStreaming() const { return isScheduled(); }
+
+protected:
+	//! Пакет точки на текущей скорости помещается в слот кольца
+	static inline bool fits(const XUsbEndpoint & ep)
+	{
+		return uint32_t(ep.maxPacket()) * ep.transactions() <= PayloadSize;
+	}
+
+	XUsbIsoRing() :
+		_head(0),
+		_tail(0),
+		_active(false)
+	{
+		memset(&_stats, 0, sizeof(_stats));
+	}
+
+	inline uint8_t * slot(uint8_t index) { return _ring[index & (Depth - 1)]; }
+
+	inline void reset()
+	{
+		_head = 0;
+		_tail = 0;
+		_active = false;
+	}
+
+	volatile uint8_t	_head;
+	volatile uint8_t	_tail;
+	//! IN: пакет отдан контроллеру; OUT: с прошлого SOF принят пакет
+	bool				_active;
+	XUsbIsoStats		_stats;
+	uint16_t			_sizes[Depth];
+	uint8_t				_ring[Depth][Stride] __attribute__((aligned(4)));
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Изохронный IN-поток: Depth пакетов до PayloadSize байт (для high-bandwidth -
+//! данные микрокадра). Следующий пакет отдаётся контроллеру сразу по завершении
+//! предыдущего и уходит в следующем интервале; SOF перезапускает поток после
+//! опустошения кольца.
+template<uint16_t PayloadSize, uint8_t Depth>
+class XUsbIsoInStream :
+		public XUsbInEndpoint,
+		public XUsbIsoRing<PayloadSize, Depth>
+{
+	typedef XUsbIsoRing<PayloadSize, Depth> Ring;
+
+public:
+	explicit XUsbIsoInStream(const XUsbEndpoint & source) :
+		XUsbInEndpoint(source)
+	{}
+
+	//! Пакет больше PayloadSize не устанавливается (XUsbEndpoint::capacity)
+	virtual uint16_t capacity(UsbSpeedClass) const override { return PayloadSize; }
+
+	//! Вызывается интерфейсом после открытия точки
+	inline bool start()
+	{
+		Ring::reset();
+		return (iface() != nullptr) && Ring::fits(*this) && iface()->scheduleSof(*this);
+	}
+
+	inline void stop()
+	{
+		if(Ring::isScheduled())
+			iface()->device()->removeSofTask(this);
+		if(Ring::_active)
+			flush();
+		Ring::_active = false;
+	}
+
+	//! Буфер следующего пакета, nullptr - кольцо заполнено
+	inline uint8_t * acquire()
+	{
+		return (Ring::queued() < Depth) ? Ring::slot(Ring::_head) : nullptr;
+	}
+
+	inline void commit(uint16_t size)
+	{
+		assert(size <= PayloadSize);
+		Ring::_sizes[Ring::_head & (Depth - 1)] = size;
+		Ring::_head = uint8_t(Ring::_head + 1);
+	}
+
+	inline bool write(const uint8_t * data, uint16_t size)
+	{
+		uint8_t * buffer = acquire();
+		if(buffer == nullptr)
+			return false;
+		memcpy(buffer, data, size);
+		commit(size);
+		return true;
+	}
+
+	virtual bool epDataIn(uint8_t *) override
+	{
+		Ring::_active = false;
+		Ring::_tail = uint8_t(Ring::_tail + 1);
+		++Ring::_stats.packets;
+		submit();
+		return true;
+	}
+
+	virtual void isoIncomplete(uint16_t frame) override
+	{
+		//! Пакет не потерян: уходит в следующем кадре
+		XUsbInEndpoint::isoIncomplete(frame);
+		++Ring::_stats.incomplete;
+		isoEvent(ISO_INCOMPLETE, frame);
+	}
+
+	virtual void sofTick(uint16_t frame) override
+	{
+		Ring::setPeriod(isoPeriod());
+		if(Ring::_active)
+			return;
+		if(!submit())
+		{
+			++Ring::_stats.underruns;
+			isoEvent(ISO_UNDERRUN, frame);
+		}
+	}
+
+	//! Потеря в потоке, вызывается из прерывания USB
+	virtual void isoEvent(XUsbIsoEvent /*event*/, uint16_t /*frame*/) {}
+
+private:
+	inline bool submit()
+	{
+		if(Ring::queued() == 0)
+			return false;
+		uint8_t index = Ring::_tail & (Depth - 1);
+		Ring::_active = true;
+		transmit(Ring::slot(index), Ring::_sizes[index]);
+		return true;
+	}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Изохронный OUT-поток: приём идёт в свободный пакет кольца, при заполненном
+//! кольце - в запасной буфер, принятое в него отбрасывается (ISO_OVERRUN).
+//! Интервал без принятого пакета после начала потока - ISO_MISSED.
+template<uint16_t PayloadSize, uint8_t Depth>
+class XUsbIsoOutStream :
+		public XUsbOutEndpoint,
+		public XUsbIsoRing<PayloadSize, Depth>
+{
+	typedef XUsbIsoRing<PayloadSize, Depth> Ring;
+
+public:
+	explicit XUsbIsoOutStream(const XUsbEndpoint & source) :
+		XUsbOutEndpoint(source),
+		_armed(Depth),
+		_started(false)
+	{}
+
+	//! Пакет больше PayloadSize не устанавливается (XUsbEndpoint::capacity)
+	virtual uint16_t capacity(UsbSpeedClass) const override { return PayloadSize; }
+
+	//! Вызывается интерфейсом после открытия точки. false - пакет точки
+	//! не помещается в слот кольца, хост переполнил бы буфер.
+	inline bool start()
+	{
+		Ring::reset();
+		_started = false;
+		if((iface() == nullptr) || !Ring::fits(*this) || !iface()->scheduleSof(*this))
+			return false;
+		arm();
+		return true;
+	}
+
+	inline void stop()
+	{
+		if(Ring::isScheduled())
+			iface()->device()->removeSofTask(this);
+		flush();
+	}
+
+	//! Самый старый принятый пакет, nullptr - кольцо пусто
+	inline const uint8_t * peek(uint16_t & size)
+	{
+		if(Ring::queued() == 0)
+			return nullptr;
+		size = Ring::_sizes[Ring::_tail & (Depth - 1)];
+		return Ring::slot(Ring::_tail);
+	}
+
+	inline void release()
+	{
+		if(Ring::queued() != 0)
+			Ring::_tail = uint8_t(Ring::_tail + 1);
+	}
+
+	virtual bool epDataOut(uint8_t *) override
+	{
+		uint16_t size = rxCount();
+		_started = true;
+		Ring::_active = true;
+
+		if(!rxComplete())
+		{
+			//! Микрокадр high-bandwidth без завершающего пакета
+			++Ring::_stats.incomplete;
+			isoEvent(ISO_INCOMPLETE, XUsbPort::frameNumber(handle()));
+		}
+		else if(_armed == Depth)
+		{
+			++Ring::_stats.overruns;
+			isoEvent(ISO_OVERRUN, XUsbPort::frameNumber(handle()));
+		}
+		else
+		{
+			Ring::_sizes[_armed] = size;
+			Ring::_head = uint8_t(Ring::_head + 1);
+			++Ring::_stats.packets;
+		}
+
+		arm();
+		return true;
+	}
+
+	virtual void isoIncomplete(uint16_t frame) override
+	{
+		XUsbOutEndpoint::isoIncomplete(frame);
+		++Ring::_stats.incomplete;
+		isoEvent(ISO_INCOMPLETE, frame);
+	}
+
+	virtual void sofTick(uint16_t frame) override
+	{
+		Ring::setPeriod(isoPeriod());
+		if(_started && !Ring::_active)
+		{
+			++Ring::_stats.missed;
+			isoEvent(ISO_MISSED, frame);
+		}
+		Ring::_active = false;
+	}
+
+	//! Потеря в потоке, вызывается из прерывания USB
+	virtual void isoEvent(XUsbIsoEvent /*event*/, uint16_t /*frame*/) {}
+
+private:
+	//! Приём в пакет под головой кольца, потребителю он станет виден после завершения.
+	//! Длина приёма не больше слота, даже если точку открыли с большим пакетом.
+	inline void arm()
+	{
+		_armed = (Ring::queued() < Depth) ? uint8_t(Ring::_head & (Depth - 1)) : Depth;
+		uint32_t length = uint32_t(maxPacket()) * transactions();
+		receive((_armed == Depth) ? _spare : Ring::_ring[_armed],
+				uint16_t((length < PayloadSize) ? length : PayloadSize));
+	}
+
+	uint8_t		_armed;			//!< пакет кольца под приёмом, Depth - запасной буфер
+	bool		_started;
+	//! Приём при заполненном кольце, содержимое отбрасывается
+	uint8_t		_spare[Ring::Stride] __attribute__((aligned(4)));
+};
+
+#endif /* XUSBISOSTREAM_H_ */
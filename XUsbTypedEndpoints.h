@@ -0,0 +1,207 @@
+/*
+ * XUsbTypedEndpoints.h
+ */
+
+#ifndef XUSBTYPEDENDPOINTS_H_
+#define XUSBTYPEDENDPOINTS_H_
+
+//! Точки с направлением, типом и размером буфера, заданными при компиляции:
+//!
+//!	class DataIn : public BulkIn<1, 64, 2> { ... };
+//!
+//!	static constexpr auto Config =
+//!		usbConfiguration(1, 0, 0x80, 50,
+//!			usbInterface(0, 0, 0xFF, 0, 0, 0,
+//!				DataIn::descriptor() + DataOut::descriptor()));
+//!
+//! Дескриптор точки строится из тех же параметров, что и буфер, поэтому
+//! wMaxPacketSize в конфигурации и размер буфера не расходятся.
+
+#include "XUsbDevice.h"
+#include "usbstaticdescriptors.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Наименьшая скорость, на которой допустим wMaxPacketSize точки
+constexpr UsbSpeedClass usbEndpointSpeed(UsbEPType type, uint16_t maxPacket)
+{
+	return usbMaxPacketValid(type, maxPacket, UsbSpeed_Full) ? UsbSpeed_Full : UsbSpeed_High;
+}
+
+//! Байт данных в одном (микро)кадре с учетом дополнительных транзакций (биты 12..11)
+constexpr uint16_t usbEndpointPayload(uint16_t maxPacket)
+{
+	return uint16_t((maxPacket & 0x07FF) * (((maxPacket >> 11) & 0x03) + 1));
+}
+
+//! Емкость буфера под обе скорости
+constexpr uint16_t usbEndpointBuffer(uint16_t fullCapacity, uint16_t highCapacity)
+{
+	return (fullCapacity > highCapacity) ? fullCapacity : highCapacity;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Capacity - емкость буфера на full-speed, HighCapacity - на high-speed
+//! (пакет bulk, описанной для full-speed, там 512 байт). Буфер выделяется
+//! под большую из них, конфигурация на скорости, где пакет не помещается
+//! в емкость, не устанавливается.
+template<uint8_t EP,
+		 UsbEPType Type,
+		 uint16_t MaxPacket,
+		 uint8_t Interval,
+		 uint16_t Capacity,
+		 uint16_t HighCapacity = Capacity>
+class XUsbTypedInEndpoint :
+		public XUsbInEndpoint
+{
+	static_assert(Capacity >= usbEndpointPayload(MaxPacket), "buffer is smaller than one transaction");
+
+public:
+	static constexpr uint8_t Address = 0x80 | EP;
+	static constexpr uint16_t BufferSize = usbEndpointBuffer(Capacity, HighCapacity);
+	static constexpr uint16_t PacketSize = MaxPacket & 0x07FF;
+	static constexpr uint8_t Transactions = ((MaxPacket >> 11) & 0x03) + 1;
+
+	static constexpr UsbDescBlob<UsbEPDescriptor::DEFAULT_LENGTH> descriptor()
+	{
+		return usbEndpoint<Address, Type, MaxPacket, Interval, usbEndpointSpeed(Type, MaxPacket)>();
+	}
+
+	explicit XUsbTypedInEndpoint(XUsbIface * iface) :
+		XUsbInEndpoint(XUsbEndpoint(UsbEPDescriptor(const_cast<uint8_t*>(Descriptor.data()),
+													UsbEPDescriptor::DEFAULT_LENGTH),
+									iface))
+	{
+		if(iface != nullptr)
+			iface->bindEP(*this);
+	}
+
+	virtual uint16_t capacity(UsbSpeedClass speed) const override
+	{
+		return (speed == UsbSpeed_High) ? HighCapacity : Capacity;
+	}
+
+	inline uint8_t * buffer() { return _buffer; }
+
+	//! Отправляет size байт из собственного буфера
+	inline void transmit(uint16_t size)
+	{
+		assert(size <= BufferSize);
+		transmit(_buffer, size);
+	}
+
+	//! Для high-bandwidth точки число пакетов микрокадра известно при компиляции
+	inline void transmit(uint8_t * pbuf, uint16_t size)
+	{
+		if(Transactions > 1)
+			XUsbPort::transmitPeriodic(handle(), Address, pbuf, size, periodicCount(size, PacketSize));
+		else
+			XUsbPort::transmit(handle(), Address, pbuf, size);
+	}
+
+private:
+	static constexpr UsbDescBlob<UsbEPDescriptor::DEFAULT_LENGTH> Descriptor = descriptor();
+
+	//! Выравнивание по слову нужно DMA ядра OTG
+	uint8_t _buffer[BufferSize] __attribute__((aligned(4)));
+};
+
+template<uint8_t EP, UsbEPType Type, uint16_t MaxPacket, uint8_t Interval, uint16_t Capacity, uint16_t HighCapacity>
+constexpr UsbDescBlob<UsbEPDescriptor::DEFAULT_LENGTH>
+XUsbTypedInEndpoint<EP, Type, MaxPacket, Interval, Capacity, HighCapacity>::Descriptor;
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+template<uint8_t EP,
+		 UsbEPType Type,
+		 uint16_t MaxPacket,
+		 uint8_t Interval,
+		 uint16_t Capacity,
+		 uint16_t HighCapacity = Capacity>
+class XUsbTypedOutEndpoint :
+		public XUsbOutEndpoint
+{
+	static_assert(Capacity >= usbEndpointPayload(MaxPacket), "buffer is smaller than one transaction");
+
+public:
+	static constexpr uint8_t Address = EP;
+	static constexpr uint16_t BufferSize = usbEndpointBuffer(Capacity, HighCapacity);
+
+	static constexpr UsbDescBlob<UsbEPDescriptor::DEFAULT_LENGTH> descriptor()
+	{
+		return usbEndpoint<Address, Type, MaxPacket, Interval, usbEndpointSpeed(Type, MaxPacket)>();
+	}
+
+	explicit XUsbTypedOutEndpoint(XUsbIface * iface) :
+		XUsbOutEndpoint(XUsbEndpoint(UsbEPDescriptor(const_cast<uint8_t*>(Descriptor.data()),
+													 UsbEPDescriptor::DEFAULT_LENGTH),
+									 iface))
+	{
+		if(iface != nullptr)
+			iface->bindEP(*this);
+	}
+
+	virtual uint16_t capacity(UsbSpeedClass speed) const override
+	{
+		return (speed == UsbSpeed_High) ? HighCapacity : Capacity;
+	}
+
+	inline uint8_t * buffer() { return _buffer; }
+
+	//! Принимает в собственный буфер на его емкость для текущей скорости шины
+	inline void receive()
+	{
+		UsbSpeedClass speed = ((iface() != nullptr) && iface()->isInitialized()) ?
+							  iface()->device()->speed() : usbEndpointSpeed(Type, MaxPacket);
+		XUsbPort::receive(handle(), Address, _buffer, capacity(speed));
+	}
+
+	inline void receive(uint8_t * pbuf, uint16_t size)
+	{
+		XUsbPort::receive(handle(), Address, pbuf, size);
+	}
+
+	inline uint16_t rxCount() const
+	{
+		return uint16_t(XUsbPort::rxCount(handle(), Address));
+	}
+
+private:
+	static constexpr UsbDescBlob<UsbEPDescriptor::DEFAULT_LENGTH> Descriptor = descriptor();
+
+	//! Выравнивание по слову нужно DMA ядра OTG
+	uint8_t _buffer[BufferSize] __attribute__((aligned(4)));
+};
+
+template<uint8_t EP, UsbEPType Type, uint16_t MaxPacket, uint8_t Interval, uint16_t Capacity, uint16_t HighCapacity>
+constexpr UsbDescBlob<UsbEPDescriptor::DEFAULT_LENGTH>
+XUsbTypedOutEndpoint<EP, Type, MaxPacket, Interval, Capacity, HighCapacity>::Descriptor;
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Bulk: буфер на Depth пакетов. HighMPS - пакет на high-speed, для точки,
+//! описанной для full-speed, на high-speed работает только HighMPS = 512.
+template<uint8_t EP, uint16_t MPS, uint8_t Depth = 1, uint16_t HighMPS = MPS>
+using BulkIn = XUsbTypedInEndpoint<EP, UsbEPType_Bulk, MPS, 0, MPS * Depth, HighMPS * Depth>;
+
+template<uint8_t EP, uint16_t MPS, uint8_t Depth = 1, uint16_t HighMPS = MPS>
+using BulkOut = XUsbTypedOutEndpoint<EP, UsbEPType_Bulk, MPS, 0, MPS * Depth, HighMPS * Depth>;
+
+//! Interrupt: буфер на один пакет, Interval - bInterval
+template<uint8_t EP, uint16_t MPS, uint8_t Interval = 1>
+using IntrIn = XUsbTypedInEndpoint<EP, UsbEPType_Interrupt, MPS, Interval, MPS>;
+
+template<uint8_t EP, uint16_t MPS, uint8_t Interval = 1>
+using IntrOut = XUsbTypedOutEndpoint<EP, UsbEPType_Interrupt, MPS, Interval, MPS>;
+
+//! Isochronous: Mult транзакций по MPS байт в микрокадре (Mult > 1 - только high-speed)
+template<uint8_t EP, uint16_t MPS, uint8_t Mult = 1, uint8_t Interval = 1>
+using IsoIn = XUsbTypedInEndpoint<EP, UsbEPType_Isochronous,
+								  uint16_t(MPS | ((Mult - 1) << 11)), Interval, MPS * Mult>;
+
+template<uint8_t EP, uint16_t MPS, uint8_t Mult = 1, uint8_t Interval = 1>
+using IsoOut = XUsbTypedOutEndpoint<EP, UsbEPType_Isochronous,
+									uint16_t(MPS | ((Mult - 1) << 11)), Interval, MPS * Mult>;
+
+#endif /* XUSBTYPEDENDPOINTS_H_ */
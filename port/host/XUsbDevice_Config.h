@@ -0,0 +1,200 @@
+/*
+ * XUsbDevice_Config.h
+ *
+ *  Created on: Sep 3, 2017
+ *      Author: ivan
+ */
+
+#ifndef XUSBDEVICE_CONFIG_H_
+#define XUSBDEVICE_CONFIG_H_
+#include <stdint.h>
+
+#define USB_MAX_EP0_SIZE 	64
+#define USB_MAX_CONFIGS		2
+#define USB_MAX_STRINGS		16
+#define USB_MAX_INTERFACES 	4
+
+//! Общий буфер фазы данных control OUT, не меньше USB_MAX_EP0_SIZE.
+//! Задаётся и флагом компилятора, см. port/host/test/run.sh.
+#ifndef USB_EP0_BUFFER_SIZE
+#define USB_EP0_BUFFER_SIZE	USB_MAX_EP0_SIZE
+#endif
+
+//! Размер таблицы закреплённых запросов class/vendor, степень двойки
+#define USB_MAX_REQUEST_CLAIMS	8
+
+//! Размер индекса дескрипторов GET_DESCRIPTOR, степень двойки
+#define USB_MAX_DESCRIPTORS		32
+
+//! Арена дескрипторов устройства: буфер на каждую конфигурацию
+//! и в среднем байт UTF-8 на копируемую строку
+#define USB_MAX_CONFIG_SIZE		128
+#define USB_MAX_STRING_SIZE		16
+
+//! Контроллер для сборки на хосте (симуляция, заглушки в тестах).
+//! Объект передаётся устройству вместо handle, поэтому в одной программе
+//! может работать несколько устройств с разными реализациями.
+class XUsbHostBackend
+{
+public:
+	virtual ~XUsbHostBackend() {}
+
+	virtual void setAddress(uint8_t addr) = 0;
+
+	//! Скорость после сброса шины и её допустимость для контроллера
+	virtual bool isHighSpeed() { return false; }
+
+	virtual bool isHighSpeedCapable() { return false; }
+
+	//! Контроллер принимает токены LPM (переход в L1)
+	virtual bool isLpmCapable() { return false; }
+
+	//! Сигнал resume на шине (remote wakeup)
+	virtual void remoteWakeupSignal(bool /*active*/) {}
+
+	//! Миллисекундный счётчик и задержка
+	virtual uint32_t ticks() { return 0; }
+
+	virtual void delay(uint32_t /*ms*/) {}
+
+	//! Запрет обработки событий контроллера, unlock получает значение lock
+	virtual uint32_t lock() { return 0; }
+
+	virtual void unlock(uint32_t /*state*/) {}
+
+	//! Номер последнего SOF, если hasFrameNumber(), и счётчик тактов
+	virtual uint16_t frameNumber() { return 0; }
+
+	virtual bool hasFrameNumber() { return false; }
+
+	virtual uint32_t cycles() { return 0; }
+
+	//! Перенацеливает ожидающую изохронную передачу на следующий (микро)кадр
+	virtual void isoNextFrame(uint8_t /*ep_addr*/) {}
+
+	virtual void openEP(uint8_t ep_addr, uint16_t ep_mps, uint8_t ep_type) = 0;
+
+	virtual void closeEP(uint8_t ep_addr) = 0;
+
+	//! Объём FIFO контроллера в 32-битных словах
+	virtual uint16_t fifoWords() { return 320; }
+
+	//! Разбиение FIFO в словах: RX и нулевая точка при сбросе шины (planRxFifo),
+	//! TX FIFO 1..count-1 при выборе конфигурации (planFifos)
+	virtual void setFifos(uint16_t /*rx*/, uint16_t /*tx0*/) {}
+
+	virtual void setTxFifos(const uint16_t * /*tx*/, uint8_t /*count*/) {}
+
+	virtual void transmit(uint8_t ep_addr, uint8_t * pbuf, uint16_t size) = 0;
+
+	virtual void receive(uint8_t ep_addr, uint8_t * pbuf, uint16_t size) = 0;
+
+	//! high-bandwidth: transactions пакетов в микрокадре
+	virtual void transmitPeriodic(uint8_t ep_addr, uint8_t * pbuf, uint16_t size, uint8_t /*transactions*/)
+	{
+		transmit(ep_addr, pbuf, size);
+	}
+
+	//! Транзакций микрокадра, объявленных хостом для последней приёмной передачи, 0 - неполная
+	virtual uint8_t rxTransactions(uint8_t /*ep_addr*/) { return 1; }
+
+	virtual void stallEP(uint8_t ep_addr) = 0;
+
+	virtual void clearStallEP(uint8_t ep_addr) = 0;
+
+	virtual bool isStallEP(uint8_t ep_addr) = 0;
+
+	virtual void flushEP(uint8_t ep_addr) = 0;
+
+	virtual uint32_t rxCount(uint8_t ep_addr) = 0;
+};
+
+struct XUsbHostPort
+{
+	static inline XUsbHostBackend * backend(void * handle)
+	{
+		return static_cast<XUsbHostBackend*>(handle);
+	}
+
+	static inline bool isHighSpeed(void * handle) { return backend(handle)->isHighSpeed(); }
+
+	static inline bool isHighSpeedCapable(void * handle) { return backend(handle)->isHighSpeedCapable(); }
+
+	static inline bool isLpmCapable(void * handle) { return backend(handle)->isLpmCapable(); }
+
+	static inline void remoteWakeupSignal(void * handle, bool active)
+	{
+		backend(handle)->remoteWakeupSignal(active);
+	}
+
+	static inline uint32_t ticks(void * handle) { return backend(handle)->ticks(); }
+
+	static inline void delay(void * handle, uint32_t ms) { backend(handle)->delay(ms); }
+
+	static inline uint32_t lock(void * handle) { return backend(handle)->lock(); }
+
+	static inline void unlock(void * handle, uint32_t state) { backend(handle)->unlock(state); }
+
+	static inline uint16_t frameNumber(void * handle) { return backend(handle)->frameNumber(); }
+
+	static inline bool hasFrameNumber(void * handle) { return backend(handle)->hasFrameNumber(); }
+
+	static inline void enableCycleCounter(void * /*handle*/) {}
+
+	static inline uint32_t cycles(void * handle) { return backend(handle)->cycles(); }
+
+	static inline void isoNextFrame(void * handle, uint8_t ep_addr) { backend(handle)->isoNextFrame(ep_addr); }
+
+	static inline void setAddress(void * handle, uint8_t addr) { backend(handle)->setAddress(addr); }
+
+	static inline void openEP(void * handle, uint8_t ep_addr, uint16_t ep_mps, uint8_t ep_type)
+	{
+		backend(handle)->openEP(ep_addr, ep_mps, ep_type);
+	}
+
+	static inline void closeEP(void * handle, uint8_t ep_addr) { backend(handle)->closeEP(ep_addr); }
+
+	static inline uint16_t fifoWords(void * handle) { return backend(handle)->fifoWords(); }
+
+	static inline void setFifos(void * handle, uint16_t rx, uint16_t tx0) { backend(handle)->setFifos(rx, tx0); }
+
+	static inline void setTxFifos(void * handle, const uint16_t * tx, uint8_t count)
+	{
+		backend(handle)->setTxFifos(tx, count);
+	}
+
+	static inline void transmit(void * handle, uint8_t ep_addr, uint8_t * pbuf, uint16_t size)
+	{
+		backend(handle)->transmit(ep_addr, pbuf, size);
+	}
+
+	static inline void transmitPeriodic(void * handle, uint8_t ep_addr, uint8_t * pbuf, uint16_t size,
+										uint8_t transactions)
+	{
+		backend(handle)->transmitPeriodic(ep_addr, pbuf, size, transactions);
+	}
+
+	static inline void receive(void * handle, uint8_t ep_addr, uint8_t * pbuf, uint16_t size)
+	{
+		backend(handle)->receive(ep_addr, pbuf, size);
+	}
+
+	static inline uint8_t rxTransactions(void * handle, uint8_t ep_addr)
+	{
+		return backend(handle)->rxTransactions(ep_addr);
+	}
+
+	static inline void stallEP(void * handle, uint8_t ep_addr) { backend(handle)->stallEP(ep_addr); }
+
+	static inline void clearStallEP(void * handle, uint8_t ep_addr) { backend(handle)->clearStallEP(ep_addr); }
+
+	static inline bool isStallEP(void * handle, uint8_t ep_addr) { return backend(handle)->isStallEP(ep_addr); }
+
+	static inline void flushEP(void * handle, uint8_t ep_addr) { backend(handle)->flushEP(ep_addr); }
+
+	static inline uint32_t rxCount(void * handle, uint8_t ep_addr) { return backend(handle)->rxCount(ep_addr); }
+};
+
+typedef XUsbHostPort XUsbPort;
+
+#endif /* XUSBDEVICE_CONFIG_H_ */
@@ -0,0 +1,245 @@
+/*
+ * XUsbTestBackend.h
+ *
+ * Контроллер для тестов на хосте: запоминает вызовы порта, отдаёт
+ * заданные номера SOF и такты. Запуск тестов - port/host/test/run.sh.
+ */
+
+#ifndef XUSBTESTBACKEND_H_
+#define XUSBTESTBACKEND_H_
+
+#include "XUsbDevice.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+//! Проверка теста: сообщение с местом и выход с ошибкой
+#define XUSB_CHECK(cond) \
+	do { if(!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); } } while(0)
+
+class XUsbTestBackend :
+		public XUsbHostBackend
+{
+public:
+	XUsbTestBackend() :
+		highSpeed(false),
+		frame(0),
+		numbered(true),
+		cyclesNow(0),
+		now(0),
+		resumeSignals(0),
+		address(0),
+		stalls(0),
+		retargets(0),
+		txBuf(nullptr),
+		txLength(0),
+		rxBuf(nullptr),
+		rxLength(0),
+		rxBytes(0),
+		rxPackets(1)
+	{
+		memset(opened, 0, sizeof(opened));
+		memset(txCount, 0, sizeof(txCount));
+	}
+
+	virtual bool isHighSpeed() override { return highSpeed; }
+
+	virtual bool isHighSpeedCapable() override { return highSpeed; }
+
+	virtual uint16_t frameNumber() override { return frame; }
+
+	virtual bool hasFrameNumber() override { return numbered; }
+
+	virtual uint32_t cycles() override { return cyclesNow; }
+
+	virtual uint32_t ticks() override { return now; }
+
+	//! Задержка продвигает время; onDelay - события шины за это время
+	virtual void delay(uint32_t ms) override
+	{
+		now += ms;
+		if(onDelay)
+			onDelay();
+	}
+
+	virtual void remoteWakeupSignal(bool active) override
+	{
+		if(active)
+			++resumeSignals;
+	}
+
+	virtual void setAddress(uint8_t addr) override { address = addr; }
+
+	virtual void openEP(uint8_t ep_addr, uint16_t ep_mps, uint8_t /*ep_type*/) override
+	{
+		opened[index(ep_addr)] = ep_mps;
+	}
+
+	virtual void closeEP(uint8_t ep_addr) override { opened[index(ep_addr)] = 0; }
+
+	//! Данные IN нулевой точки собираются в ep0In, размеры пакетов - в ep0Packets,
+	//! по остальным точкам запоминается последняя передача
+	virtual void transmit(uint8_t ep_addr, uint8_t * pbuf, uint16_t size) override
+	{
+		++txCount[index(ep_addr)];
+		if(ep_addr == 0x80)
+		{
+			ep0In.insert(ep0In.end(), pbuf, pbuf + size);
+			ep0Packets.push_back(size);
+		}
+		txBuf = pbuf;
+		txLength = size;
+	}
+
+	virtual void receive(uint8_t /*ep_addr*/, uint8_t * pbuf, uint16_t size) override
+	{
+		rxBuf = pbuf;
+		rxLength = size;
+	}
+
+	virtual uint8_t rxTransactions(uint8_t /*ep_addr*/) override { return rxPackets; }
+
+	virtual void stallEP(uint8_t /*ep_addr*/) override { ++stalls; }
+
+	virtual void isoNextFrame(uint8_t /*ep_addr*/) override { ++retargets; }
+
+	virtual void clearStallEP(uint8_t /*ep_addr*/) override {}
+
+	virtual bool isStallEP(uint8_t /*ep_addr*/) override { return false; }
+
+	virtual void flushEP(uint8_t /*ep_addr*/) override {}
+
+	virtual uint32_t rxCount(uint8_t /*ep_addr*/) override { return rxBytes; }
+
+	static inline int index(uint8_t ep_addr) { return (ep_addr & 0x0F) + ((ep_addr & 0x80) ? 16 : 0); }
+
+	bool				highSpeed;
+	uint16_t			frame;
+	bool				numbered;
+	uint32_t			cyclesNow;
+	uint32_t			now;
+	int					resumeSignals;
+	std::function<void()> onDelay;
+	uint8_t				address;
+	int					stalls;
+	int					retargets;
+	uint16_t			opened[32];
+	int					txCount[32];
+	std::vector<uint8_t> ep0In;
+	std::vector<uint16_t> ep0Packets;
+	uint8_t *			txBuf;
+	uint16_t			txLength;
+	uint8_t *			rxBuf;
+	uint16_t			rxLength;
+	uint32_t			rxBytes;
+	uint8_t				rxPackets;
+};
+
+//! Интерфейс без запросов класса, считает смену настроек
+class XUsbTestIface :
+		public XUsbIface
+{
+public:
+	explicit XUsbTestIface(const UsbInterfaceDescriptor & self) :
+		XUsbIface(self),
+		selected(0),
+		deselected(0)
+	{}
+
+	virtual bool setupRequest(UsbSetupRequest *) override { return false; }
+	virtual void ep0RxReady(UsbSetupRequest *, const XUsbCtlData &) override {}
+	virtual void ep0TxSent(UsbSetupRequest *) override {}
+
+	virtual void altSelected(uint8_t) override { ++selected; }
+	virtual void altDeselected(uint8_t) override { ++deselected; }
+
+	int		selected;
+	int		deselected;
+};
+
+class XUsbTestInEndpoint :
+		public XUsbInEndpoint
+{
+public:
+	explicit XUsbTestInEndpoint(const XUsbEndpoint & source) :
+		XUsbInEndpoint(source)
+	{}
+
+	virtual bool epDataIn(uint8_t *) override { return true; }
+};
+
+class XUsbTestOutEndpoint :
+		public XUsbOutEndpoint
+{
+public:
+	explicit XUsbTestOutEndpoint(const XUsbEndpoint & source) :
+		XUsbOutEndpoint(source)
+	{}
+
+	virtual bool epDataOut(uint8_t *) override { return true; }
+};
+
+//! Control-передача без фазы данных
+template<class Device>
+inline void xusbControl(Device & dev, std::initializer_list<uint8_t> setup)
+{
+	uint8_t packet[8];
+	int i = 0;
+	for(uint8_t byte : setup)
+		packet[i++] = byte;
+	dev.setupStage(packet);
+}
+
+//! Control-передача с фазой данных IN: SETUP и пакеты до конца фазы данных
+template<class Device>
+inline void xusbControlIn(Device & dev, XUsbTestBackend & port, std::initializer_list<uint8_t> setup)
+{
+	uint8_t packet[8];
+	int i = 0;
+	for(uint8_t byte : setup)
+		packet[i++] = byte;
+	port.ep0In.clear();
+	port.ep0Packets.clear();
+	dev.setupStage(packet);
+	for(;;)
+	{
+		int sent = port.txCount[XUsbTestBackend::index(0x80)];
+		dev.dataInStage(0, nullptr);
+		if(port.txCount[XUsbTestBackend::index(0x80)] == sent)
+			break;
+	}
+}
+
+//! Control-передача с фазой данных OUT: хост отправляет size байт data
+//! пакетами по длине, запрошенной нулевой точкой. Возвращает отправленное
+//! количество; фаза данных закончена, если после неё отправлен статус.
+template<class Device>
+inline uint32_t xusbControlOut(Device & dev, XUsbTestBackend & port, std::initializer_list<uint8_t> setup,
+							   const uint8_t * data, uint32_t size)
+{
+	uint8_t packet[8];
+	int i = 0;
+	for(uint8_t byte : setup)
+		packet[i++] = byte;
+	port.ep0Packets.clear();
+	port.rxLength = 0;
+	dev.setupStage(packet);
+	uint32_t sent = 0;
+	while((sent < size) && (port.rxLength != 0) && port.ep0Packets.empty())
+	{
+		uint32_t chunk = size - sent;
+		if(chunk > port.rxLength)
+			chunk = port.rxLength;
+		memcpy(port.rxBuf, data + sent, chunk);
+		sent += chunk;
+		port.rxBytes = chunk;
+		port.rxLength = 0;
+		dev.dataOutStage(0, nullptr);
+	}
+	return sent;
+}
+
+#endif /* XUSBTESTBACKEND_H_ */
@@ -0,0 +1,297 @@
+/*
+ * config_test.cpp
+ *
+ * Регистрация и установка конфигураций: периодическая полоса с учётом
+ * альтернативных настроек на обеих скоростях, уведомления интерфейсов
+ * при отказе в установке, закрепления запросов за объектами конфигурации.
+ */
+
+#include "XUsbTestBackend.h"
+#include <memory>
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Конфигурация из интерфейсов и их настроек, владеет объектами
+class Builder
+{
+public:
+	explicit Builder(UsbSpeedClass speed = UsbSpeed_Full) :
+		cfg(UsbConfigDescriptor(buffer, sizeof(buffer)), speed)
+	{
+		cfg.init(1, UsbStringDescriptor(), 0xA0, 50);
+	}
+
+	XUsbTestIface & iface(uint8_t num)
+	{
+		ifaces.emplace_back(new XUsbTestIface(cfg.beginInterface()));
+		ifaces.back()->init(num, 0, 0xFF, 0, 0, UsbStringDescriptor());
+		return *ifaces.back();
+	}
+
+	XUsbAltSetting & alternate(XUsbTestIface & itf, uint8_t alt)
+	{
+		alts.emplace_back(new XUsbAltSetting(cfg.beginInterface(), itf));
+		alts.back()->init(itf.bInterfaceNumber(), alt, 0xFF, 0, 0, UsbStringDescriptor());
+		return *alts.back();
+	}
+
+	template<class Setting>
+	void endpoint(Setting & setting, uint8_t addr, uint8_t type, uint16_t packet, uint8_t interval = 1)
+	{
+		XUsbEndpoint e = setting.beginEP();
+		e.init(7, addr, type, packet, interval);
+		if(addr & 0x80)
+			endpoints.emplace_back(new XUsbTestInEndpoint(e));
+		else
+			endpoints.emplace_back(new XUsbTestOutEndpoint(e));
+		setting.endEP(*endpoints.back());
+	}
+
+	XUsbConfiguration								cfg;
+	std::vector<std::unique_ptr<XUsbTestIface>>		ifaces;
+	std::vector<std::unique_ptr<XUsbAltSetting>>	alts;
+	std::vector<std::unique_ptr<XUsbEndpoint>>		endpoints;
+	uint8_t											buffer[256];
+};
+
+static void initDevice(XUsbDevice & dev)
+{
+	XUSB_CHECK(dev.init(0x200, 0, 0, 0, 64, 0x1234, 0x5678, 0x100, nullptr, nullptr, nullptr, 1));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Full-speed: iso OUT интерфейса 0 в настройках 1 и 2, iso IN интерфейса 1.
+//! Полосу занимает наибольшая настройка, а не выбранная при установке нулевая.
+static void testWorstAlternate(uint16_t alt2Packet, bool fits)
+{
+	Builder b;
+	XUsbTestIface & stream = b.iface(0);
+	XUSB_CHECK(b.cfg.endInterface(stream));
+	XUsbAltSetting & alt1 = b.alternate(stream, 1);
+	b.endpoint(alt1, 0x01, UsbEPType_Isochronous, 400);
+	XUSB_CHECK(b.cfg.endAlternate(stream, alt1));
+	XUsbAltSetting & alt2 = b.alternate(stream, 2);
+	b.endpoint(alt2, 0x01, UsbEPType_Isochronous, alt2Packet);
+	XUSB_CHECK(b.cfg.endAlternate(stream, alt2));
+	XUsbTestIface & source = b.iface(1);
+	b.endpoint(source, 0x82, UsbEPType_Isochronous, 300);
+	XUSB_CHECK(b.cfg.endInterface(source));
+
+	//! 1350 - (300 + 9) - (alt2Packet + 9)
+	XUSB_CHECK(b.cfg.periodicRemaining(UsbSpeed_Full) == 1350 - 309 - (alt2Packet + 9));
+
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	initDevice(dev);
+	XUSB_CHECK(dev.addConfig(&b.cfg) == fits);
+	if(!fits)
+		return;
+
+	//! Любая настройка укладывается в полосу, зарезервированную при регистрации
+	dev.reset();
+	xusbControl(dev, { 0x00, 0x05, 3, 0, 0, 0, 0, 0 });
+	xusbControl(dev, { 0x00, 0x09, 1, 0, 0, 0, 0, 0 });
+	XUSB_CHECK(dev.isConfigured());
+	for(uint8_t alt = 1; alt <= 2; ++alt)
+	{
+		int stalls = port.stalls;
+		xusbControl(dev, { 0x01, 0x0B, alt, 0, 0, 0, 0, 0 });
+		XUSB_CHECK((port.stalls == stalls) && (port.opened[XUsbTestBackend::index(0x01)] != 0));
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Конфигурация high-speed, которая на full-speed укладывается в полосу,
+//! а на high-speed - нет: отказ только у порта с high-speed
+static void testHighSpeedBudget()
+{
+	for(int capable = 0; capable < 2; ++capable)
+	{
+		Builder b(UsbSpeed_High);
+		XUsbTestIface & stream = b.iface(0);
+		XUSB_CHECK(b.cfg.endInterface(stream));
+		XUsbAltSetting & alt1 = b.alternate(stream, 1);
+		b.endpoint(alt1, 0x81, UsbEPType_Isochronous, 1024 | (2 << 11));
+		XUSB_CHECK(b.cfg.endAlternate(stream, alt1));
+		XUsbTestIface & status = b.iface(1);
+		b.endpoint(status, 0x82, UsbEPType_Interrupt, 1024 | (2 << 11));
+		XUSB_CHECK(b.cfg.endInterface(status));
+
+		XUSB_CHECK(b.cfg.periodicRemaining(UsbSpeed_Full) >= 0);
+		XUSB_CHECK(b.cfg.periodicRemaining(UsbSpeed_High) == 6000 - (1024 + 55) * 3 - (1024 + 38) * 3);
+
+		XUsbTestBackend port;
+		port.highSpeed = (capable != 0);
+		XUsbDevice dev(&port, false);
+		initDevice(dev);
+		XUSB_CHECK(dev.addConfig(&b.cfg) == !capable);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Контроллер с FIFO, в которое не помещаются точки обоих интерфейсов
+class SmallFifoBackend :
+		public XUsbTestBackend
+{
+public:
+	virtual uint16_t fifoWords() override { return 64; }
+};
+
+//! openEndpoints() отказывает при SET_CONFIGURATION: интерфейсы не запускались
+//! и не получают altDeselected; после успешной установки пары вызовов сходятся
+static void testOpenFailure()
+{
+	for(int small = 1; small >= 0; --small)
+	{
+		Builder b;
+		XUsbTestIface & first = b.iface(0);
+		b.endpoint(first, 0x81, UsbEPType_Interrupt, 64);
+		XUSB_CHECK(b.cfg.endInterface(first));
+		XUsbTestIface & second = b.iface(1);
+		b.endpoint(second, 0x82, UsbEPType_Interrupt, 64);
+		XUSB_CHECK(b.cfg.endInterface(second));
+
+		SmallFifoBackend smallPort;
+		XUsbTestBackend normalPort;
+		XUsbTestBackend & port = small ? smallPort : normalPort;
+		XUsbDevice dev(&port, false);
+		initDevice(dev);
+		XUSB_CHECK(dev.addConfig(&b.cfg));
+		dev.reset();
+		xusbControl(dev, { 0x00, 0x05, 3, 0, 0, 0, 0, 0 });
+		int stalls = port.stalls;
+		xusbControl(dev, { 0x00, 0x09, 1, 0, 0, 0, 0, 0 });
+		XUSB_CHECK(dev.isConfigured() == !small);
+		XUSB_CHECK((port.stalls != stalls) == (small != 0));
+		for(XUsbTestIface * itf : { &first, &second })
+			XUSB_CHECK((itf->selected == !small) && (itf->deselected == 0) && (itf->isInitialized() == !small));
+
+		//! Сброс шины снимает конфигурацию
+		dev.reset();
+		for(XUsbTestIface * itf : { &first, &second })
+			XUSB_CHECK((itf->selected == itf->deselected) && !itf->isInitialized());
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Обработчики запросов vendor: интерфейс и точка конфигурации, сторонний обработчик
+class CommandIface :
+		public XUsbTestIface
+{
+public:
+	explicit CommandIface(const UsbInterfaceDescriptor & self) :
+		XUsbTestIface(self),
+		requests(0)
+	{}
+
+	virtual bool setupRequest(UsbSetupRequest *) override { ++requests; return true; }
+
+	int		requests;
+};
+
+class CommandEndpoint :
+		public XUsbTestInEndpoint
+{
+public:
+	explicit CommandEndpoint(const XUsbEndpoint & source) :
+		XUsbTestInEndpoint(source),
+		requests(0)
+	{}
+
+	virtual bool setupRequest(UsbSetupRequest *) override { ++requests; return true; }
+
+	int		requests;
+};
+
+class Commands :
+		public XUsbRequestHandler
+{
+public:
+	Commands() : requests(0) {}
+
+	virtual bool setupRequest(UsbSetupRequest *) override { ++requests; return true; }
+
+	int		requests;
+};
+
+//! Запрос vendor без фазы данных, false - STALL
+static bool vendor(XUsbDevice & dev, XUsbTestBackend & port, uint8_t recipient, uint8_t bRequest, uint8_t index)
+{
+	int stalls = port.stalls;
+	xusbControl(dev, { uint8_t(REQ_TYPE_VENDOR | recipient), bRequest, 0, 0, index, 0, 0, 0 });
+	return port.stalls == stalls;
+}
+
+//! Закрепления за интерфейсом и точкой (в том числе с получателем "device")
+//! снимаются при снятии конфигурации и при сбросе шины, сторонние - остаются
+static void testClaimsReleased()
+{
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	initDevice(dev);
+	uint8_t buffer[64];
+	XUsbConfiguration cfg(UsbConfigDescriptor(buffer, sizeof(buffer)));
+	cfg.init(1, UsbStringDescriptor(), 0xA0, 50);
+	CommandIface itf(cfg.beginInterface());
+	itf.init(0, 0, 0xFF, 0, 0, UsbStringDescriptor());
+	XUsbEndpoint e = itf.beginEP();
+	e.init(7, 0x81, UsbEPType_Interrupt, 8, 10);
+	CommandEndpoint ep(e);
+	itf.endEP(ep);
+	XUSB_CHECK(cfg.endInterface(itf));
+	XUSB_CHECK(dev.addConfig(&cfg));
+
+	Commands commands;
+	XUSB_CHECK(dev.claimRequest(REQ_TYPE_VENDOR | REQ_RECIPIENT_DEVICE, 1, 0, &commands));
+	dev.reset();
+	xusbControl(dev, { 0x00, 0x05, 3, 0, 0, 0, 0, 0 });
+
+	for(int round = 0; round < 2; ++round)
+	{
+		xusbControl(dev, { 0x00, 0x09, 1, 0, 0, 0, 0, 0 });
+		XUSB_CHECK(dev.isConfigured());
+		XUSB_CHECK(dev.claimRequest(REQ_TYPE_VENDOR | REQ_RECIPIENT_DEVICE, 2, 0, &itf));
+		XUSB_CHECK(itf.claimRequest(REQ_TYPE_VENDOR, 3));
+		XUSB_CHECK(ep.claimRequest(REQ_TYPE_VENDOR, 4));
+		XUSB_CHECK(vendor(dev, port, REQ_RECIPIENT_DEVICE, 2, 0));
+		XUSB_CHECK(vendor(dev, port, REQ_RECIPIENT_INTERFACE, 3, 0));
+		XUSB_CHECK(vendor(dev, port, REQ_RECIPIENT_ENDPOINT, 4, 0x81));
+		XUSB_CHECK((itf.requests == 2) && (ep.requests == 1));
+
+		if(round == 0)
+			xusbControl(dev, { 0x00, 0x09, 0, 0, 0, 0, 0, 0 });
+		else
+		{
+			dev.reset();
+			xusbControl(dev, { 0x00, 0x05, 3, 0, 0, 0, 0, 0 });
+		}
+		XUSB_CHECK(!dev.isConfigured());
+		XUSB_CHECK(!vendor(dev, port, REQ_RECIPIENT_DEVICE, 2, 0));
+		XUSB_CHECK(vendor(dev, port, REQ_RECIPIENT_DEVICE, 1, 0) && (commands.requests == round + 1));
+
+		//! Конфигурация установлена снова: прежние закрепления не действуют
+		xusbControl(dev, { 0x00, 0x09, 1, 0, 0, 0, 0, 0 });
+		XUSB_CHECK(!vendor(dev, port, REQ_RECIPIENT_INTERFACE, 3, 0));
+		XUSB_CHECK(!vendor(dev, port, REQ_RECIPIENT_ENDPOINT, 4, 0x81));
+		XUSB_CHECK((itf.requests == 2) && (ep.requests == 1));
+		xusbControl(dev, { 0x00, 0x09, 0, 0, 0, 0, 0, 0 });
+		itf.requests = 0;
+		ep.requests = 0;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+	testWorstAlternate(600, true);
+	testWorstAlternate(1100, false);
+	testHighSpeedBudget();
+	testOpenFailure();
+	testClaimsReleased();
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * ep0chunk_test.cpp
+ *
+ * Фаза данных нулевой точки: деление на пакеты со смещением, ZLP после
+ * ответа короче wLength и кратного размеру пакета, передачи до 64 КиБ
+ * в обе стороны, досрочное завершение control OUT коротким пакетом.
+ */
+
+#include "XUsbTestBackend.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Запрос vendor к устройству: IN отдаёт response[0..length), OUT принимает
+//! в received целиком
+class Vendor :
+		public XUsbRequestHandler
+{
+public:
+	explicit Vendor(XUsbDevice & dev) :
+		dev(dev),
+		length(0),
+		sent(0),
+		chunks(0)
+	{
+		response.resize(65535);
+		received.resize(65535);
+		for(size_t i = 0; i < response.size(); ++i)
+			response[i] = uint8_t(i * 7 + (i >> 8));
+	}
+
+	virtual bool setupRequest(UsbSetupRequest * req) override
+	{
+		if(req->bmRequest & 0x80)
+			dev.ctlTransmit(response.data(), length);
+		else
+			dev.ctlReceive(received.data(), req->wLength);
+		return true;
+	}
+
+	virtual void ep0RxReady(UsbSetupRequest *, const XUsbCtlData & data) override
+	{
+		++chunks;
+		last = data;
+	}
+
+	virtual void ep0TxSent(UsbSetupRequest *) override { ++sent; }
+
+	XUsbDevice &			dev;
+	std::vector<uint8_t>	response;
+	std::vector<uint8_t>	received;
+	uint16_t				length;
+	int						sent;
+	int						chunks;
+	XUsbCtlData				last = XUsbCtlData(nullptr, 0, 0, false);
+};
+
+template<class Test>
+static void run(Test test)
+{
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	dev.reset();
+	Vendor vendor(dev);
+	XUSB_CHECK(dev.claimRequest(REQ_TYPE_VENDOR | REQ_RECIPIENT_DEVICE, 1, 0, &vendor));
+	test(dev, port, vendor);
+}
+
+static bool samePackets(const XUsbTestBackend & port, std::initializer_list<uint16_t> sizes)
+{
+	return port.ep0Packets == std::vector<uint16_t>(sizes);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Ответ короче wLength: пакеты по 64 байта, последний короткий, без ZLP
+static void testShortReply(XUsbDevice & dev, XUsbTestBackend & port, Vendor & vendor)
+{
+	vendor.length = 200;
+	xusbControlIn(dev, port, { 0xC0, 1, 0, 0, 0, 0, 0xFF, 0 });
+	XUSB_CHECK(samePackets(port, { 64, 64, 64, 8 }));
+	XUSB_CHECK(memcmp(port.ep0In.data(), vendor.response.data(), 200) == 0);
+	//! После данных - ep0TxSent и приём статуса
+	XUSB_CHECK((vendor.sent == 1) && (port.rxBuf == nullptr) && (port.rxLength == 0));
+}
+
+//! Ответ кратен пакету: ZLP только если он короче wLength
+static void testZlp(XUsbDevice & dev, XUsbTestBackend & port, Vendor & vendor)
+{
+	vendor.length = 128;
+	xusbControlIn(dev, port, { 0xC0, 1, 0, 0, 0, 0, 0xFF, 0 });
+	XUSB_CHECK(samePackets(port, { 64, 64, 0 }));
+
+	xusbControlIn(dev, port, { 0xC0, 1, 0, 0, 0, 0, 128, 0 });
+	XUSB_CHECK(samePackets(port, { 64, 64 }));
+
+	vendor.length = 0;
+	xusbControlIn(dev, port, { 0xC0, 1, 0, 0, 0, 0, 16, 0 });
+	XUSB_CHECK(samePackets(port, { 0 }));
+	XUSB_CHECK(vendor.sent == 3);
+}
+
+//! Чтение 65535 байт: смещение ведётся нулевой точкой по всем 1024 пакетам
+static void testLargeRead(XUsbDevice & dev, XUsbTestBackend & port, Vendor & vendor)
+{
+	vendor.length = 65535;
+	xusbControlIn(dev, port, { 0xC0, 1, 0, 0, 0, 0, 0xFF, 0xFF });
+	XUSB_CHECK(port.ep0Packets.size() == 1024);
+	XUSB_CHECK((port.ep0Packets.front() == 64) && (port.ep0Packets.back() == 63));
+	XUSB_CHECK(port.ep0In == vendor.response);
+	XUSB_CHECK(vendor.sent == 1);
+}
+
+//! Запись 65535 байт в буфер обработчика: данные отдаются один раз, целиком
+static void testLargeWrite(XUsbDevice & dev, XUsbTestBackend & port, Vendor & vendor)
+{
+	std::vector<uint8_t> data(vendor.response.rbegin(), vendor.response.rend());
+	uint32_t sent = xusbControlOut(dev, port, { 0x40, 1, 0, 0, 0, 0, 0xFF, 0xFF }, data.data(), 65535);
+	XUSB_CHECK(sent == 65535);
+	XUSB_CHECK((vendor.chunks == 1) && vendor.last.isLast());
+	XUSB_CHECK((vendor.last.size() == 65535) && (vendor.last.offset() == 0));
+	XUSB_CHECK(vendor.received == data);
+	XUSB_CHECK(dev.ctlRxCount() == 65535);
+	//! Статус - ZLP на IN
+	XUSB_CHECK(samePackets(port, { 0 }));
+}
+
+//! Короткий пакет завершает фазу данных до wLength
+static void testShortWrite(XUsbDevice & dev, XUsbTestBackend & port, Vendor & vendor)
+{
+	const uint8_t * data = vendor.response.data();
+	uint32_t sent = xusbControlOut(dev, port, { 0x40, 1, 0, 0, 0, 0, 200, 0 }, data, 130);
+	XUSB_CHECK(sent == 130);
+	XUSB_CHECK((vendor.chunks == 1) && vendor.last.isLast() && (vendor.last.size() == 130));
+	XUSB_CHECK(memcmp(vendor.received.data(), data, 130) == 0);
+	XUSB_CHECK(samePackets(port, { 0 }));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+	run(testShortReply);
+	run(testZlp);
+	run(testLargeRead);
+	run(testLargeWrite);
+	run(testShortWrite);
+	return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * ep0fragment_test.cpp
+ *
+ * Фаза IN нулевой точки из цепочки фрагментов: пакеты на стыках фрагментов,
+ * пустые фрагменты, дескриптор конфигурации с внешним фрагментом в RAM,
+ * изменение фрагмента между запросами и пересчёт дескрипторов точек
+ * для другой скорости на границе пакета.
+ */
+
+#include "XUsbTestBackend.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+class Chain :
+		public XUsbRequestHandler
+{
+public:
+	Chain(XUsbDevice & dev, const XUsbFragment * chain, uint16_t length) :
+		dev(dev),
+		chain(chain),
+		length(length)
+	{}
+
+	virtual bool setupRequest(UsbSetupRequest *) override
+	{
+		dev.ctlTransmit(chain, length);
+		return true;
+	}
+
+	XUsbDevice &			dev;
+	const XUsbFragment *	chain;
+	uint16_t				length;
+};
+
+static void initDevice(XUsbDevice & dev)
+{
+	XUSB_CHECK(dev.init(0x200, 0, 0, 0, 64, 0x1234, 0x5678, 0x100, nullptr, nullptr, nullptr, 1));
+	dev.reset();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Пакеты собираются через стыки фрагментов, пустой фрагмент пропускается,
+//! длина ответа ограничена длиной цепочки
+static void testChain()
+{
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	dev.reset();
+
+	uint8_t data[163];
+	for(unsigned i = 0; i < sizeof(data); ++i)
+		data[i] = uint8_t(i + 1);
+	XUsbFragment tail(data + 113, 50);
+	XUsbFragment small(data + 110, 3, &tail);
+	XUsbFragment empty(nullptr, 0, &small);
+	XUsbFragment middle(data + 10, 100, &empty);
+	XUsbFragment head(data, 10, &middle);
+
+	Chain handler(dev, &head, 1000);
+	XUSB_CHECK(dev.claimRequest(REQ_TYPE_VENDOR | REQ_RECIPIENT_DEVICE, 1, 0, &handler));
+	xusbControlIn(dev, port, { 0xC0, 1, 0, 0, 0, 0, 0xE8, 0x03 });
+	XUSB_CHECK(port.ep0Packets == std::vector<uint16_t>({ 64, 64, 35 }));
+	XUSB_CHECK(port.ep0In == std::vector<uint8_t>(data, data + sizeof(data)));
+
+	//! Пакет внутри одного фрагмента отправляется прямо из него
+	handler.chain = &middle;
+	handler.length = 64;
+	xusbControlIn(dev, port, { 0xC0, 1, 0, 0, 0, 0, 64, 0 });
+	XUSB_CHECK((port.ep0Packets.size() == 1) && (port.txBuf == data + 10));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! GET_DESCRIPTOR(CONFIGURATION): буфер построителя и фрагмент в RAM,
+//! изменения фрагмента видны в следующем запросе
+static void testConfigFragment()
+{
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	uint8_t buffer[64];
+	XUsbConfiguration cfg(UsbConfigDescriptor(buffer, sizeof(buffer)));
+	cfg.init(1, UsbStringDescriptor(), 0xA0, 50);
+	XUsbTestIface itf(cfg.beginInterface());
+	itf.init(0, 0, 0xFF, 0, 0, UsbStringDescriptor());
+	XUsbEndpoint e = itf.beginEP();
+	e.init(7, 0x81, UsbEPType_Interrupt, 8, 10);
+	XUsbTestInEndpoint ep(e);
+	itf.endEP(ep);
+	XUSB_CHECK(cfg.endInterface(itf));
+
+	//! Дескриптор класса длиннее пакета нулевой точки
+	uint8_t vendor[70];
+	for(unsigned i = 0; i < sizeof(vendor); ++i)
+		vendor[i] = uint8_t(0xA0 + i);
+	vendor[0] = sizeof(vendor);
+	vendor[1] = 0x41;
+	XUsbFragment frag(vendor, sizeof(vendor));
+	XUSB_CHECK(cfg.appendFragment(frag));
+	initDevice(dev);
+	XUSB_CHECK(dev.addConfig(&cfg));
+
+	const uint16_t total = 9 + 9 + 7 + sizeof(vendor);
+	std::vector<uint8_t> expected(buffer, buffer + 9 + 9 + 7);
+	expected.insert(expected.end(), vendor, vendor + sizeof(vendor));
+
+	xusbControlIn(dev, port, { 0x80, 6, 0, UsbDescType_Configuration, 0, 0, 0xFF, 0 });
+	XUSB_CHECK(port.ep0In == expected);
+	XUSB_CHECK((port.ep0In[2] | (port.ep0In[3] << 8)) == total);
+	XUSB_CHECK(port.ep0Packets == std::vector<uint16_t>({ 64, total - 64 }));
+
+	vendor[40] = 0x5A;
+	expected[9 + 9 + 7 + 40] = 0x5A;
+	xusbControlIn(dev, port, { 0x80, 6, 0, UsbDescType_Configuration, 0, 0, 0xFF, 0 });
+	XUSB_CHECK(port.ep0In == expected);
+
+	//! Хост сначала читает заголовок
+	xusbControlIn(dev, port, { 0x80, 6, 0, UsbDescType_Configuration, 0, 0, 9, 0 });
+	XUSB_CHECK(port.ep0In == std::vector<uint8_t>(expected.begin(), expected.begin() + 9));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Конфигурация описана для full-speed, шина high-speed: дескрипторы точек
+//! пересчитываются по мере отправки, в том числе разрезанные границей пакета
+static void testSpeedRewrite()
+{
+	XUsbTestBackend port;
+	port.highSpeed = true;
+	XUsbDevice dev(&port, false);
+	uint8_t buffer[128];
+	XUsbConfiguration cfg(UsbConfigDescriptor(buffer, sizeof(buffer)));
+	cfg.init(1, UsbStringDescriptor(), 0xA0, 50);
+	XUsbTestIface itf(cfg.beginInterface());
+	itf.init(0, 0, 0xFF, 0, 0, UsbStringDescriptor());
+	std::vector<XUsbTestInEndpoint*> endpoints;
+	for(uint8_t epnum = 1; epnum <= 7; ++epnum)
+	{
+		XUsbEndpoint e = itf.beginEP();
+		e.init(7, uint8_t(0x80 | epnum), UsbEPType_Interrupt, 8, uint8_t(epnum * 4));
+		endpoints.push_back(new XUsbTestInEndpoint(e));
+		itf.endEP(*endpoints.back());
+	}
+	XUSB_CHECK(cfg.endInterface(itf));
+	initDevice(dev);
+	XUSB_CHECK(dev.addConfig(&cfg));
+	XUSB_CHECK(dev.speed() == UsbSpeed_High);
+
+	const uint16_t total = 9 + 9 + 7 * 7;
+	std::vector<uint8_t> expected(buffer, buffer + total);
+	for(int i = 0; i < 7; ++i)
+		UsbEPDescriptor::convertSpeed(&expected[18 + i * 7], UsbSpeed_Full, UsbSpeed_High);
+
+	xusbControlIn(dev, port, { 0x80, 6, 0, UsbDescType_Configuration, 0, 0, 0xFF, 0 });
+	XUSB_CHECK(port.ep0In == expected);
+	//! Седьмая точка (смещение 60..66) разрезана границей пакета
+	XUSB_CHECK(port.ep0In[66] != buffer[66]);
+
+	expected[1] = UsbDescType_OtherSpeedConfiguration;
+	std::copy(buffer + 18, buffer + total, expected.begin() + 18);
+	xusbControlIn(dev, port, { 0x80, 6, 0, UsbDescType_OtherSpeedConfiguration, 0, 0, 0xFF, 0 });
+	XUSB_CHECK(port.ep0In == expected);
+
+	for(XUsbTestInEndpoint * ep : endpoints)
+		delete ep;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+	testChain();
+	testConfigFragment();
+	testSpeedRewrite();
+	return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * ep0out_test.cpp
+ *
+ * Фаза control OUT через общий буфер нулевой точки: данные отдаются
+ * обработчику порциями по заполнению буфера, со смещением и признаком
+ * последней порции. Размер буфера - USB_EP0_BUFFER_SIZE, проверяется
+ * и с флагом run.sh -DUSB_EP0_BUFFER_SIZE=160.
+ */
+
+#include "XUsbTestBackend.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Порция данных: в буфер помещается целое число пакетов
+static const uint32_t Chunk = USB_EP0_BUFFER_SIZE / USB_MAX_EP0_SIZE * USB_MAX_EP0_SIZE;
+
+class Stream :
+		public XUsbRequestHandler
+{
+public:
+	explicit Stream(XUsbDevice & dev) :
+		dev(dev),
+		buffer(nullptr),
+		lasts(0)
+	{}
+
+	virtual bool setupRequest(UsbSetupRequest * req) override
+	{
+		dev.ctlReceive(req->wLength);
+		return true;
+	}
+
+	//! Порции приходят по порядку и лежат в буфере устройства
+	virtual void ep0RxReady(UsbSetupRequest *, const XUsbCtlData & data) override
+	{
+		XUSB_CHECK(data.offset() == received.size());
+		XUSB_CHECK((buffer == nullptr) || (data.data() == buffer));
+		buffer = data.data();
+		sizes.push_back(data.size());
+		received.insert(received.end(), data.data(), data.data() + data.size());
+		if(data.isLast())
+			++lasts;
+	}
+
+	XUsbDevice &			dev;
+	const uint8_t *			buffer;
+	std::vector<uint16_t>	sizes;
+	std::vector<uint8_t>	received;
+	int						lasts;
+};
+
+//! Хост отправляет size байт при wLength; обработчик получает их целиком
+//! порциями по Chunk, последняя порция помечена
+static void transfer(uint16_t wLength, uint32_t size)
+{
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	dev.reset();
+	Stream stream(dev);
+	XUSB_CHECK(dev.claimRequest(REQ_TYPE_VENDOR | REQ_RECIPIENT_DEVICE, 2, 0, &stream));
+
+	std::vector<uint8_t> data(size);
+	for(uint32_t i = 0; i < size; ++i)
+		data[i] = uint8_t(i ^ (i >> 8) ^ 0x5A);
+	uint32_t sent = xusbControlOut(dev, port, { 0x40, 2, 0, 0, 0, 0, uint8_t(wLength), uint8_t(wLength >> 8) },
+								   data.data(), size);
+	XUSB_CHECK(sent == size);
+	XUSB_CHECK(stream.received == data);
+	XUSB_CHECK(stream.lasts == 1);
+	XUSB_CHECK(dev.ctlRxCount() == size);
+
+	std::vector<uint16_t> expected((size + Chunk - 1) / Chunk, uint16_t(Chunk));
+	expected.back() = uint16_t(size - (expected.size() - 1) * Chunk);
+	XUSB_CHECK(stream.sizes == expected);
+	//! Статус - ZLP на IN после последней порции
+	XUSB_CHECK(port.ep0Packets == std::vector<uint16_t>({ 0 }));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+	//! Последний пакет короткий
+	transfer(200, 200);
+	//! Данные кратны порции: последняя порция полная
+	transfer(uint16_t(Chunk * 2), Chunk * 2);
+	//! Короткий пакет раньше wLength
+	transfer(1000, 300);
+	//! Один короткий пакет
+	transfer(16, 10);
+	transfer(65535, 65535);
+	return 0;
+}
@@ -0,0 +1,334 @@
+/*
+ * isostream_test.cpp
+ *
+ * Изохронные потоки (XUsbIsoStream.h): заполнение и опустошение кольца,
+ * переход индексов через 256, недогрузка IN, переполнение OUT в запасной
+ * буфер, пропуск интервала, incomplete iso и незавершённый микрокадр
+ * high-bandwidth.
+ */
+
+#include "XUsbTestBackend.h"
+#include "XUsbIsoStream.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+template<uint16_t PayloadSize, uint8_t Depth>
+class InStream :
+		public XUsbIsoInStream<PayloadSize, Depth>
+{
+public:
+	explicit InStream(const XUsbEndpoint & source) :
+		XUsbIsoInStream<PayloadSize, Depth>(source)
+	{
+		memset(events, 0, sizeof(events));
+	}
+
+	virtual void isoEvent(XUsbIsoEvent event, uint16_t) override { ++events[event]; }
+
+	int events[4];
+};
+
+template<uint16_t PayloadSize, uint8_t Depth>
+class OutStream :
+		public XUsbIsoOutStream<PayloadSize, Depth>
+{
+public:
+	explicit OutStream(const XUsbEndpoint & source) :
+		XUsbIsoOutStream<PayloadSize, Depth>(source)
+	{
+		memset(events, 0, sizeof(events));
+	}
+
+	virtual void isoEvent(XUsbIsoEvent event, uint16_t) override { ++events[event]; }
+
+	int events[4];
+};
+
+typedef InStream<64, 4> In;
+typedef OutStream<64, 2> Out;
+
+//! Конфигурация с точками IN 0x81 и OUT 0x02, устройство в состоянии configured
+template<class InT, class OutT>
+class Fixture
+{
+public:
+	Fixture(XUsbTestBackend & port, uint16_t inPacket, uint16_t outPacket) :
+		dev(&port, false),
+		cfg(UsbConfigDescriptor(buffer, sizeof(buffer)))
+	{
+		dev.init(0x200, 0, 0, 0, 64, 0x1234, 0x5678, 0x100, nullptr, nullptr, nullptr, 1);
+		cfg.init(1, UsbStringDescriptor(), 0xA0, 50);
+		iface = new XUsbTestIface(cfg.beginInterface());
+		iface->init(0, 0, 0xFF, 0, 0, UsbStringDescriptor());
+		XUsbEndpoint e1 = iface->beginEP();
+		e1.init(7, 0x81, UsbEPType_Isochronous, inPacket, 1);
+		in = new InT(e1);
+		iface->endEP(*in);
+		XUsbEndpoint e2 = iface->beginEP();
+		e2.init(7, 0x02, UsbEPType_Isochronous, outPacket, 1);
+		out = new OutT(e2);
+		iface->endEP(*out);
+		cfg.endInterface(*iface);
+		added = dev.addConfig(&cfg);
+		if(!added)
+			return;
+		dev.reset();
+		xusbControl(dev, { 0x00, 0x05, 3, 0, 0, 0, 0, 0 });
+		xusbControl(dev, { 0x00, 0x09, 1, 0, 0, 0, 0, 0 });
+	}
+
+	~Fixture()
+	{
+		delete out;
+		delete in;
+		delete iface;
+	}
+
+	XUsbDevice			dev;
+	XUsbConfiguration	cfg;
+	XUsbTestIface *		iface;
+	InT *				in;
+	OutT *				out;
+	bool				added;
+	uint8_t				buffer[256];
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! IN: пустое кольцо, заполнение до Depth, опустошение, incomplete iso
+static void testInFullEmpty()
+{
+	XUsbTestBackend port;
+	Fixture<In, Out> f(port, 64, 64);
+	In & in = *f.in;
+	const int tx = XUsbTestBackend::index(0x81);
+	XUSB_CHECK(f.added && in.start());
+
+	//! Пустое кольцо к интервалу - недогрузка, передачи нет
+	f.dev.SOF();
+	XUSB_CHECK(in.isoStats().underruns == 1);
+	XUSB_CHECK(in.events[ISO_UNDERRUN] == 1);
+	XUSB_CHECK(port.txCount[tx] == 0);
+
+	uint8_t data[64];
+	for(int i = 0; i < 4; ++i)
+	{
+		memset(data, 0x10 + i, sizeof(data));
+		XUSB_CHECK(in.write(data, uint16_t(i + 1)));
+	}
+	XUSB_CHECK(in.queued() == 4);
+	XUSB_CHECK(in.acquire() == nullptr);
+	XUSB_CHECK(!in.write(data, 1));
+
+	//! Первый пакет уходит по SOF, следующий SOF при активной передаче ничего не отдаёт
+	f.dev.SOF();
+	XUSB_CHECK((port.txCount[tx] == 1) && (port.txLength == 1) && (port.txBuf[0] == 0x10));
+	f.dev.SOF();
+	XUSB_CHECK(port.txCount[tx] == 1);
+
+	//! Завершение освобождает слот и сразу отдаёт следующий пакет
+	f.dev.dataInStage(1, nullptr);
+	XUSB_CHECK((in.queued() == 3) && (in.acquire() != nullptr));
+	XUSB_CHECK((port.txCount[tx] == 2) && (port.txLength == 2) && (port.txBuf[0] == 0x11));
+
+	//! Incomplete iso: пакет остаётся в кольце, точка перенацелена на следующий кадр
+	f.dev.isoInIncomplete(1);
+	XUSB_CHECK((in.isoStats().incomplete == 1) && (in.events[ISO_INCOMPLETE] == 1));
+	XUSB_CHECK((port.retargets == 1) && (in.queued() == 3));
+
+	for(int i = 0; i < 3; ++i)
+		f.dev.dataInStage(1, nullptr);
+	XUSB_CHECK(in.queued() == 0);
+	XUSB_CHECK((port.txCount[tx] == 4) && (in.isoStats().packets == 4));
+
+	f.dev.SOF();
+	XUSB_CHECK((in.isoStats().underruns == 2) && (port.txCount[tx] == 4));
+
+	in.stop();
+	XUSB_CHECK(!in.isStreaming());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! IN: порядок и содержимое пакетов при переходе индексов кольца через 256
+static void testInWrap()
+{
+	XUsbTestBackend port;
+	Fixture<In, Out> f(port, 64, 64);
+	In & in = *f.in;
+	XUSB_CHECK(f.added && in.start());
+
+	uint32_t sent = 0;
+	uint32_t done = 0;
+	for(int round = 0; round < 300; ++round)
+	{
+		int burst = round % 4 + 1;
+		for(int i = 0; i < burst; ++i, ++sent)
+		{
+			uint8_t * buffer = in.acquire();
+			XUSB_CHECK(buffer != nullptr);
+			buffer[0] = uint8_t(sent);
+			in.commit(uint16_t(sent % 64 + 1));
+		}
+		XUSB_CHECK(in.queued() == burst);
+		f.dev.SOF();
+		for(int i = 0; i < burst; ++i, ++done)
+		{
+			XUSB_CHECK((port.txLength == done % 64 + 1) && (port.txBuf[0] == uint8_t(done)));
+			f.dev.dataInStage(1, nullptr);
+		}
+	}
+	XUSB_CHECK(in.queued() == 0);
+	XUSB_CHECK((in.isoStats().packets == sent) && (sent > 256));
+	XUSB_CHECK(in.isoStats().underruns == 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! OUT: приём в кольцо, переполнение в запасной буфер, пропуск интервала
+static void testOutFullEmpty()
+{
+	XUsbTestBackend port;
+	Fixture<In, Out> f(port, 64, 64);
+	Out & out = *f.out;
+	uint16_t size;
+	XUSB_CHECK(f.added && out.start());
+
+	uint8_t * first = port.rxBuf;
+	XUSB_CHECK((first != nullptr) && (port.rxLength == 64));
+	XUSB_CHECK(out.peek(size) == nullptr);
+
+	//! До первого пакета интервалы без приёма не считаются
+	f.dev.SOF();
+	f.dev.SOF();
+	XUSB_CHECK(out.isoStats().missed == 0);
+
+	port.rxBytes = 20;
+	f.dev.dataOutStage(2, nullptr);
+	uint8_t * second = port.rxBuf;
+	XUSB_CHECK((out.queued() == 1) && (second != first));
+
+	f.dev.SOF();
+	XUSB_CHECK(out.isoStats().missed == 0);
+	f.dev.SOF();
+	XUSB_CHECK((out.isoStats().missed == 1) && (out.events[ISO_MISSED] == 1));
+
+	//! Кольцо заполнено - приём идёт в запасной буфер
+	port.rxBytes = 30;
+	f.dev.dataOutStage(2, nullptr);
+	uint8_t * spare = port.rxBuf;
+	XUSB_CHECK((out.queued() == 2) && (spare != first) && (spare != second));
+
+	port.rxBytes = 40;
+	f.dev.dataOutStage(2, nullptr);
+	XUSB_CHECK((out.isoStats().overruns == 1) && (out.events[ISO_OVERRUN] == 1));
+	XUSB_CHECK((out.queued() == 2) && (port.rxBuf == spare));
+
+	XUSB_CHECK((out.peek(size) == first) && (size == 20));
+	out.release();
+	XUSB_CHECK(out.queued() == 1);
+
+	//! Пакет, уже принимаемый в запасной буфер, отбрасывается; следующий
+	//! идёт в освободившийся слот
+	f.dev.dataOutStage(2, nullptr);
+	XUSB_CHECK((out.isoStats().overruns == 2) && (port.rxBuf == first));
+	port.rxBytes = 50;
+	f.dev.dataOutStage(2, nullptr);
+	XUSB_CHECK((out.queued() == 2) && (out.isoStats().packets == 3));
+
+	XUSB_CHECK((out.peek(size) == second) && (size == 30));
+	out.release();
+	XUSB_CHECK((out.peek(size) == first) && (size == 50));
+	out.release();
+	out.release();
+	XUSB_CHECK((out.queued() == 0) && (out.peek(size) == nullptr));
+
+	f.dev.isoOutIncomplete(2);
+	XUSB_CHECK((out.isoStats().incomplete == 1) && (port.retargets == 1));
+
+	out.stop();
+	XUSB_CHECK(!out.isStreaming());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! OUT: размеры пакетов при переходе индексов кольца через 256
+static void testOutWrap()
+{
+	XUsbTestBackend port;
+	Fixture<In, OutStream<64, 4>> f(port, 64, 64);
+	OutStream<64, 4> & out = *f.out;
+	XUSB_CHECK(f.added && out.start());
+
+	//! Полное кольцо переводит приём в запасной буфер (testOutFullEmpty),
+	//! здесь в кольце остаётся свободный слот
+	uint32_t received = 0;
+	uint32_t consumed = 0;
+	for(int round = 0; round < 300; ++round)
+	{
+		int burst = round % 3 + 1;
+		for(int i = 0; i < burst; ++i, ++received)
+		{
+			port.rxBytes = received % 64 + 1;
+			port.rxBuf[0] = uint8_t(received);
+			f.dev.dataOutStage(2, nullptr);
+		}
+		XUSB_CHECK(out.queued() == burst);
+		for(int i = 0; i < burst; ++i, ++consumed)
+		{
+			uint16_t size;
+			const uint8_t * data = out.peek(size);
+			XUSB_CHECK((data != nullptr) && (size == consumed % 64 + 1) && (data[0] == uint8_t(consumed)));
+			out.release();
+		}
+	}
+	XUSB_CHECK((out.isoStats().packets == received) && (received > 256));
+	XUSB_CHECK(out.isoStats().overruns == 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! High-bandwidth OUT: длина приёма - микрокадр, микрокадр без завершающего
+//! пакета в кольцо не попадает
+static void testOutHighBandwidth()
+{
+	XUsbTestBackend port;
+	port.highSpeed = true;
+	Fixture<InStream<64, 2>, OutStream<1024, 2>> f(port, 64, 512 | (1 << 11));
+	OutStream<1024, 2> & out = *f.out;
+	XUSB_CHECK(f.added && out.start());
+	XUSB_CHECK(port.rxLength == 1024);
+
+	port.rxBytes = 700;
+	port.rxPackets = 2;
+	f.dev.dataOutStage(2, nullptr);
+	XUSB_CHECK((out.queued() == 1) && (out.isoStats().incomplete == 0));
+
+	port.rxPackets = 0;
+	f.dev.dataOutStage(2, nullptr);
+	XUSB_CHECK((out.queued() == 1) && (out.isoStats().incomplete == 1));
+	XUSB_CHECK(out.events[ISO_INCOMPLETE] == 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Пакет точки больше слота кольца - конфигурация не принимается
+static void testOversize()
+{
+	XUsbTestBackend port;
+	Fixture<In, Out> f(port, 64, 128);
+	XUSB_CHECK(!f.added);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+	testInFullEmpty();
+	testInWrap();
+	testOutFullEmpty();
+	testOutWrap();
+	testOutHighBandwidth();
+	testOversize();
+	return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Сборка и запуск тестов библиотеки на хосте (порт port/host).
+# Каждый *_test.cpp собирается с XUsbDevice.cpp в отдельную программу.
+#
+#   port/host/test/run.sh [флаги компилятора...]
+#
+#   port/host/test/run.sh -fsanitize=address,undefined
+#   port/host/test/run.sh -DXUSB_COMPACT_LAYOUT
+#   port/host/test/run.sh -DUSB_EP0_BUFFER_SIZE=160
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/../../.." && pwd)
+TEST=$ROOT/port/host/test
+
+CXX=${CXX:-g++}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+FLAGS="-std=c++14 -g -Wall -I$TEST -I$ROOT/port/host -I$ROOT $*"
+
+failed=0
+for src in "$TEST"/*_test.cpp; do
+	name=$(basename "$src" .cpp)
+	$CXX $FLAGS "$src" "$ROOT/XUsbDevice.cpp" -o "$OUT/$name"
+	if ASAN_OPTIONS=detect_leaks=0 "$OUT/$name"; then
+		echo "  ok    $name"
+	else
+		echo "  FAIL  $name"
+		failed=1
+	fi
+done
+
+exit $failed
@@ -0,0 +1,108 @@
+/*
+ * sofclock_test.cpp
+ *
+ * Подстройка локальных часов по SOF (XUsbSofClock) и счёт SOF в XUsbDevice::SOF():
+ * генератор 168 МГц с уходом +50 ppm, задержка входа в прерывание 12..60 тактов,
+ * пропуск нескольких прерываний подряд, переполнение счётчика тактов и номера кадра.
+ */
+
+#include "XUsbTestBackend.h"
+#include <math.h>
+#include <random>
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+static void testDiscipline()
+{
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	dev.reset();
+
+	const double clock = 168e6 * (1 + 50e-6);
+	const uint32_t base = 4000000000u;				//!< счётчик тактов переполняется через ~1,8 с
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int> latency(12, 60);
+
+	int lockedAt = -1;
+	double maxError = 0;
+	for(int n = 0; n < 3000; ++n)
+	{
+		double bus = n * 1e-3;
+		port.cyclesNow = uint32_t(base + uint64_t(llround(bus * clock)) + latency(rng));
+		port.frame = uint16_t((100 + n) & 0x7FF);
+		if(n == 1500)
+		{
+			//! Четыре SOF без прерывания
+			n += 3;
+			continue;
+		}
+		dev.SOF();
+		if(dev.isClockLocked() && (lockedAt < 0))
+			lockedAt = n;
+
+		if(n > 500)
+		{
+			//! Отметка между SOF переводится во время шины
+			double query = bus + 0.37e-3;
+			XUsbSofClock::BusTime time = dev.busTime(uint32_t(base + uint64_t(llround(query * clock))));
+			double estimate = ((time.frame - 100) & 0x7FF) * 1e-3 + time.ns * 1e-9;
+			double error = fabs(estimate - fmod(query, 2.048));
+			if(error > maxError)
+				maxError = error;
+		}
+	}
+
+	printf("    lock after %d SOF, period %.2f (true %.2f) cycles, max error %.2f us\n",
+		   lockedAt, dev.sofPeriod() / 65536.0, clock / 1000, maxError * 1e6);
+	XUSB_CHECK((lockedAt >= 0) && (lockedAt <= 20));
+	XUSB_CHECK(fabs(dev.sofPeriod() / 65536.0 - clock / 1000) < 1.0);
+	XUSB_CHECK(maxError < 0.5e-6);
+	XUSB_CHECK(dev.sofStats().missed == 4);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Ноль - обычное значение FNSOF после переполнения, а не отсутствие номера
+static void testFrameWrap()
+{
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	dev.reset();
+
+	static const uint16_t Frames[] = { 0x7FE, 0x7FF, 0x000, 0x001, 0x003, 0x000 };
+	for(uint16_t frame : Frames)
+	{
+		port.frame = frame;
+		dev.SOF();
+	}
+	//! 0x001 -> 0x003 - один пропуск, 0x003 -> 0x000 - 2044
+	XUSB_CHECK(dev.sofStats().missed == 1 + 2044);
+	XUSB_CHECK(dev.sofCount() == 1 + 1 + 1 + 1 + 2 + 2045);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Порт без номера SOF: каждый вызов - один SOF, номер ведёт устройство
+static void testUnnumbered()
+{
+	XUsbTestBackend port;
+	port.numbered = false;
+	XUsbDevice dev(&port, false);
+	dev.reset();
+
+	for(int n = 0; n < 2050; ++n)
+		dev.SOF();
+	XUSB_CHECK(dev.sofStats().missed == 0);
+	XUSB_CHECK(dev.sofCount() == 2050);
+	XUSB_CHECK(dev.sofStats().frames == 2050);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+	testDiscipline();
+	testFrameWrap();
+	testUnnumbered();
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * strings_test.cpp
+ *
+ * Дескрипторы строк по LANGID: основной язык при DESC_FALLBACK_STALL,
+ * переводы setStr() и их перенос через exportImage()/loadImage().
+ */
+
+#include "XUsbTestBackend.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! GET_DESCRIPTOR(STRING): ответ или пустой вектор при STALL
+static std::vector<uint8_t> getString(XUsbDevice & dev, XUsbTestBackend & port, uint8_t idx, uint16_t langid)
+{
+	int stalls = port.stalls;
+	xusbControlIn(dev, port, { 0x80, 6, idx, UsbDescType_String, uint8_t(langid), uint8_t(langid >> 8), 0xFF, 0 });
+	return (port.stalls != stalls) ? std::vector<uint8_t>() : port.ep0In;
+}
+
+static const uint8_t HelloDe[] = { 12, UsbDescType_String, 'H', 0, 'a', 0, 'l', 0, 'l', 0, 'o', 0 };
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Строка createStr() (langid 0) доступна при STALL по основному LANGID,
+//! остальные языки - только через переводы
+static void testStallPrimary()
+{
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	XUSB_CHECK(dev.init(0x200, 0, 0, 0, 64, 0x1234, 0x5678, 0x100, "Maker", nullptr, nullptr, 1));
+	dev.setDescFallback(XUsbDevice::DESC_FALLBACK_STALL);
+	dev.reset();
+	uint8_t idx = dev.createStr("Hello").idx();
+
+	std::vector<uint8_t> en = getString(dev, port, idx, 0x0409);
+	XUSB_CHECK((en.size() == 12) && (en[1] == UsbDescType_String) && (en[2] == 'H') && (en[10] == 'o'));
+	XUSB_CHECK(getString(dev, port, idx, 0x0407).empty());
+
+	XUSB_CHECK(dev.setStr(idx, HelloDe, 0x0407));
+	XUSB_CHECK(getString(dev, port, idx, 0x0407) == std::vector<uint8_t>(HelloDe, HelloDe + sizeof(HelloDe)));
+	XUSB_CHECK(getString(dev, port, idx, 0x0409) == en);
+
+	//! Основной язык - первый в дескрипторе строки 0
+	static const uint8_t Langs[] = { 6, UsbDescType_String, 0x07, 0x04, 0x09, 0x04 };
+	XUSB_CHECK(dev.setStr(0, Langs));
+	XUSB_CHECK(getString(dev, port, 1, 0x0407).size() == 12);
+	XUSB_CHECK(getString(dev, port, 1, 0x0409).empty());
+}
+
+//! При DESC_FALLBACK_NEUTRAL вариант с langid 0 отдаётся на любой LANGID
+static void testNeutral()
+{
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	XUSB_CHECK(dev.init(0x200, 0, 0, 0, 64, 0x1234, 0x5678, 0x100, "Maker", nullptr, nullptr, 1));
+	dev.reset();
+	XUSB_CHECK(getString(dev, port, 1, 0x0409).size() == 12);
+	XUSB_CHECK(getString(dev, port, 1, 0x0407).size() == 12);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Переводы переносятся через образ вместе с основными строками
+static void testImageTranslations()
+{
+	uint8_t image[256];
+	uint16_t size;
+	uint8_t idx;
+	{
+		XUsbTestBackend port;
+		XUsbDevice dev(&port, false);
+		XUSB_CHECK(dev.init(0x200, 0, 0, 0, 64, 0x1234, 0x5678, 0x100, "Maker", "Box", nullptr, 1));
+		idx = dev.createStr("Hello").idx();
+		XUSB_CHECK(dev.setStr(idx, HelloDe, 0x0407));
+		size = dev.exportImage(image, sizeof(image));
+		XUSB_CHECK(size != 0);
+		XUSB_CHECK(dev.exportImage(image, uint16_t(size - 1)) == 0);
+		size = dev.exportImage(image, sizeof(image));
+	}
+
+	XUsbDescriptorImage img(image);
+	XUSB_CHECK(img.isValid() && (img.size() == size) && (img.numStrings() == idx + 1));
+	uint8_t tIdx = 0;
+	uint16_t tLang = 0;
+	const uint8_t * str = img.translation(0, tIdx, tLang);
+	XUSB_CHECK((str != nullptr) && (tIdx == idx) && (tLang == 0x0407) && (memcmp(str, HelloDe, sizeof(HelloDe)) == 0));
+	XUSB_CHECK(img.translation(1, tIdx, tLang) == nullptr);
+
+	XUsbTestBackend port;
+	XUsbDevice dev(&port, false);
+	XUSB_CHECK(dev.loadImage(img));
+	dev.setDescFallback(XUsbDevice::DESC_FALLBACK_STALL);
+	dev.reset();
+	XUSB_CHECK(getString(dev, port, idx, 0x0407) == std::vector<uint8_t>(HelloDe, HelloDe + sizeof(HelloDe)));
+	std::vector<uint8_t> en = getString(dev, port, idx, 0x0409);
+	XUSB_CHECK((en.size() == 12) && (en[2] == 'H'));
+	XUSB_CHECK(getString(dev, port, 2, 0x0409).size() == 8);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+	testStallPrimary();
+	testNeutral();
+	testImageTranslations();
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * wakeup_test.cpp
+ *
+ * Remote wakeup из suspend: сигнал resume после простоя шины, resume хоста
+ * во время ожидания, передачи wakeupTransmit() с разрешением хоста и без него.
+ */
+
+#include "XUsbTestBackend.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Сконфигурированное устройство с interrupt IN 0x81
+class Fixture
+{
+public:
+	explicit Fixture(bool wakeupEnabled) :
+		dev(&port, false),
+		cfg(UsbConfigDescriptor(buffer, sizeof(buffer))),
+		iface(nullptr),
+		ep(nullptr)
+	{
+		XUSB_CHECK(dev.init(0x200, 0, 0, 0, 64, 0x1234, 0x5678, 0x100, nullptr, nullptr, nullptr, 1));
+		cfg.init(1, UsbStringDescriptor(), 0xA0, 50);
+		iface = new XUsbTestIface(cfg.beginInterface());
+		iface->init(0, 0, 0xFF, 0, 0, UsbStringDescriptor());
+		XUsbEndpoint e = iface->beginEP();
+		e.init(7, 0x81, UsbEPType_Interrupt, 8, 10);
+		ep = new XUsbTestInEndpoint(e);
+		iface->endEP(*ep);
+		XUSB_CHECK(cfg.endInterface(*iface));
+		XUSB_CHECK(dev.addConfig(&cfg));
+		dev.reset();
+		xusbControl(dev, { 0x00, 0x05, 3, 0, 0, 0, 0, 0 });
+		xusbControl(dev, { 0x00, 0x09, 1, 0, 0, 0, 0, 0 });
+		if(wakeupEnabled)
+			xusbControl(dev, { 0x00, 0x03, 1, 0, 0, 0, 0, 0 });
+		XUSB_CHECK(dev.isConfigured() && (dev.isRemoteWakeupEnabled() == wakeupEnabled));
+	}
+
+	~Fixture()
+	{
+		delete ep;
+		delete iface;
+	}
+
+	inline int sent() const { return port.txCount[XUsbTestBackend::index(0x81)]; }
+
+	XUsbTestBackend		port;
+	XUsbDevice			dev;
+	XUsbConfiguration	cfg;
+	XUsbTestIface *		iface;
+	XUsbTestInEndpoint *	ep;
+	uint8_t				buffer[64];
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+//! Сигнал resume не раньше 3 мс после suspend, передача уходит после выхода в L0
+static void testWakeup()
+{
+	Fixture f(true);
+	uint8_t report[8] = { 1 };
+	f.port.now = 100;
+	f.dev.suspend();
+	f.port.now = 101;
+
+	XUSB_CHECK(f.dev.wakeupTransmit(f.ep, report, sizeof(report)));
+	XUSB_CHECK(f.port.resumeSignals == 1);
+	XUSB_CHECK(f.port.now >= 103 + USB_REMOTE_WAKEUP_MS);
+	XUSB_CHECK((f.dev.linkState() == XUsbDevice::LINK_L0) && f.dev.isConfigured());
+	XUSB_CHECK((f.sent() == 1) && (f.port.txBuf == report));
+	XUSB_CHECK(f.dev.wakeupStats().count == 1);
+}
+
+//! Хост вывел шину из suspend, пока устройство выжидало простой:
+//! сигнал resume не подаётся, передача уходит по resume хоста
+static void testHostResumeFirst()
+{
+	Fixture f(true);
+	uint8_t report[8] = { 2 };
+	f.dev.suspend();
+	f.port.onDelay = [&f]() { f.dev.resume(); };
+
+	XUSB_CHECK(f.dev.wakeupTransmit(f.ep, report, sizeof(report)));
+	XUSB_CHECK(f.port.resumeSignals == 0);
+	XUSB_CHECK(f.dev.linkState() == XUsbDevice::LINK_L0);
+	XUSB_CHECK(f.sent() == 1);
+	XUSB_CHECK(f.dev.wakeupStats().count == 0);
+}
+
+//! Без SET_FEATURE(DEVICE_REMOTE_WAKEUP) передача не принимается и не
+//! остаётся в очереди: resume хоста её не отправит
+static void testRefused()
+{
+	Fixture f(false);
+	uint8_t report[8] = { 3 };
+	f.dev.suspend();
+
+	XUSB_CHECK(!f.dev.remoteWakeup());
+	XUSB_CHECK(!f.dev.wakeupTransmit(f.ep, report, sizeof(report)));
+	XUSB_CHECK(f.port.resumeSignals == 0);
+	f.dev.resume();
+	XUSB_CHECK(f.sent() == 0);
+
+	//! В L0 передача уходит сразу и без разрешения
+	XUSB_CHECK(f.dev.wakeupTransmit(f.ep, report, sizeof(report)));
+	XUSB_CHECK(f.sent() == 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+int main()
+{
+	testWakeup();
+	testHostResumeFirst();
+	testRefused();
+	return 0;
+}
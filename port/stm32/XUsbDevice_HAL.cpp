@@ -4,15 +4,24 @@
  *  Created on: Dec 20, 2017
  *      Author: ivan
  */
-#include <stm32f4xx_hal.h>
+//! Общий для семейств файл: заголовок HAL подключается из XUsbDevice_Config.h
+//! каталога семейства (STM32F4xx, STM32F7xx), который должен быть в пути поиска
+#include "XUsbDevice_Config.h"
 #include <plugins/usb/device/XUsbDevice.h>
 
+//! Класс устройства приложения (например, наследник XUsbStaticDevice).
+//! Если задан, фазы данных вызываются у него напрямую, без виртуальных вызовов.
+#ifdef XUSB_DEVICE_CLASS
+#include XUSB_DEVICE_HEADER
+typedef XUSB_DEVICE_CLASS XUsbPortDevice;
+#else
+typedef XUsbDevice XUsbPortDevice;
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define USBx USB_OTG_FS
-
 /**
   * @brief  Setup stage callback
   * @param  hpcd: PCD handle
@@ -32,7 +41,7 @@ void HAL_PCD_SetupStageCallback(PCD_HandleTypeDef *hpcd)
   */
 void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
-	XUsbDevice * device = (XUsbDevice*)hpcd->pData;
+	XUsbPortDevice * device = (XUsbPortDevice*)hpcd->pData;
     device->dataOutStage(epnum, hpcd->OUT_ep[epnum].xfer_buff);
 }
 
@@ -44,7 +53,7 @@ void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
   */
 void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
-	XUsbDevice * device = (XUsbDevice*)hpcd->pData;
+	XUsbPortDevice * device = (XUsbPortDevice*)hpcd->pData;
     device->dataInStage(epnum, hpcd->IN_ep[epnum].xfer_buff);
 }
 
@@ -112,14 +121,10 @@ void HAL_PCD_ResumeCallback(PCD_HandleTypeDef *hpcd)
   */
 void HAL_PCD_ISOOUTIncompleteCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
-	//XUsbDevice * device = (XUsbDevice*)hpcd->pData;
-    //device->isoOutIncomplete(epnum);
-
-    uint32_t framenum = (USBx_DEVICE->DSTS | USB_OTG_DSTS_FNSOF) >> USB_OTG_DSTS_FNSOF_Pos;
-    if(framenum % 2 == 0)
-    	USBx_OUTEP(epnum)->DOEPCTL |= USB_OTG_DOEPCTL_SODDFRM;
-    else
-    	USBx_OUTEP(epnum)->DOEPCTL |= USB_OTG_DOEPCTL_SD0PID_SEVNFRM;
+	//! Чётность кадра переключает точка (XUsbEndpoint::isoRetarget) через порт,
+	//! на регистрах того контроллера, которому принадлежит hpcd
+	XUsbDevice * device = (XUsbDevice*)hpcd->pData;
+    device->isoOutIncomplete(epnum);
 }
 
 /**
@@ -130,16 +135,8 @@ void HAL_PCD_ISOOUTIncompleteCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
   */
 void HAL_PCD_ISOINIncompleteCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 {
-	//XUsbDevice * device = (XUsbDevice*)hpcd->pData;
-	//device->isoInIncomplete(epnum);
-
-	//uint32_t framenum = (USBx_DEVICE->DSTS | USB_OTG_DSTS_FNSOF) >> USB_OTG_DSTS_FNSOF_Pos;
-
-
-	if ((USBx_DEVICE->DSTS & ( 1U << 8U )) != 0U)
-	    USBx_INEP(epnum)->DIEPCTL |= USB_OTG_DIEPCTL_SODDFRM;
-	else
-	    USBx_INEP(epnum)->DIEPCTL |= USB_OTG_DIEPCTL_SD0PID_SEVNFRM;
+	XUsbDevice * device = (XUsbDevice*)hpcd->pData;
+	device->isoInIncomplete(epnum);
 }
 
 /**
@@ -166,6 +163,16 @@ void HAL_PCD_DisconnectCallback(PCD_HandleTypeDef *hpcd)
 
 
 #if (USBD_LPM_ENABLED == 1)
+
+//! Выход из STOP с перезапуском PLL занимает сотни микросекунд, поэтому STOP
+//! допустим, только если хост даёт на выход из L1 не меньше этого (см. BESL)
+#ifndef USB_LPM_STOP_MIN_US
+#define USB_LPM_STOP_MIN_US 1000
+#endif
+
+//! Контроллер остановлен в L1, при выходе нужно восстановить тактирование
+static bool lpmStopped = false;
+
 /**
   * @brief  HAL_PCDEx_LPM_Callback : Send LPM message to user layer
   * @param  hpcd: PCD handle
@@ -176,24 +183,28 @@ void HAL_PCDEx_LPM_Callback(PCD_HandleTypeDef *hpcd, PCD_LPM_MsgTypeDef msg) {
 	XUsbDevice * device = (XUsbDevice*)hpcd->pData;
     switch ( msg) {
     case PCD_LPM_L0_ACTIVE:
-        if (hpcd->Init.low_power_enable) {
+        if (lpmStopped) {
             SystemClock_Config();
-
-            /* Reset SLEEPDEEP bit of Cortex System Control Register */
-            SCB->SCR &= (uint32_t)~((uint32_t)(SCB_SCR_SLEEPDEEP_Msk | SCB_SCR_SLEEPONEXIT_Msk));
+            lpmStopped = false;
         }
+        /* Reset SLEEPDEEP bit of Cortex System Control Register */
+        SCB->SCR &= (uint32_t)~((uint32_t)(SCB_SCR_SLEEPDEEP_Msk | SCB_SCR_SLEEPONEXIT_Msk));
         __HAL_PCD_UNGATE_PHYCLOCK(hpcd);
-        device->resume();
+        device->lpmWake();
         break;
 
     case PCD_LPM_L1_ACTIVE:
+        device->lpmSleep(uint8_t(hpcd->BESL),
+                         (hpcd->Instance->GLPMCFG & USB_OTG_GLPMCFG_REMWAKE) != 0);
         __HAL_PCD_GATE_PHYCLOCK(hpcd);
-        device->suspend();
 
-        /*Enter in STOP mode */
         if (hpcd->Init.low_power_enable) {
-            /* Set SLEEPDEEP bit and SleepOnExit of Cortex System Control Register */
-            SCB->SCR |= (uint32_t)((uint32_t)(SCB_SCR_SLEEPDEEP_Msk | SCB_SCR_SLEEPONEXIT_Msk));
+            /* STOP, если успеваем из него выйти, иначе SLEEP с тактированием ядра */
+            lpmStopped = (usbBeslMicroseconds(uint8_t(hpcd->BESL)) >= USB_LPM_STOP_MIN_US);
+            if (lpmStopped)
+                SCB->SCR |= (uint32_t)((uint32_t)(SCB_SCR_SLEEPDEEP_Msk | SCB_SCR_SLEEPONEXIT_Msk));
+            else
+                SCB->SCR |= (uint32_t)SCB_SCR_SLEEPONEXIT_Msk;
         }
         break;
   }
@@ -0,0 +1,279 @@
+/*
+ * XUsbStm32Port.h
+ *
+ *  Created on: Sep 3, 2017
+ *      Author: ivan
+ */
+
+#ifndef XUSBSTM32PORT_H_
+#define XUSBSTM32PORT_H_
+
+#include <string.h>
+
+//! Порт для STM32 Cube HAL (PCD). Подключается из XUsbDevice_Config.h семейства
+//! после заголовка HAL. handle - указатель на PCD_HandleTypeDef.
+struct XUsbStm32Port
+{
+	static inline PCD_HandleTypeDef * pcd(void * handle)
+	{
+		return static_cast<PCD_HandleTypeDef*>(handle);
+	}
+
+	//! HAL записывает скорость в Init.speed до вызова HAL_PCD_ResetCallback
+	static inline bool isHighSpeed(void * handle)
+	{
+		return pcd(handle)->Init.speed == PCD_SPEED_HIGH;
+	}
+
+	//! high-speed возможен только с внешним ULPI или встроенным UTMI PHY
+	static inline bool isHighSpeedCapable(void * handle)
+	{
+		return pcd(handle)->Init.phy_itface != PCD_PHY_EMBEDDED;
+	}
+
+	//! LPM включается в HAL_PCDEx_ActivateLPM() при инициализации контроллера
+	static inline bool isLpmCapable(void * handle)
+	{
+		return pcd(handle)->Init.lpm_enable != 0;
+	}
+
+	//! Тактирование PHY могло быть остановлено при входе в suspend или L1,
+	//! ядро - оставлено в режиме сна по выходу из прерывания
+	static inline void remoteWakeupSignal(void * handle, bool active)
+	{
+		if(active)
+		{
+			SCB->SCR &= ~(uint32_t)(SCB_SCR_SLEEPDEEP_Msk | SCB_SCR_SLEEPONEXIT_Msk);
+			__HAL_PCD_UNGATE_PHYCLOCK(pcd(handle));
+			HAL_PCD_ActivateRemoteWakeup(pcd(handle));
+		}
+		else
+			HAL_PCD_DeActivateRemoteWakeup(pcd(handle));
+	}
+
+	static inline uint32_t ticks(void * /*handle*/)
+	{
+		return HAL_GetTick();
+	}
+
+	static inline void delay(void * /*handle*/, uint32_t ms)
+	{
+		HAL_Delay(ms);
+	}
+
+	//! Запрет прерываний для данных, общих с обработчиком USB. Вложенный вызов
+	//! не разрешает прерывания раньше внешнего: возвращается прежний PRIMASK.
+	static inline uint32_t lock(void * /*handle*/)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		return primask;
+	}
+
+	static inline void unlock(void * /*handle*/, uint32_t state)
+	{
+		__set_PRIMASK(state);
+	}
+
+	//! DSTS.FNSOF: номер кадра на full-speed, кадр и микрокадр (биты 2..0) на high-speed
+	static inline uint16_t frameNumber(void * handle)
+	{
+		return uint16_t((device(handle)->DSTS & USB_OTG_DSTS_FNSOF) >> USB_OTG_DSTS_FNSOF_Pos);
+	}
+
+	//! Номер SOF ядро сообщает всегда
+	static inline bool hasFrameNumber(void * /*handle*/)
+	{
+		return true;
+	}
+
+	//! Счётчик тактов ядра DWT, включается один раз при создании устройства
+	static inline void enableCycleCounter(void * /*handle*/)
+	{
+		CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+		DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	}
+
+	static inline uint32_t cycles(void * /*handle*/)
+	{
+		return DWT->CYCCNT;
+	}
+
+	//! Изохронная передача уходит только в (микро)кадре заданной чётности
+	//! (SODDFRM/SEVNFRM), как при запуске в HAL - следующий после текущего.
+	//! Бит 0 номера SOF - DSTS бит 8 на обеих скоростях.
+	static inline void isoNextFrame(void * handle, uint8_t ep_addr)
+	{
+		bool currentOdd = (frameNumber(handle) & 0x01) != 0;
+		if(ep_addr & 0x80)
+			inEP(handle, ep_addr)->DIEPCTL |= currentOdd ? USB_OTG_DIEPCTL_SD0PID_SEVNFRM : USB_OTG_DIEPCTL_SODDFRM;
+		else
+			outEP(handle, ep_addr)->DOEPCTL |= currentOdd ? USB_OTG_DOEPCTL_SD0PID_SEVNFRM : USB_OTG_DOEPCTL_SODDFRM;
+	}
+
+	static inline void setAddress(void * handle, uint8_t addr)
+	{
+		HAL_PCD_SetAddress(pcd(handle), addr);
+	}
+
+	static inline void openEP(void * handle, uint8_t ep_addr, uint16_t ep_mps, uint8_t ep_type)
+	{
+		HAL_PCD_EP_Open(pcd(handle), ep_addr, ep_mps, ep_type);
+	}
+
+	//! Объём FIFO в словах: OTG HS - 4 КБ, OTG FS - 1,25 КБ
+	static inline uint16_t fifoWords(void * handle)
+	{
+#ifdef USB_OTG_HS
+		if(pcd(handle)->Instance == USB_OTG_HS)
+			return 1024;
+#endif
+		(void)handle;
+		return 320;
+	}
+
+	//! Размеры в словах. RX FIFO и TX FIFO нулевой точки, при сбросе шины:
+	//! смещения остальных TX FIFO HAL считает от них.
+	static inline void setFifos(void * handle, uint16_t rx, uint16_t tx0)
+	{
+		USB_FlushTxFifo(pcd(handle)->Instance, 0x10U);
+		USB_FlushRxFifo(pcd(handle)->Instance);
+		HAL_PCDEx_SetRxFiFo(pcd(handle), rx);
+		HAL_PCDEx_SetTxFiFo(pcd(handle), 0, tx0);
+	}
+
+	//! TX FIFO 1..count-1 по порядку за FIFO нулевой точки. Сбрасываются только
+	//! они: RX FIFO и FIFO нулевой точки заняты текущим запросом (SET_CONFIGURATION).
+	//! Точек больше, чем в ядре, не бывает.
+	static inline void setTxFifos(void * handle, const uint16_t * tx, uint8_t count)
+	{
+		for(uint8_t i = 1; (i < count) && (i < pcd(handle)->Init.dev_endpoints); ++i)
+		{
+			USB_FlushTxFifo(pcd(handle)->Instance, i);
+			HAL_PCDEx_SetTxFiFo(pcd(handle), i, tx[i]);
+		}
+	}
+
+	static inline void closeEP(void * handle, uint8_t ep_addr)
+	{
+		HAL_PCD_EP_Close(pcd(handle), ep_addr);
+	}
+
+	static inline void transmit(void * handle, uint8_t ep_addr, uint8_t * pbuf, uint16_t size)
+	{
+		HAL_PCD_EP_Transmit(pcd(handle), ep_addr, pbuf, size);
+	}
+
+	//! Запуск периодической IN-передачи в обход HAL_PCD_EP_Transmit: ядро фиксирует
+	//! DIEPTSIZ при установке EPENA, а HAL записывает для изохронной точки MCNT = 1
+	//! в той же последовательности. Здесь PKTCNT, XFRSIZ и MCNT (число пакетов
+	//! микрокадра high-bandwidth) записываются до включения точки. Поля IN_ep
+	//! заполняются как в HAL: по ним обработчик прерываний дописывает FIFO
+	//! и завершает передачу.
+	static inline void transmitPeriodic(void * handle, uint8_t ep_addr, uint8_t * pbuf, uint16_t size,
+										uint8_t transactions)
+	{
+		PCD_HandleTypeDef * hpcd = pcd(handle);
+		PCD_EPTypeDef * ep = &hpcd->IN_ep[ep_addr & 0x0F];
+		USB_OTG_INEndpointTypeDef * regs = inEP(handle, ep_addr);
+		bool dma = (hpcd->Init.dma_enable == 1U);
+		uint32_t packets = (size == 0) ? 1 : (size + ep->maxpacket - 1) / ep->maxpacket;
+
+		ep->is_in = 1;
+		ep->num = ep_addr & 0x0F;
+		ep->xfer_buff = pbuf;
+		ep->xfer_len = size;
+		ep->xfer_count = 0;
+		if(dma)
+			ep->dma_addr = uint32_t(reinterpret_cast<uintptr_t>(pbuf));
+
+		regs->DIEPTSIZ = ((packets << USB_OTG_DIEPTSIZ_PKTCNT_Pos) & USB_OTG_DIEPTSIZ_PKTCNT) |
+						 (uint32_t(size) & USB_OTG_DIEPTSIZ_XFRSIZ) |
+						 ((uint32_t(transactions) << USB_OTG_DIEPTSIZ_MULCNT_Pos) & USB_OTG_DIEPTSIZ_MULCNT);
+		if(dma)
+			regs->DIEPDMA = uint32_t(reinterpret_cast<uintptr_t>(pbuf));
+		if(ep->type == EP_TYPE_ISOC)
+			isoNextFrame(handle, ep_addr);
+		regs->DIEPCTL |= USB_OTG_DIEPCTL_CNAK | USB_OTG_DIEPCTL_EPENA;
+
+		if(dma)
+			return;
+		//! Изохронные данные микрокадра записываются в FIFO сразу, interrupt - по TXFE
+		if(ep->type == EP_TYPE_ISOC)
+			writeFifo(handle, ep->num, pbuf, size);
+		else if(size != 0)
+			device(handle)->DIEPEMPMSK |= 1U << ep->num;
+	}
+
+	static inline void writeFifo(void * handle, uint8_t epnum, const uint8_t * src, uint16_t size)
+	{
+		volatile uint32_t * fifo = reinterpret_cast<volatile uint32_t*>(
+				reinterpret_cast<uintptr_t>(pcd(handle)->Instance) + USB_OTG_FIFO_BASE + epnum * USB_OTG_FIFO_SIZE);
+		for(uint16_t i = 0; i < size; i += 4)
+		{
+			uint32_t word = 0;
+			memcpy(&word, src + i, ((size - i) < 4) ? (size - i) : 4);
+			*fifo = word;
+		}
+	}
+
+	//! Транзакций микрокадра по PID последнего принятого пакета (RXDPID):
+	//! DATA0 - 1, DATA1 - 2, DATA2 - 3, MDATA - 0 (завершающий пакет не принят)
+	static inline uint8_t rxTransactions(void * handle, uint8_t ep_addr)
+	{
+		static const uint8_t Transactions[4] = { 1, 3, 2, 0 };
+		uint32_t pid = (outEP(handle, ep_addr)->DOEPTSIZ & USB_OTG_DOEPTSIZ_STUPCNT) >> USB_OTG_DOEPTSIZ_STUPCNT_Pos;
+		return Transactions[pid & 0x03];
+	}
+
+	static inline void receive(void * handle, uint8_t ep_addr, uint8_t * pbuf, uint16_t size)
+	{
+		HAL_PCD_EP_Receive(pcd(handle), ep_addr, pbuf, size);
+	}
+
+	static inline void stallEP(void * handle, uint8_t ep_addr)
+	{
+		HAL_PCD_EP_SetStall(pcd(handle), ep_addr);
+	}
+
+	static inline void clearStallEP(void * handle, uint8_t ep_addr)
+	{
+		HAL_PCD_EP_ClrStall(pcd(handle), ep_addr);
+	}
+
+	static inline bool isStallEP(void * handle, uint8_t ep_addr)
+	{
+		return (ep_addr & 0x80) ? pcd(handle)->IN_ep[ep_addr & 0x7F].is_stall :
+								  pcd(handle)->OUT_ep[ep_addr & 0x7F].is_stall;
+	}
+
+	static inline void flushEP(void * handle, uint8_t ep_addr)
+	{
+		HAL_PCD_EP_Flush(pcd(handle), ep_addr);
+	}
+
+	static inline uint32_t rxCount(void * handle, uint8_t ep_addr)
+	{
+		return HAL_PCD_EP_GetRxCount(pcd(handle), ep_addr);
+	}
+
+	static inline USB_OTG_DeviceTypeDef * device(void * handle)
+	{
+		return reinterpret_cast<USB_OTG_DeviceTypeDef*>(reinterpret_cast<uintptr_t>(pcd(handle)->Instance) +
+				USB_OTG_DEVICE_BASE);
+	}
+
+	static inline USB_OTG_INEndpointTypeDef * inEP(void * handle, uint8_t ep_addr)
+	{
+		return reinterpret_cast<USB_OTG_INEndpointTypeDef*>(reinterpret_cast<uintptr_t>(pcd(handle)->Instance) +
+				USB_OTG_IN_ENDPOINT_BASE + (ep_addr & 0x0F) * USB_OTG_EP_REG_SIZE);
+	}
+
+	static inline USB_OTG_OUTEndpointTypeDef * outEP(void * handle, uint8_t ep_addr)
+	{
+		return reinterpret_cast<USB_OTG_OUTEndpointTypeDef*>(reinterpret_cast<uintptr_t>(pcd(handle)->Instance) +
+				USB_OTG_OUT_ENDPOINT_BASE + (ep_addr & 0x0F) * USB_OTG_EP_REG_SIZE);
+	}
+};
+
+#endif /* XUSBSTM32PORT_H_ */
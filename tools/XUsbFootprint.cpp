@@ -0,0 +1,32 @@
+/*
+ * XUsbFootprint.cpp
+ *
+ * Размеры объектов библиотеки для текущей конфигурации (XUsbDevice_Config.h).
+ * sizeof каждого класса записывается как размер символа xusb_sizeof_<класс>,
+ * поэтому отчёт получается через nm и для кросс-компилятора, без запуска.
+ * Используется tools/footprint.sh.
+ */
+
+#include "XUsbDevice.h"
+
+#define XUSB_FOOTPRINT(name, ...) \
+	extern const uint8_t xusb_sizeof_##name[sizeof(__VA_ARGS__)]; \
+	__attribute__((used)) const uint8_t xusb_sizeof_##name[sizeof(__VA_ARGS__)] = { 0 };
+
+XUSB_FOOTPRINT(UsbDescriptor, UsbDescriptor)
+XUSB_FOOTPRINT(UsbEPDescriptor, UsbEPDescriptor)
+XUSB_FOOTPRINT(UsbStringDescriptor, UsbStringDescriptor)
+XUSB_FOOTPRINT(UsbInterfaceDescriptor, UsbInterfaceDescriptor)
+XUSB_FOOTPRINT(UsbConfigDescriptor, UsbConfigDescriptor)
+XUSB_FOOTPRINT(UsbUtf16Encoder, UsbUtf16Encoder)
+XUSB_FOOTPRINT(XUsbFragment, XUsbFragment)
+XUSB_FOOTPRINT(XUsbCtlData, XUsbCtlData)
+XUSB_FOOTPRINT(XUsbDescriptorImage, XUsbDescriptorImage)
+XUSB_FOOTPRINT(XUsbEndpointState, XUsbEndpointState)
+XUSB_FOOTPRINT(XUsbEndpoint, XUsbEndpoint)
+XUSB_FOOTPRINT(XUsbInEndpoint, XUsbInEndpoint)
+XUSB_FOOTPRINT(XUsbOutEndpoint, XUsbOutEndpoint)
+XUSB_FOOTPRINT(XUsbZeroEndpoint, XUsbZeroEndpoint<XUsbDevice>)
+XUSB_FOOTPRINT(XUsbDevice, XUsbDevice)
+XUSB_FOOTPRINT(XUsbIface, XUsbIface)
+XUSB_FOOTPRINT(XUsbConfiguration, XUsbConfiguration)
@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Отчёт о размере библиотеки для заданной конфигурации:
+# sizeof каждого класса, flash и RAM объектных файлов, крупнейшие символы.
+#
+#   tools/footprint.sh <каталог XUsbDevice_Config.h> [флаги компилятора...]
+#
+#   CXX=arm-none-eabi-g++ NM=arm-none-eabi-nm SIZE=arm-none-eabi-size \
+#   tools/footprint.sh port/stm32/STM32F4xx -mcpu=cortex-m4 -mthumb \
+#       -DSTM32F405xx -I<Cube>/Drivers/STM32F4xx_HAL_Driver/Inc ...
+#
+#   tools/footprint.sh port/host
+#
+# Добавьте -DXUSB_COMPACT_LAYOUT, чтобы сравнить с компактной раскладкой.
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "usage: $0 <config dir> [compiler flags...]" >&2
+	exit 1
+fi
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CONFIG=$1
+shift
+
+CXX=${CXX:-g++}
+NM=${NM:-nm}
+SIZE=${SIZE:-size}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+FLAGS="-std=c++11 -Os -ffunction-sections -fdata-sections -I$CONFIG -I$ROOT $*"
+
+$CXX $FLAGS -c "$ROOT/tools/XUsbFootprint.cpp" -o "$OUT/footprint.o"
+$CXX $FLAGS -c "$ROOT/XUsbDevice.cpp" -o "$OUT/XUsbDevice.o"
+
+echo "== sizeof ($CONFIG $*)"
+$NM -S -t d "$OUT/footprint.o" | awk '/xusb_sizeof_/ {
+	name = $4; sub(/^xusb_sizeof_/, "", name);
+	printf "  %-28s %6d\n", name, $2 }'
+
+echo
+echo "== XUsbDevice.o"
+$SIZE -A "$OUT/XUsbDevice.o" | awk '
+	$1 ~ /^\.text/ || $1 ~ /^\.rodata/ { flash += $2 }
+	$1 ~ /^\.data/ { flash += $2; ram += $2 }
+	$1 ~ /^\.bss/ { ram += $2 }
+	END { printf "  flash %6d\n  ram   %6d\n", flash, ram }'
+
+echo
+echo "== largest symbols (T/W/V/R - flash, D - flash+ram, B - ram)"
+$NM -S -t d -C --size-sort -r "$OUT/XUsbDevice.o" | awk 'NF >= 4 {
+	size = $2 + 0; type = toupper($3);
+	$1 = ""; $2 = ""; $3 = "";
+	printf "  %s %6d %s\n", type, size, substr($0, 4) }' | head -20
@@ -32,10 +32,39 @@ typedef enum
     UsbDescType_Endpoint      	= 0x05,
 	UsbDescType_DeviceQualifier = 0x06,
 	UsbDescType_OtherSpeedConfiguration = 0x07,
-	UsbDescType_BOS 			= 0x0F
+	UsbDescType_InterfaceAssociation = 0x0B,
+	UsbDescType_BOS 			= 0x0F,
+	UsbDescType_DeviceCapability = 0x10
 }
 UsbDescType;
 
+//! bDevCapabilityType дескрипторов из BOS
+typedef enum
+{
+	UsbDevCap_USB20Extension	= 0x02
+}
+UsbDevCapType;
+
+//! bmAttributes USB 2.0 Extension (USB 2.0 LPM ECN)
+typedef enum
+{
+	UsbLpm_Supported		= 0x0002,	//!< поддерживается LPM L1
+	UsbLpm_BESL				= 0x0004,	//!< HIRD/BESL в токене трактуется как BESL
+	UsbLpm_BaselineValid	= 0x0008,	//!< биты 11..8 - рекомендуемый базовый BESL
+	UsbLpm_DeepValid		= 0x0010	//!< биты 15..12 - рекомендуемый глубокий BESL
+}
+UsbLpmAttributes;
+
+//! Время на выход из L1, которое хост даёт устройству по BESL (USB 2.0 LPM ECN), мкс:
+//! 125, 150, 200, 300, 400, 500, затем 1..10 мс
+constexpr uint16_t usbBeslMicroseconds(uint8_t besl)
+{
+	return ((besl & 0x0F) == 0) ? 125 :
+		   ((besl & 0x0F) == 1) ? 150 :
+		   ((besl & 0x0F) < 6) ? uint16_t(100 * (besl & 0x0F)) :
+		   uint16_t(1000 * ((besl & 0x0F) - 5));
+}
+
 typedef enum
 {
     UsbEPDir_Out    = 0x00,
@@ -71,6 +100,33 @@ typedef enum
 }
 UsbEPUsage;
 
+typedef enum
+{
+	UsbSpeed_Full,
+	UsbSpeed_High
+}
+UsbSpeedClass;
+
+//! Доля (микро)кадра под периодические передачи (USB 2.0, 5.6.4, 5.7.4):
+//! 90% от 1500 байт кадра full-speed, 80% от 7500 байт микрокадра high-speed
+constexpr uint16_t usbPeriodicBudget(UsbSpeedClass speed)
+{
+	return (speed == UsbSpeed_High) ? 6000 : 1350;
+}
+
+//! Время шины, резервируемое точкой в (микро)кадре, в байтах: данные всех
+//! транзакций и накладные расходы протокола на транзакцию (USB 2.0, табл. 5-4 - 5-8).
+//! Bulk и control периодическую полосу не занимают.
+constexpr uint16_t usbPeriodicBytes(uint8_t attributes, uint16_t maxPacket, UsbSpeedClass speed)
+{
+	return uint16_t(
+		((attributes & 0x03) == UsbEPType_Isochronous) ?
+			((maxPacket & 0x07FF) + ((speed == UsbSpeed_High) ? 38 : 9)) * (((maxPacket >> 11) & 0x03) + 1) :
+		((attributes & 0x03) == UsbEPType_Interrupt) ?
+			((maxPacket & 0x07FF) + ((speed == UsbSpeed_High) ? 55 : 13)) * (((maxPacket >> 11) & 0x03) + 1) :
+		0);
+}
+
 typedef enum
 {
     REQ_RECIPIENT_DEVICE                       = 0x00,
@@ -332,8 +388,90 @@ public:
 
     inline uint16_t	wMaxPacketSize() const { return fields()->wMaxPacketSize; }
 
+    //! Размер пакета, биты 10..0 wMaxPacketSize
+    inline uint16_t packetSize() const { return fields()->wMaxPacketSize & 0x07FF; }
+
+    //! Транзакций в микрокадре: 1 + биты 12..11 wMaxPacketSize (high-bandwidth,
+    //! только периодические точки high-speed)
+    inline uint8_t transactions() const { return uint8_t(((fields()->wMaxPacketSize >> 11) & 0x03) + 1); }
+
     inline uint8_t	bInterval() const { return fields()->bInterval; }
 
+    //! wMaxPacketSize точки, описанной для скорости from, при работе на скорости to:
+    //! bulk - 64 или 512 байт, периодические точки на full-speed теряют
+    //! дополнительные транзакции и ограничиваются пакетом full-speed
+    static inline uint16_t speedMaxPacket(uint8_t attributes,
+                                          uint16_t maxPacket,
+                                          UsbSpeedClass from,
+                                          UsbSpeedClass to)
+    {
+        if(from == to)
+            return maxPacket;
+
+        uint16_t size = maxPacket & 0x07FF;
+        uint32_t total = uint32_t(size) * (((maxPacket >> 11) & 0x03) + 1);
+        switch(attributes & UsbEPTypeMask)
+        {
+        case UsbEPType_Bulk:
+            return (to == UsbSpeed_High) ? 512 : 64;
+
+        case UsbEPType_Interrupt:
+            return (to == UsbSpeed_High) ? maxPacket : ((size < 64) ? size : 64);
+
+        case UsbEPType_Isochronous:
+            return (to == UsbSpeed_High) ? maxPacket : uint16_t((total < 1023) ? total : 1023);
+
+        default:
+            return maxPacket;
+        }
+    }
+
+    //! bInterval для скорости to. На full-speed interrupt задаётся в кадрах,
+    //! isochronous - как 2^(n-1) кадров, на high-speed оба - 2^(n-1) микрокадров.
+    //! Период при пересчёте не увеличивается.
+    static inline uint8_t speedInterval(uint8_t attributes,
+                                        uint8_t interval,
+                                        UsbSpeedClass from,
+                                        UsbSpeedClass to)
+    {
+        if((from == to) || (interval == 0))
+            return interval;
+
+        switch(attributes & UsbEPTypeMask)
+        {
+        case UsbEPType_Isochronous:
+            if(to == UsbSpeed_High)
+                return uint8_t((interval + 3 < 16) ? interval + 3 : 16);
+            return uint8_t((interval > 4) ? interval - 3 : 1);
+
+        case UsbEPType_Interrupt:
+            if(to == UsbSpeed_High)
+            {
+                uint8_t n = 1;
+                while((n < 16) && ((1UL << n) <= 8UL * interval))
+                    ++n;
+                return n;
+            }
+            else
+            {
+                uint32_t frames = (1UL << (((interval < 16) ? interval : 16) - 1)) / 8;
+                return uint8_t((frames < 1) ? 1 : (frames > 255) ? 255 : frames);
+            }
+
+        default:
+            return interval;
+        }
+    }
+
+    //! Пересчитывает DEFAULT_LENGTH байт дескриптора точки на месте
+    static inline void convertSpeed(uint8_t * ep, UsbSpeedClass from, UsbSpeedClass to)
+    {
+        uint16_t maxPacket = speedMaxPacket(ep[3], uint16_t(ep[4] | (ep[5] << 8)), from, to);
+        ep[4] = uint8_t(maxPacket);
+        ep[5] = uint8_t(maxPacket >> 8);
+        ep[6] = speedInterval(ep[3], ep[6], from, to);
+    }
+
 protected:
     inline uint8_t * restFields() const { return UsbDescriptor::restFields() + sizeof(EPDescriptorFields); }
 
@@ -401,6 +539,86 @@ public:
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+//! Последовательное преобразование UTF-8 в единицы UTF-16.
+//! Некорректные последовательности заменяются на U+FFFD,
+//! символы вне BMP передаются суррогатной парой.
+class __packed UsbUtf16Encoder
+{
+public:
+	explicit UsbUtf16Encoder(const char * utf8 = nullptr) :
+		_src(reinterpret_cast<const uint8_t*>(utf8)),
+		_pending(0)
+	{}
+
+	inline bool isValid() const { return _src != nullptr; }
+
+	//! Следующая единица UTF-16, 0 - конец строки
+	inline uint16_t next()
+	{
+		if(_pending != 0)
+		{
+			uint16_t unit = _pending;
+			_pending = 0;
+			return unit;
+		}
+
+		uint32_t cp = decode();
+		if(cp < 0x10000)
+			return uint16_t(cp);
+
+		cp -= 0x10000;
+		_pending = uint16_t(0xDC00 | (cp & 0x3FF));
+		return uint16_t(0xD800 | (cp >> 10));
+	}
+
+	//! Количество единиц UTF-16 в строке (не больше 126 - предел bLength)
+	static inline uint8_t units(const char * utf8)
+	{
+		UsbUtf16Encoder encoder(utf8);
+		uint8_t count = 0;
+		while((count < 126) && (encoder.next() != 0))
+			++count;
+		return count;
+	}
+
+private:
+	inline uint32_t decode()
+	{
+		uint8_t lead = *_src;
+		if(lead == 0)
+			return 0;
+		++_src;
+		if(lead < 0x80)
+			return lead;
+
+		uint8_t extra;
+		uint32_t cp;
+		uint32_t min;
+		if((lead & 0xE0) == 0xC0)		{ extra = 1; cp = lead & 0x1F; min = 0x80; }
+		else if((lead & 0xF0) == 0xE0)	{ extra = 2; cp = lead & 0x0F; min = 0x800; }
+		else if((lead & 0xF8) == 0xF0)	{ extra = 3; cp = lead & 0x07; min = 0x10000; }
+		else
+			return 0xFFFD;
+
+		for(uint8_t i = 0; i < extra; ++i)
+		{
+			//! Обрыв последовательности: продолжение не поглощается
+			if((*_src & 0xC0) != 0x80)
+				return 0xFFFD;
+			cp = (cp << 6) | (*_src++ & 0x3F);
+		}
+
+		if((cp < min) || (cp > 0x10FFFF) || ((cp >= 0xD800) && (cp <= 0xDFFF)))
+			return 0xFFFD;
+		return cp;
+	}
+
+	const uint8_t *	_src;
+	uint16_t		_pending;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 class __packed UsbStringDescriptor :
         public UsbDescriptor
 {
@@ -430,14 +648,19 @@ public:
 	    return true;
 	}
 
+    //! str в UTF-8, буфера длиной 2 + strlen(str) * 2 всегда достаточно
     inline bool init(const char * str)
     {
-        uint8_t len = uint8_t(strlen(str));
+        uint8_t len = UsbUtf16Encoder::units(str);
         if(!UsbDescriptor::init(2 + len * 2, UsbDescType_String))
             return false;
-        memset(restFields(), 0, len * 2);
+        UsbUtf16Encoder encoder(str);
         for(int i = 0; i < len; ++i)
-        	restFields()[i * 2] = str[i];
+        {
+        	uint16_t unit = encoder.next();
+        	restFields()[i * 2] = unit & 0x00FF;
+        	restFields()[i * 2 + 1] = (unit & 0xFF00) >> 8;
+        }
         return true;
     }
 
@@ -455,6 +678,70 @@ private:
 };
 
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! Interface Association (ECN "Interface Association Descriptors"): объединяет
+//! интерфейсы first..first+count-1 в одну функцию составного устройства.
+//! Стоит в конфигурации перед первым интерфейсом функции, устройству нужен
+//! класс 0xEF/0x02/0x01 (Miscellaneous / Common Class / IAD).
+class UsbIfaceAssocDescriptor :
+        public UsbDescriptor
+{
+public:
+	static const uint8_t SIZE = 8;
+
+    UsbIfaceAssocDescriptor(uint8_t * data, uint16_t length) :
+        UsbDescriptor(data, length)
+    {}
+
+    inline bool init(uint8_t firstIface,
+                     uint8_t ifaceCount,
+                     uint8_t functionClass,
+                     uint8_t functionSubClass,
+                     uint8_t functionProtocol,
+                     const UsbStringDescriptor & functionStr)
+    {
+    	if(!UsbDescriptor::init(SIZE, UsbDescType_InterfaceAssociation))
+    		return false;
+    	fields()->bFirstInterface = firstIface;
+    	fields()->bInterfaceCount = ifaceCount;
+    	fields()->bFunctionClass = functionClass;
+    	fields()->bFunctionSubClass = functionSubClass;
+    	fields()->bFunctionProtocol = functionProtocol;
+    	fields()->iFunction = functionStr.idx();
+    	return true;
+    }
+
+    inline uint8_t	bFirstInterface() const { return fields()->bFirstInterface; }
+
+    inline uint8_t	bInterfaceCount() const { return fields()->bInterfaceCount; }
+
+    inline uint8_t	bFunctionClass() const { return fields()->bFunctionClass; }
+
+    inline uint8_t	bFunctionSubClass() const { return fields()->bFunctionSubClass; }
+
+    inline uint8_t	bFunctionProtocol() const { return fields()->bFunctionProtocol; }
+
+    inline uint8_t	iFunction() const { return fields()->iFunction; }
+
+private:
+    typedef struct __packed
+    {
+        uint8_t	bFirstInterface;
+        uint8_t	bInterfaceCount;
+        uint8_t	bFunctionClass;
+        uint8_t	bFunctionSubClass;
+        uint8_t	bFunctionProtocol;
+        uint8_t	iFunction;
+    }
+    IfaceAssocDescriptorFields;
+
+    inline IfaceAssocDescriptorFields * fields() const
+    {
+    	return reinterpret_cast<IfaceAssocDescriptorFields*>(restFields());
+    }
+};
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 class UsbInterfaceDescriptor :
@@ -528,6 +815,31 @@ public:
             return false;
         _totalLength = new_length;
         ++fields()->bNumEndpoints;
+        return bindEP(ep);
+    }
+
+    //! Дескриптор точки address среди дескрипторов, следующих за интерфейсом
+    //! в готовом дескрипторе конфигурации (до следующего интерфейса)
+    inline UsbEPDescriptor findEP(uint8_t address) const
+    {
+        if(!isValid())
+            return UsbEPDescriptor(nullptr, 0);
+        for(uint16_t pos = bLength(); pos + 2 < size(); pos += data()[pos])
+        {
+            if((data()[pos] < 2) || (data()[pos + 1] == UsbDescType_Interface))
+                break;
+            if((data()[pos + 1] == UsbDescType_Endpoint) && (data()[pos + 2] == address))
+                return UsbEPDescriptor(data() + pos, size() - pos);
+        }
+        return UsbEPDescriptor(nullptr, 0);
+    }
+
+    //! Привязывает уже готовый дескриптор точки (например, во flash)
+    //! без изменения данных интерфейса
+    inline bool bindEP(UsbEPDescriptor & ep)
+    {
+        if(!ep.isValid())
+            return false;
 
         if(ep.bEndpointAddress() & 0x80)
         	_inEps[ep.bEndpointAddress() & 0x0F] = &ep;
@@ -643,6 +955,66 @@ public:
         return true;
     }
 
+    inline UsbIfaceAssocDescriptor beginAssociation() const
+    {
+        uint16_t totalLength = wTotalLength();
+        if(totalLength >= size())
+            return UsbIfaceAssocDescriptor(nullptr, 0);
+        return UsbIfaceAssocDescriptor(data() + totalLength,
+                                       size() - totalLength);
+    }
+
+    inline bool endAssociation(const UsbIfaceAssocDescriptor & iad) const
+    {
+        if(!iad.isValid())
+            return false;
+        uint16_t new_length = fields()->wTotalLength + iad.bLength();
+        if(new_length > size())
+            return false;
+        fields()->wTotalLength = new_length;
+        return true;
+    }
+
+    //! Альтернативная настройка уже учтённого интерфейса: bNumInterfaces не меняется
+    inline bool endAlternate(const UsbInterfaceDescriptor & alt) const
+    {
+        if(!alt.isValid())
+            return false;
+        uint16_t new_length = fields()->wTotalLength + alt.totalLength();
+        if(new_length > size())
+            return false;
+        fields()->wTotalLength = new_length;
+        return true;
+    }
+
+    //! Дескриптор интерфейса number/alt в готовом дескрипторе конфигурации
+    inline UsbInterfaceDescriptor findInterface(uint8_t number, uint8_t alt = 0) const
+    {
+        uint16_t totalLength = (wTotalLength() < size()) ? wTotalLength() : size();
+        for(uint16_t pos = bLength(); pos + 3 < totalLength; pos += data()[pos])
+        {
+            if(data()[pos] < 2)
+                break;
+            if((data()[pos + 1] == UsbDescType_Interface) &&
+               (data()[pos + 2] == number) &&
+               (data()[pos + 3] == alt))
+                return UsbInterfaceDescriptor(data() + pos, totalLength - pos);
+        }
+        return UsbInterfaceDescriptor(nullptr, 0);
+    }
+
+protected:
+    //! Учитывает в заголовке данные, лежащие вне буфера дескриптора
+    inline bool extend(uint16_t length, uint8_t numInterfaces) const
+    {
+        uint32_t new_length = uint32_t(fields()->wTotalLength) + length;
+        if(new_length > 0xFFFF)
+            return false;
+        fields()->wTotalLength = uint16_t(new_length);
+        fields()->bNumInterfaces += numInterfaces;
+        return true;
+    }
+
 private:
     typedef struct __packed
     {
@@ -0,0 +1,482 @@
+#ifndef USBSTATICDESCRIPTORS_H
+#define USBSTATICDESCRIPTORS_H
+
+//! Построение дескрипторов на этапе компиляции. Результат - константный
+//! массив байт, который размещается во flash:
+//!
+//!	static constexpr auto Config =
+//!		usbConfiguration(1, 0, 0x80, 50,
+//!			usbInterface(0, 0, 0xFF, 0, 0, 0,
+//!				usbEndpoint<0x81, UsbEPType_Bulk, 64>() +
+//!				usbEndpoint<0x01, UsbEPType_Bulk, 64>()));
+//!
+//! Ошибки в дескрипторах (длина, номера точек, размеры пакетов,
+//! превышение периодической полосы) обнаруживаются при компиляции.
+//! Остаток полосы - usbPeriodicRemaining(Config, скорость).
+
+#if __cplusplus < 201402L
+#error "usbstaticdescriptors.h requires C++14"
+#endif
+
+#include "usbdescriptors.h"
+#include "XUsbDevice_Config.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! Не имеет определения: вызов при вычислении константы - ошибка компиляции,
+//! вызов во время выполнения - ошибка компоновки
+void usbDescriptorError(const char * msg);
+
+template<uint16_t N>
+struct UsbDescBlob
+{
+	static_assert(N > 0, "empty descriptor");
+
+	uint8_t bytes[N];
+
+	static constexpr uint16_t Size = N;
+
+	constexpr uint16_t size() const { return N; }
+
+	constexpr const uint8_t * data() const { return bytes; }
+
+	constexpr uint8_t operator[](uint16_t idx) const { return bytes[idx]; }
+};
+
+template<uint16_t N, uint16_t M>
+constexpr UsbDescBlob<N + M> operator+(const UsbDescBlob<N> & a, const UsbDescBlob<M> & b)
+{
+	static_assert(uint32_t(N) + M <= 0xFFFF, "descriptor exceeds 65535 bytes");
+
+	UsbDescBlob<N + M> result {};
+	for(uint16_t i = 0; i < N; ++i)
+		result.bytes[i] = a.bytes[i];
+	for(uint16_t i = 0; i < M; ++i)
+		result.bytes[N + i] = b.bytes[i];
+	return result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! Проверяет цепочку дескрипторов и считает дескрипторы типа type.
+//! Для интерфейсов учитываются только основные настройки (bAlternateSetting == 0).
+template<uint16_t N>
+constexpr uint8_t usbCountDescriptors(const UsbDescBlob<N> & blob, uint8_t type)
+{
+	uint8_t count = 0;
+	uint16_t pos = 0;
+	while(pos < N)
+	{
+		uint8_t length = blob.bytes[pos];
+		if((length < 2) || (uint32_t(pos) + length > N))
+		{
+			usbDescriptorError("malformed descriptor chain");
+			return count;
+		}
+
+		if((blob.bytes[pos + 1] == type) &&
+			((type != UsbDescType_Interface) || (blob.bytes[pos + 3] == 0)))
+			++count;
+		pos += length;
+	}
+	return count;
+}
+
+//! Допустимый wMaxPacketSize для типа точки и скорости (USB 2.0, 5.5.3 - 5.8.3).
+//! Биты 12..11 (дополнительные транзакции) разрешены только для периодических
+//! точек на high-speed.
+constexpr bool usbMaxPacketValid(UsbEPType type, uint16_t maxPacket, UsbSpeedClass speed)
+{
+	uint16_t size = maxPacket & 0x07FF;
+	uint8_t extra = (maxPacket >> 11) & 0x03;
+
+	if((maxPacket & 0xE000) || (size == 0) || (extra == 3))
+		return false;
+
+	bool periodic = (type == UsbEPType_Isochronous) || (type == UsbEPType_Interrupt);
+	if(extra && ((speed != UsbSpeed_High) || !periodic))
+		return false;
+
+	switch(type)
+	{
+	case UsbEPType_Control:
+		return (speed == UsbSpeed_High) ? (size == 64) :
+			   ((size == 8) || (size == 16) || (size == 32) || (size == 64));
+
+	case UsbEPType_Bulk:
+		return (speed == UsbSpeed_High) ? (size == 512) :
+			   ((size == 8) || (size == 16) || (size == 32) || (size == 64));
+
+	case UsbEPType_Interrupt:
+		return size <= ((speed == UsbSpeed_High) ? 1024 : 64);
+
+	case UsbEPType_Isochronous:
+		return size <= ((speed == UsbSpeed_High) ? 1024 : 1023);
+	}
+	return false;
+}
+
+//! Скорость, которой требуют точки дескриптора: high, если хотя бы
+//! одна недопустима на full-speed
+template<uint16_t N>
+constexpr UsbSpeedClass usbRequiredSpeed(const UsbDescBlob<N> & blob)
+{
+	for(uint16_t pos = 0; pos < N; pos += blob.bytes[pos])
+		if((blob.bytes[pos + 1] == UsbDescType_Endpoint) &&
+		   !usbMaxPacketValid(UsbEPType(blob.bytes[pos + 3] & 0x03),
+							  uint16_t(blob.bytes[pos + 4] | (blob.bytes[pos + 5] << 8)),
+							  UsbSpeed_Full))
+			return UsbSpeed_High;
+	return UsbSpeed_Full;
+}
+
+//! Остаток периодической полосы (микро)кадра на скорости speed, байт.
+//! Интерфейс занимает наибольшую нагрузку среди своих альтернативных настроек.
+//! Отрицательное значение - превышение.
+template<uint16_t N>
+constexpr int32_t usbPeriodicRemaining(const UsbDescBlob<N> & blob, UsbSpeedClass speed)
+{
+	uint16_t ifaceLoad[256] = {};
+	uint8_t iface = 0;
+	uint16_t altLoad = 0;
+	for(uint16_t pos = 0; pos < N; pos += blob.bytes[pos])
+	{
+		if(blob.bytes[pos + 1] == UsbDescType_Interface)
+		{
+			iface = blob.bytes[pos + 2];
+			altLoad = 0;
+		}
+		else if(blob.bytes[pos + 1] == UsbDescType_Endpoint)
+		{
+			altLoad += usbPeriodicBytes(blob.bytes[pos + 3],
+										uint16_t(blob.bytes[pos + 4] | (blob.bytes[pos + 5] << 8)),
+										speed);
+			if(altLoad > ifaceLoad[iface])
+				ifaceLoad[iface] = altLoad;
+		}
+	}
+
+	int32_t remaining = usbPeriodicBudget(speed);
+	for(uint16_t i = 0; i < 256; ++i)
+		remaining -= ifaceLoad[i];
+	return remaining;
+}
+
+//! Адрес точки может повторяться только в разных альтернативных
+//! настройках одного интерфейса
+template<uint16_t N>
+constexpr bool usbEndpointsUnique(const UsbDescBlob<N> & blob)
+{
+	uint8_t iface = 0xFF;
+	uint8_t alt = 0;
+	uint16_t pos = 0;
+	while(pos < N)
+	{
+		if(blob.bytes[pos + 1] == UsbDescType_Interface)
+		{
+			iface = blob.bytes[pos + 2];
+			alt = blob.bytes[pos + 3];
+		}
+		else if(blob.bytes[pos + 1] == UsbDescType_Endpoint)
+		{
+			uint8_t other_iface = 0xFF;
+			uint8_t other_alt = 0;
+			uint16_t other = 0;
+			while(other < pos)
+			{
+				if(blob.bytes[other + 1] == UsbDescType_Interface)
+				{
+					other_iface = blob.bytes[other + 2];
+					other_alt = blob.bytes[other + 3];
+				}
+				else if((blob.bytes[other + 1] == UsbDescType_Endpoint) &&
+						 (blob.bytes[other + 2] == blob.bytes[pos + 2]) &&
+						 ((other_iface != iface) || (other_alt == alt)))
+					return false;
+				other += blob.bytes[other];
+			}
+		}
+		pos += blob.bytes[pos];
+	}
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+constexpr UsbDescBlob<UsbDeviceDescriptor::SIZE> usbDevice(uint16_t bcd,
+														   uint8_t deviceClass,
+														   uint8_t deviceSubClass,
+														   uint8_t deviceProtocol,
+														   uint8_t maxPacketSize,
+														   uint16_t vendorID,
+														   uint16_t productID,
+														   uint16_t bcdDev,
+														   uint8_t manufacturerStr,
+														   uint8_t productStr,
+														   uint8_t serial,
+														   uint8_t numConfigs)
+{
+	if((maxPacketSize != 8) && (maxPacketSize != 16) &&
+		(maxPacketSize != 32) && (maxPacketSize != 64))
+		usbDescriptorError("bMaxPacketSize0 must be 8, 16, 32 or 64");
+
+	return UsbDescBlob<UsbDeviceDescriptor::SIZE>
+	{{
+		UsbDeviceDescriptor::SIZE, UsbDescType_Device,
+		uint8_t(bcd), uint8_t(bcd >> 8),
+		deviceClass, deviceSubClass, deviceProtocol, maxPacketSize,
+		uint8_t(vendorID), uint8_t(vendorID >> 8),
+		uint8_t(productID), uint8_t(productID >> 8),
+		uint8_t(bcdDev), uint8_t(bcdDev >> 8),
+		manufacturerStr, productStr, serial, numConfigs
+	}};
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<uint8_t Address,
+		 UsbEPType Type,
+		 uint16_t MaxPacket,
+		 uint8_t Interval = 0,
+		 UsbSpeedClass Speed = UsbSpeed_Full,
+		 uint8_t Attributes = 0>
+constexpr UsbDescBlob<UsbEPDescriptor::DEFAULT_LENGTH> usbEndpoint()
+{
+	static_assert(((Address & 0x70) == 0) && ((Address & 0x0F) != 0),
+				  "endpoint number must be 1..15");
+	static_assert((Address & 0x0F) < UsbInterfaceDescriptor::MaxEndpoints,
+				  "endpoint number exceeds UsbInterfaceDescriptor::MaxEndpoints");
+	static_assert(Type != UsbEPType_Control, "control endpoints besides EP0 are not supported");
+	static_assert(usbMaxPacketValid(Type, MaxPacket, Speed),
+				  "wMaxPacketSize is not valid for this endpoint type and speed");
+	static_assert((Type != UsbEPType_Isochronous) || ((Interval >= 1) && (Interval <= 16)),
+				  "isochronous bInterval must be 1..16");
+	static_assert((Type != UsbEPType_Interrupt) || (Interval >= 1),
+				  "interrupt bInterval must not be 0");
+	static_assert((Type != UsbEPType_Interrupt) || (Speed != UsbSpeed_High) || (Interval <= 16),
+				  "high-speed interrupt bInterval must be 1..16");
+
+	return UsbDescBlob<UsbEPDescriptor::DEFAULT_LENGTH>
+	{{
+		UsbEPDescriptor::DEFAULT_LENGTH, UsbDescType_Endpoint,
+		Address, uint8_t(Type | Attributes),
+		uint8_t(MaxPacket), uint8_t(MaxPacket >> 8),
+		Interval
+	}};
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! Произвольный (например, class-specific) дескриптор из байт после заголовка
+template<typename... Bytes>
+constexpr UsbDescBlob<2 + sizeof...(Bytes)> usbDescriptor(uint8_t type, Bytes... bytes)
+{
+	static_assert(2 + sizeof...(Bytes) <= 0xFF, "descriptor exceeds 255 bytes");
+
+	return UsbDescBlob<2 + sizeof...(Bytes)>
+	{{
+		uint8_t(2 + sizeof...(Bytes)), type, uint8_t(bytes)...
+	}};
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+constexpr UsbDescBlob<9> usbInterface(uint8_t ifaceNumber,
+									  uint8_t altSetting,
+									  uint8_t ifaceClass,
+									  uint8_t ifaceSubClass,
+									  uint8_t protocol,
+									  uint8_t ifaceStr,
+									  uint8_t numEndpoints = 0)
+{
+	return UsbDescBlob<9>
+	{{
+		9, UsbDescType_Interface,
+		ifaceNumber, altSetting, numEndpoints,
+		ifaceClass, ifaceSubClass, protocol, ifaceStr
+	}};
+}
+
+//! Интерфейс с вложенными дескрипторами (class-specific, точки),
+//! bNumEndpoints вычисляется по содержимому
+template<uint16_t N>
+constexpr UsbDescBlob<9 + N> usbInterface(uint8_t ifaceNumber,
+										  uint8_t altSetting,
+										  uint8_t ifaceClass,
+										  uint8_t ifaceSubClass,
+										  uint8_t protocol,
+										  uint8_t ifaceStr,
+										  const UsbDescBlob<N> & body)
+{
+	return usbInterface(ifaceNumber, altSetting, ifaceClass, ifaceSubClass, protocol, ifaceStr,
+						usbCountDescriptors(body, UsbDescType_Endpoint)) + body;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! Interface Association: функция составного устройства из ifaceCount
+//! интерфейсов начиная с firstIface
+constexpr UsbDescBlob<8> usbInterfaceAssociation(uint8_t firstIface,
+												 uint8_t ifaceCount,
+												 uint8_t functionClass,
+												 uint8_t functionSubClass,
+												 uint8_t functionProtocol,
+												 uint8_t functionStr)
+{
+	return usbDescriptor(UsbDescType_InterfaceAssociation, firstIface, ifaceCount,
+						 functionClass, functionSubClass, functionProtocol, functionStr);
+}
+
+//! Функция вместе с её интерфейсами: bFirstInterface и bInterfaceCount
+//! вычисляются по содержимому, номера интерфейсов должны идти подряд
+//!
+//!	usbFunction(0x02, 0x02, 0x01, 0,
+//!		usbInterface(0, 0, 0x02, 0x02, 0x01, 0, ...) +
+//!		usbInterface(1, 0, 0x0A, 0x00, 0x00, 0, ...))
+//!
+//! Дескриптору устройства нужен класс 0xEF/0x02/0x01.
+template<uint16_t N>
+constexpr UsbDescBlob<8 + N> usbFunction(uint8_t functionClass,
+										 uint8_t functionSubClass,
+										 uint8_t functionProtocol,
+										 uint8_t functionStr,
+										 const UsbDescBlob<N> & body)
+{
+	uint8_t count = usbCountDescriptors(body, UsbDescType_Interface);
+	if((count == 0) || (body.bytes[1] != UsbDescType_Interface))
+		usbDescriptorError("function must start with an interface descriptor");
+
+	uint8_t first = body.bytes[2];
+	for(uint16_t pos = 0; pos < N; pos += body.bytes[pos])
+		if((body.bytes[pos + 1] == UsbDescType_Interface) &&
+		   ((body.bytes[pos + 2] < first) || (body.bytes[pos + 2] >= first + count)))
+			usbDescriptorError("function interfaces must be numbered consecutively");
+
+	return usbInterfaceAssociation(first, count, functionClass, functionSubClass,
+								   functionProtocol, functionStr) + body;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! Полный дескриптор конфигурации. wTotalLength и bNumInterfaces
+//! вычисляются по содержимому.
+template<uint16_t N>
+constexpr UsbDescBlob<9 + N> usbConfiguration(uint8_t configValue,
+											  uint8_t configStr,
+											  uint8_t attributes,
+											  uint8_t maxPower,
+											  const UsbDescBlob<N> & body)
+{
+	static_assert(9 + uint32_t(N) <= 0xFFFF, "wTotalLength exceeds 65535 bytes");
+
+	uint8_t numInterfaces = usbCountDescriptors(body, UsbDescType_Interface);
+	if(numInterfaces > USB_MAX_INTERFACES)
+		usbDescriptorError("too many interfaces for USB_MAX_INTERFACES");
+	if(!usbEndpointsUnique(body))
+		usbDescriptorError("endpoint address used twice in one configuration");
+	if(usbPeriodicRemaining(body, usbRequiredSpeed(body)) < 0)
+		usbDescriptorError("isochronous/interrupt bandwidth exceeds the periodic limit of a (micro)frame");
+	if((attributes & 0x80) == 0)
+		usbDescriptorError("bmAttributes bit 7 must be set");
+
+	return UsbDescBlob<9>
+	{{
+		9, UsbDescType_Configuration,
+		uint8_t(9 + N), uint8_t((9 + N) >> 8),
+		numInterfaces, configValue, configStr, attributes, maxPower
+	}} + body;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! Дескриптор строки из UTF-16 литерала: usbString(u"Устройство")
+template<uint16_t N>
+constexpr UsbDescBlob<2 * N> usbString(const char16_t (&str)[N])
+{
+	static_assert(2 * N <= 0xFF, "string descriptor exceeds 255 bytes");
+
+	UsbDescBlob<2 * N> result {};
+	result.bytes[0] = 2 * N;
+	result.bytes[1] = UsbDescType_String;
+	for(uint16_t i = 0; i + 1 < N; ++i)
+	{
+		result.bytes[2 + i * 2] = uint8_t(str[i]);
+		result.bytes[3 + i * 2] = uint8_t(str[i] >> 8);
+	}
+	return result;
+}
+
+//! Дескриптор строки из ASCII литерала. Для остальных символов нужен u"" литерал.
+template<uint16_t N>
+constexpr UsbDescBlob<2 * N> usbString(const char (&str)[N])
+{
+	static_assert(2 * N <= 0xFF, "string descriptor exceeds 255 bytes");
+
+	UsbDescBlob<2 * N> result {};
+	result.bytes[0] = 2 * N;
+	result.bytes[1] = UsbDescType_String;
+	for(uint16_t i = 0; i + 1 < N; ++i)
+	{
+		if(uint8_t(str[i]) & 0x80)
+			usbDescriptorError("non-ASCII character, use a u\"\" literal");
+		result.bytes[2 + i * 2] = uint8_t(str[i]);
+	}
+	return result;
+}
+
+//! Дескриптор строки 0 - список поддерживаемых языков
+template<typename... LangIDs>
+constexpr UsbDescBlob<2 + 2 * sizeof...(LangIDs)> usbLanguages(LangIDs... langIDs)
+{
+	const uint16_t ids[] = { uint16_t(langIDs)... };
+
+	UsbDescBlob<2 + 2 * sizeof...(LangIDs)> result {};
+	result.bytes[0] = 2 + 2 * sizeof...(LangIDs);
+	result.bytes[1] = UsbDescType_String;
+	for(uint16_t i = 0; i < sizeof...(LangIDs); ++i)
+	{
+		result.bytes[2 + i * 2] = uint8_t(ids[i]);
+		result.bytes[3 + i * 2] = uint8_t(ids[i] >> 8);
+	}
+	return result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//! USB 2.0 Extension для BOS, attributes - UsbLpmAttributes и рекомендуемые BESL:
+//!	usbUsb20Extension(UsbLpm_Supported | UsbLpm_BESL | UsbLpm_BaselineValid | (4 << 8))
+constexpr UsbDescBlob<7> usbUsb20Extension(uint32_t attributes)
+{
+	if((attributes & UsbLpm_BESL) && !(attributes & UsbLpm_Supported))
+		usbDescriptorError("BESL requires LPM support bit");
+	if((attributes & (UsbLpm_BaselineValid | UsbLpm_DeepValid)) && !(attributes & UsbLpm_BESL))
+		usbDescriptorError("recommended BESL values require the BESL bit");
+
+	return usbDescriptor(UsbDescType_DeviceCapability, UsbDevCap_USB20Extension,
+						 uint8_t(attributes), uint8_t(attributes >> 8),
+						 uint8_t(attributes >> 16), uint8_t(attributes >> 24));
+}
+
+//! Binary Object Store: заголовок и дескрипторы возможностей устройства.
+//! Хост запрашивает BOS, только если bcdUSB в дескрипторе устройства не меньше 0x0201.
+template<uint16_t N>
+constexpr UsbDescBlob<5 + N> usbBOS(const UsbDescBlob<N> & capabilities)
+{
+	static_assert(5 + uint32_t(N) <= 0xFFFF, "wTotalLength exceeds 65535 bytes");
+
+	uint8_t numCaps = usbCountDescriptors(capabilities, UsbDescType_DeviceCapability);
+	uint8_t total = 0;
+	for(uint16_t pos = 0; pos < N; pos += capabilities[pos])
+		++total;
+	if(total != numCaps)
+		usbDescriptorError("BOS may contain only device capability descriptors");
+
+	return UsbDescBlob<5>
+	{{
+		5, UsbDescType_BOS,
+		uint8_t(5 + N), uint8_t((5 + N) >> 8),
+		numCaps
+	}} + capabilities;
+}
+
+#endif // USBSTATICDESCRIPTORS_H